@@ -0,0 +1,132 @@
+//********************************************************
+/**
+ * @file  AuthCache.hh
+ *
+ * @brief Http authentification results cache (sharded, bounded)
+ *
+ * @author agent (agent@local)
+ *
+ * @version 1
+ * @date 19/10/26
+ */
+//********************************************************
+
+#ifndef AUTHCACHE_HH_
+#define AUTHCACHE_HH_
+
+#ifdef USE_USTL
+
+#include <libnavajo/with_ustl.h>
+
+#else
+
+#include <string>
+#include <map>
+#include <list>
+#include <libnavajo/with_ustl.h>
+
+#endif // USE_USTL
+
+#include <time.h>
+#include <pthread.h>
+
+#define AUTH_CACHE_SHARDS 16
+#define AUTH_CACHE_KEY_LENGTH 32 // SHA-256
+
+/**
+* The result of a cache lookup
+*/
+typedef enum
+{
+  AUTH_CACHE_MISS = 0,
+  AUTH_CACHE_ALLOWED,
+  AUTH_CACHE_DENIED
+} AuthCacheResult;
+
+/**
+* AuthCacheStats - authentification cache statistics
+*/
+typedef struct
+{
+  unsigned long hits;
+  unsigned long misses;
+  size_t entries;    // number of cached results
+} AuthCacheStats;
+
+/**
+* AuthCache - the results of the credentials verifications. The credentials
+* are not kept: the entries are found by a hash of them, salted with a
+* random value drawn at startup. The successful and failed verifications
+* have their own lifetimes, and the least recently used entries are
+* evicted once a shard is full.
+*/
+class AuthCache
+{
+    struct Entry
+    {
+      bool allowed;
+      nw::string username;
+      time_t expiration;
+      nw::list<nw::string>::iterator lruIt;
+    };
+
+    typedef nw::map<nw::string, Entry> EntriesMap;
+
+    struct Shard
+    {
+      pthread_mutex_t mutex;
+      EntriesMap entries;
+      nw::list<nw::string> lru; // least recently used first
+    };
+
+    Shard shards[AUTH_CACHE_SHARDS];
+    size_t maxEntriesPerShard;
+    time_t allowedTimeout, deniedTimeout;
+    unsigned char salt[AUTH_CACHE_KEY_LENGTH];
+
+    volatile unsigned long hits, misses;
+
+    AuthCache(const AuthCache&);
+    AuthCache& operator=(const AuthCache&);
+
+    inline Shard& getShard(const nw::string& key)
+      { return shards[(unsigned char)key[0] % AUTH_CACHE_SHARDS]; };
+
+  public:
+    AuthCache();
+    ~AuthCache();
+
+    /**
+    * Configure the cache, before its use
+    * @param maxEntries: the maximum number of cached results, 0 to disable the cache
+    * @param allowedTimeout: the lifetime of the successful verifications, in seconds
+    * @param deniedTimeout: the lifetime of the failed verifications, in seconds
+    */
+    void setup(const size_t maxEntries, const time_t allowedTimeout, const time_t deniedTimeout);
+
+    /**
+    * @param credentials: the credentials, as sent by the client
+    * @return the cache key of the credentials (a salted hash)
+    */
+    nw::string getKey(const nw::string& credentials) const;
+
+    /**
+    * Look for a verification result
+    * @param key: the cache key of the credentials
+    * @param username: set to the user name if found
+    * @return AUTH_CACHE_MISS if not found (or expired)
+    */
+    AuthCacheResult lookup(const nw::string& key, nw::string& username);
+
+    /**
+    * Record a verification result
+    * @param key: the cache key of the credentials
+    * @param username: the user name
+    * @param allowed: the result
+    */
+    void store(const nw::string& key, const nw::string& username, const bool allowed);
+
+    void getStats(AuthCacheStats& stats);
+};
+
+#endif
@@ -28,6 +28,21 @@
 #include <ctype.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <time.h>
+
+#ifdef USE_USTL
+
+#include <libnavajo/with_ustl.h>
+
+#else
+
+#include <string>
+#include <map>
+#include <libnavajo/with_ustl.h>
+
+#endif // USE_USTL
+
+#include <pthread.h>
 
 
 
@@ -52,5 +67,42 @@ class AuthPAM
 
 };
 
+/**
+* AuthPAMVerifications - the PAM verifications in progress: a request verifies
+* the credentials on its own thread, and the requests for the same
+* credentials meanwhile wait for its result.
+*/
+class AuthPAMVerifications
+{
+	struct Verification
+	{
+	  bool done, allowed;
+	  unsigned refs;
+	};
+
+	nw::map<nw::string, Verification*> verifications; // by key, until done
+	pthread_mutex_t mutex;
+	pthread_cond_t doneCond;
+
+	AuthPAMVerifications(const AuthPAMVerifications&);
+	AuthPAMVerifications& operator=(const AuthPAMVerifications&);
+
+  public:
+	AuthPAMVerifications();
+	~AuthPAMVerifications();
+
+	/**
+	* Verify a login/password, or wait for the result of the same verification
+	* @param key: identifies the credentials
+	* @param username: the login
+	* @param password: the password
+	* @param service: the pam configuration file
+	* @param timeout: the maximum delay to wait for the verification of another
+	*   request, in seconds
+	* @return 1 if authenticated, 0 if failed, -1 if the delay has expired
+	*/
+	int authentificate(const nw::string& key, const char *username, const char *password, const char *service, const time_t timeout);
+};
+
 #endif
 
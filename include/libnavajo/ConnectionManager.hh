@@ -0,0 +1,145 @@
+//********************************************************
+/**
+ * @file  ConnectionManager.hh
+ *
+ * @brief Connections limits (total and per ip address)
+ *        and read deadlines (timer wheel)
+ *
+ * @author agent (agent@local)
+ *
+ * @version 1
+ * @date 19/10/26
+ */
+//********************************************************
+
+#ifndef CONNECTIONMANAGER_HH_
+#define CONNECTIONMANAGER_HH_
+
+#ifdef USE_USTL
+
+#include <libnavajo/with_ustl.h>
+
+#else
+
+#include <map>
+#include <libnavajo/with_ustl.h>
+
+#endif // USE_USTL
+
+#include <time.h>
+#include <pthread.h>
+
+#include "libnavajo/IpAddress.hh"
+
+#define CONNECTION_TIMER_WHEEL_SLOTS 256  // power of two
+#define CONNECTION_TIMER_WHEEL_TICK 250   // ms
+
+/**
+* ConnectionTimer - the read deadline of a connection, linked in a slot of
+* the timer wheel while it is armed
+*/
+typedef struct ConnectionTimer
+{
+  struct ConnectionTimer *prev, *next;
+  int socketId;
+  unsigned long long expiration; // tick
+  bool armed;
+} ConnectionTimer;
+
+class ConnectionManager
+{
+    size_t maxConnections, maxConnectionsPerIp;
+    volatile size_t nbConnections;
+    nw::map<IpAddress,size_t> connectionsPerIp;
+    pthread_mutex_t connectionsPerIp_mutex;
+
+    ConnectionTimer wheel[CONNECTION_TIMER_WHEEL_SLOTS]; // lists heads
+    unsigned long long currentTick;
+    bool closing;
+    volatile bool running;
+    pthread_t thread;
+    pthread_mutex_t wheel_mutex;
+    pthread_cond_t wheel_cond;
+
+    ConnectionManager(const ConnectionManager&);
+    ConnectionManager& operator=(const ConnectionManager&);
+
+    static unsigned long long getTick();
+    static void unlink(ConnectionTimer &timer);
+    static void expire(ConnectionTimer &timer);
+    void expireTimers(const unsigned long long tick);
+    static void* startThread(void* );
+    void threadProcessing();
+
+  public:
+    ConnectionManager();
+    ~ConnectionManager();
+
+    /**
+    * Set the maximum number of connections
+    * @param n: the connections count, 0 for no limit
+    */
+    inline void setMaxConnections(const size_t n) { maxConnections=n; };
+
+    /**
+    * Set the maximum number of connections from an ip address
+    * @param n: the connections count, 0 for no limit
+    */
+    inline void setMaxConnectionsPerIp(const size_t n) { maxConnectionsPerIp=n; };
+
+    /**
+    * @return the number of open connections
+    */
+    inline size_t getConnectionsCount() const { return nbConnections; };
+
+    /**
+    * A new connection
+    * @param ip: the client address
+    * @return false if a limit is reached (the connection must be closed)
+    */
+    bool acquire(const IpAddress& ip);
+
+    /**
+    * A connection, accepted by acquire(), is closed
+    * @param ip: the client address
+    */
+    void release(const IpAddress& ip);
+
+    inline static void initTimer(ConnectionTimer &timer, const int socketId)
+    {
+      timer.prev=timer.next=NULL;
+      timer.socketId=socketId;
+      timer.expiration=0;
+      timer.armed=false;
+    };
+
+    /**
+    * Set the read deadline of a connection: once expired, the socket is shut
+    * down for reading, so the blocked reads return.
+    * @param timer: the connection's timer
+    * @param seconds: the delay, 0 for no deadline
+    */
+    void setDeadline(ConnectionTimer &timer, const time_t seconds);
+
+    /**
+    * Remove the read deadline of a connection (before the socket is closed)
+    */
+    void cancelDeadline(ConnectionTimer &timer);
+
+    /**
+    * Start the timer wheel thread
+    */
+    void start();
+
+    /**
+    * Expire all the deadlines, now and until the next start (server exiting)
+    */
+    void shutdownConnections();
+
+    /**
+    * Stop the timer wheel thread
+    */
+    void stop();
+};
+
+#endif
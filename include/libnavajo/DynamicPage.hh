@@ -66,7 +66,7 @@ class DynamicPage
     {
       size_t webpageLen;
       unsigned char *webpage;
-      if ( (webpage = (unsigned char *)malloc( resultat.size()+1 * sizeof(char))) == NULL )
+      if ( (webpage = response->allocateContent( resultat.size()+1 * sizeof(char))) == NULL )
           return false;
       webpageLen=resultat.size();
       strcpy ((char *)webpage, resultat.c_str());
@@ -21,54 +21,186 @@
 #else
 
 #include <string>
+#include <vector>
 #include <map>
 #include <libnavajo/with_ustl.h>
 
 #endif // USE_USTL
 
+#include <stdlib.h>
+
 #include "libnavajo/WebRepository.hh"
 
+class DynamicPage;
 
+/**
+* DynamicRepository - dynamic pages, routed by a radix tree.
+*
+* The routes are urls, which can contain:
+*   - parameters matching a path segment: "api/sensors/{id}/values"
+*   - a final '*' wildcard, matching the rest of the url
+* Static segments have priority over parameters, which have priority over
+* wildcards. The parameters are available with HttpRequest::getPathParameter()
+* ("*" for the wildcard).
+*
+* HEAD requests are handled by the GET pages (unless a HEAD page is added),
+* and OPTIONS requests are answered automatically (unless an OPTIONS page is
+* added), with the route's CORS policy if any.
+*
+* The GET/HEAD responses of a route can be cached (setCachePolicy), for pages
+* polled by many clients whose output changes slowly. The output must only
+* depend on the url and on the parameters/headers of the cache key (not on
+* the session, for instance).
+*
+* Routes must be added before the webserver is started: the lookups are
+* done without any lock.
+*/
 class DynamicRepository : public WebRepository
 {
+  public:
+    /**
+    * CorsPolicy - the Cross Origin Resource Sharing rules of a route, used for
+    * the preflight (OPTIONS) responses and the actual responses
+    */
+    struct CorsPolicy
+    {
+      nw::string allowedOrigin;  // "*" or an origin ("https://example.org")
+      bool allowCredentials;
+      nw::string allowedHeaders; // "" : the requested headers are allowed
+      time_t maxAge;             // preflight cache duration (seconds), 0: not set
 
-    pthread_mutex_t _mutex;
-    typedef nw::map<nw::string, DynamicPage *> IndexMap;
-    IndexMap indexMap;
+      CorsPolicy(const nw::string& origin="*", const bool credentials=false, const nw::string& headers="", const time_t age=0):
+        allowedOrigin(origin), allowCredentials(credentials), allowedHeaders(headers), maxAge(age) {};
+    };
 
-  public:
-    DynamicRepository() { pthread_mutex_init(&_mutex, NULL); };
-    virtual ~DynamicRepository() { indexMap.clear(); };
+    /**
+    * CachePolicy - the response cache rules of a route
+    */
+    struct CachePolicy
+    {
+      time_t ttl;                           // entries lifetime (seconds)
+      bool serveStale;                      // serve an expired entry while a thread regenerates it
+      size_t maxEntries;
+      nw::vector<nw::string> keyParameters; // the request parameters in the cache key (with the url)
+      nw::vector<nw::string> keyHeaders;    // the request headers in the cache key
+
+      CachePolicy(const time_t t=1, const bool stale=true, const size_t max=1024):
+        ttl(t), serveStale(stale), maxEntries(max) {};
+      inline CachePolicy& addKeyParameter(const nw::string& name) { keyParameters.push_back(name); return *this; };
+      inline CachePolicy& addKeyHeader(const nw::string& name) { keyHeaders.push_back(name); return *this; };
+    };
 
-    inline void freeFile(unsigned char *webpage) { ::free (webpage); };
+  private:
+    struct CacheEntry
+    {
+      unsigned char *content, *gzipContent;  // gzipContent: NULL if not worth it
+      size_t contentLength, gzipContentLength;
+      bool zipped;
+      nw::string mimeType;
+      nw::vector<nw::string> headers;
+      bool cors, corsCred;
+      nw::string corsDomain;
+      time_t expiration;
+      bool updating;                         // being regenerated by a thread
+
+      CacheEntry(): content(NULL), gzipContent(NULL), contentLength(0), gzipContentLength(0), zipped(false),
+                    cors(false), corsCred(false), expiration(0), updating(false) {};
+      ~CacheEntry() { free(content); free(gzipContent); };
+    };
 
-    inline void add(nw::string url, DynamicPage *page)
+    struct ResponseCache
     {
-      size_t i=0;
-      while (url.size() && url[i]=='/') i++;
-      indexMap.insert(nw::pair<nw::string, DynamicPage *>(url.substr(i, url.size()-i), page)); };
+      CachePolicy policy;
+      pthread_mutex_t mutex;
+      pthread_cond_t updated;
+      nw::map<nw::string, CacheEntry*> entries;
+
+      ResponseCache(const CachePolicy& p): policy(p)
+        { pthread_mutex_init(&mutex, NULL); pthread_cond_init(&updated, NULL); };
+      ~ResponseCache();
+    };
 
-    inline virtual bool getFile(HttpRequest* request, HttpResponse *response)
+    struct RouteNode
     {
-      nw::string url = request->getUrl();
-      while (url.size() && url[0]=='/') url.erase(0, 1);
-      pthread_mutex_lock( &_mutex );
-      IndexMap::const_iterator i = indexMap.find (url);
-      if (i == indexMap.end())
-      {
-        pthread_mutex_unlock( &_mutex );
-        return false;
-      }
-      else
-      {
-        pthread_mutex_unlock( &_mutex );
-        bool res = i->second->getPage( request, response );
-        if (request->getSessionId().size())
-          response->addSessionCookie(request->getSessionId());
-        return res;
-      }
+      nw::string label;                   // static part (radix compressed)
+      nw::vector<RouteNode *> children;   // static children, distinct first chars
+      RouteNode *paramChild;              // "{name}" child
+      nw::string paramName;
+      RouteNode *wildcardChild;           // "*" child
+      DynamicPage *pages[HTTP_METHODS_COUNT]; // pages[UNKNOWN_METHOD]: any method
+      CorsPolicy *cors;
+      ResponseCache *cache;
+
+      RouteNode(const nw::string& l=""): label(l), paramChild(NULL), wildcardChild(NULL), cors(NULL), cache(NULL)
+        { for (size_t i=0; i<HTTP_METHODS_COUNT; i++) pages[i]=NULL; };
+      ~RouteNode();
+      DynamicPage* getPage(const HttpRequestMethod method) const;
+      bool hasPage(const HttpRequestMethod method) const;
     };
 
+    pthread_mutex_t _mutex;
+    RouteNode root;
+
+    RouteNode* insertStatic(RouteNode *node, const char *str, size_t len);
+    RouteNode* insert(const nw::string& url);
+    const RouteNode* lookup(const RouteNode *node, const char *url, const char *path, const HttpRequestMethod method,
+                            HttpPathParameter *params, size_t& nbParams) const;
+    const RouteNode* findNode(const HttpRequestMethod method, const char *url, HttpPathParameter *params, size_t& nbParams) const;
+    static nw::string getAllowedMethods(const RouteNode *node);
+    static bool setCorsHeaders(const CorsPolicy *cors, HttpRequest* request, HttpResponse *response);
+    static bool getOptions(const RouteNode *node, HttpRequest* request, HttpResponse *response);
+    static nw::string getCacheKey(const CachePolicy& policy, HttpRequest* request);
+    static void storeCacheEntry(CacheEntry *entry, HttpResponse *response, const time_t expiration);
+    static bool getCacheEntry(const CacheEntry *entry, HttpRequest* request, HttpResponse *response);
+    static bool getCachedPage(ResponseCache *cache, DynamicPage *page, HttpRequest* request, HttpResponse *response);
+
+  public:
+    DynamicRepository() { pthread_mutex_init(&_mutex, NULL); };
+    virtual ~DynamicRepository() { pthread_mutex_destroy(&_mutex); };
+
+    inline void freeFile(unsigned char *webpage) { ::free (webpage); };
+
+    /**
+    * Add a dynamic page, for all the request methods
+    * @param url: the route
+    * @param page: the dynamic page
+    */
+    inline void add(nw::string url, DynamicPage *page) { add(UNKNOWN_METHOD, url, page); };
+
+    /**
+    * Add a dynamic page for a request method
+    * @param method: the request method (UNKNOWN_METHOD: all the methods)
+    * @param url: the route
+    * @param page: the dynamic page
+    */
+    void add(const HttpRequestMethod method, const nw::string& url, DynamicPage *page);
+
+    /**
+    * Set the CORS policy of a route
+    * @param url: the route
+    * @param policy: the CORS policy
+    */
+    void setCorsPolicy(const nw::string& url, const CorsPolicy& policy);
+
+    /**
+    * Cache the GET/HEAD responses of a route
+    * @param url: the route
+    * @param policy: the cache policy
+    */
+    void setCachePolicy(const nw::string& url, const CachePolicy& policy);
+
+    /**
+    * Find the page matching an url and a method
+    * @param method: the request method
+    * @param url: the url
+    * @param params: filled with the path parameters (HTTP_MAX_PATH_PARAMETERS entries)
+    * @param nbParams: the number of parameters found
+    * @return the page or NULL
+    */
+    DynamicPage* find(const HttpRequestMethod method, const char *url, HttpPathParameter *params, size_t& nbParams) const;
+
+    virtual bool getFile(HttpRequest* request, HttpResponse *response);
+    virtual nw::string getAllowedMethods(const char *url) const;
 };
 #endif
 
@@ -27,14 +27,24 @@
 #include <libnavajo/with_ustl.h>
 #endif // USE_USTL
 
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
 #include <openssl/ssl.h>
 #include "HttpSession.hh"
+#include "RequestArena.hh"
+#include "ConnectionManager.hh"
 
 
 //****************************************************************************
 
-typedef enum { UNKNOWN_METHOD = 0, GET_METHOD = 1, POST_METHOD = 2, PUT_METHOD = 3, DELETE_METHOD = 4 } HttpRequestMethod;
+typedef enum { UNKNOWN_METHOD = 0, GET_METHOD = 1, POST_METHOD = 2, PUT_METHOD = 3, DELETE_METHOD = 4,
+               HEAD_METHOD = 5, OPTIONS_METHOD = 6, PATCH_METHOD = 7,
+               EXTENSION_METHOD = 8 /* any other method token, see HttpRequest::getRequestMethodName() */ } HttpRequestMethod;
+#define HTTP_METHODS_COUNT (EXTENSION_METHOD+1)
 typedef enum { GZIP, ZLIB, NONE } CompressionMode;
+class WebSocketClient;
+class HttpRequestBuffer;
 typedef struct
 {
   int socketId;
@@ -43,101 +53,284 @@ typedef struct
   SSL *ssl;
   BIO *bio;
   nw::string *peerDN;
+  WebSocketClient *webSocketClient;
+  HttpRequestBuffer *requestBuffer;
+  unsigned long long queuedTime; // when given to the threads pool (monotonic, in µs)
+  ConnectionTimer timer;         // read deadline
 } ClientSockData;
 
-class HttpRequest
+#define HTTP_MAX_HEADERS 64
+
+/**
+* HttpHeader - a request header, pointing in the connection's buffer
+*/
+typedef struct
+{
+  const char *name;
+  const char *value;
+  size_t valueLength;
+} HttpHeader;
+
+#define HTTP_MAX_PATH_PARAMETERS 16
+
+/**
+* HttpPathParameter - a parameter extracted from the url by a route
+* ("/api/sensors/{id}/values"), stored as an offset in the url
+*/
+typedef struct
+{
+  const char *name;
+  size_t offset, length;
+} HttpPathParameter;
+
+#define HTTP_INLINE_ENTRIES 16
+
+/**
+* HttpRequestEntries - decoded name/value pairs (parameters or cookies),
+* kept in the received order (repeated names allowed). Names and values are
+* stored flat in a single buffer, allocated in the request arena if any.
+*/
+class HttpRequestEntries
 {
-  typedef nw::map <nw::string, nw::string> HttpRequestParametersMap;
-  typedef nw::map <nw::string, nw::string> HttpRequestCookiesMap;
+    typedef struct
+    {
+      size_t name, nameLength, value, valueLength; // offsets in storage
+    } Entry;
+
+    char *storage;
+    size_t storageSize, storageUsed;
+    bool storageInArena;
+    Entry inlineEntries[HTTP_INLINE_ENTRIES];
+    nw::vector<Entry> moreEntries;
+    size_t nbEntries;
+
+    HttpRequestEntries(const HttpRequestEntries&);
+    HttpRequestEntries& operator=(const HttpRequestEntries&);
+
+    inline const Entry& get(size_t i) const
+      { return i < HTTP_INLINE_ENTRIES ? inlineEntries[i] : moreEntries[i - HTTP_INLINE_ENTRIES]; };
+
+    inline nw::string str(size_t offset, size_t len) const { return nw::string(storage+offset, len); };
+
+    inline bool match(size_t i, const nw::string& name) const
+    {
+      const Entry& e=get(i);
+      return e.nameLength == name.size() && !memcmp(storage+e.name, name.data(), e.nameLength);
+    };
+
+    /**
+    * append a string, percent-decoded ("%XX" and '+') if needed
+    */
+    inline size_t append(const char *str, size_t len, bool decode)
+    {
+      static const signed char hexValues[256] = {
+        -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+        -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,  0, 1, 2, 3, 4, 5, 6, 7, 8, 9,-1,-1,-1,-1,-1,-1,
+        -1,10,11,12,13,14,15,-1,-1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+        -1,10,11,12,13,14,15,-1,-1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+        -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+        -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+        -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+        -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1 };
+
+      size_t offset=storageUsed;
+      if (storageUsed + len > storageSize) len=storageSize-storageUsed; // not reserved
+      if (!decode)
+      {
+        memcpy(storage+storageUsed, str, len);
+        storageUsed+=len;
+        return offset;
+      }
+
+      for (size_t i=0; i<len; i++)
+      {
+        char c=str[i];
+        if (c == '+') c=' ';
+        else if (c == '%' && i+1 < len)
+        {
+          if (str[i+1] == '%') i++;
+          else if (i+2 < len && hexValues[(unsigned char)str[i+1]] >= 0 && hexValues[(unsigned char)str[i+2]] >= 0)
+          {
+            c=(char)(hexValues[(unsigned char)str[i+1]] << 4 | hexValues[(unsigned char)str[i+2]]);
+            i+=2;
+          }
+        }
+        storage[storageUsed++]=c;
+      }
+      return offset;
+    };
+
+  public:
+    HttpRequestEntries(): storage(NULL), storageSize(0), storageUsed(0), storageInArena(false), nbEntries(0) {};
+    ~HttpRequestEntries() { if (!storageInArena) free(storage); };
+
+    /**
+    * allocate the storage: the decoded entries are never longer than the
+    * raw string
+    * @param len: the raw string length
+    * @param arena: the request arena, or NULL
+    */
+    inline void reserve(size_t len, RequestArena *arena)
+    {
+      storage = arena != NULL ? (char*)arena->allocate(len) : NULL;
+      storageInArena = storage != NULL;
+      if (storage == NULL) storage=(char*)malloc(len ? len : 1);
+      storageSize = storage != NULL ? len : 0;
+      storageUsed=0;
+    };
+
+    /**
+    * add a new entry
+    * @param decode: percent-decode the name and the value
+    */
+    inline void add(const char *name, size_t nameLength, const char *value, size_t valueLength, bool decode)
+    {
+      Entry e;
+      e.name=append(name, nameLength, decode);
+      e.nameLength=storageUsed-e.name;
+      e.value=append(value, valueLength, decode);
+      e.valueLength=storageUsed-e.value;
+      if (nbEntries < HTTP_INLINE_ENTRIES) inlineEntries[nbEntries]=e;
+      else moreEntries.push_back(e);
+      nbEntries++;
+    };
 
+    inline size_t size() const { return nbEntries; };
+
+    /**
+    * find the last value of a name
+    */
+    inline bool find(const nw::string& name, nw::string &value) const
+    {
+      for (size_t i=nbEntries; i-- > 0; )
+        if (match(i, name))
+        {
+          value.assign(storage+get(i).value, get(i).valueLength);
+          return true;
+        }
+      return false;
+    };
+
+    inline nw::vector<nw::string> findAll(const nw::string& name) const
+    {
+      nw::vector<nw::string> res;
+      for (size_t i=0; i<nbEntries; i++)
+        if (match(i, name))
+          res.push_back(str(get(i).value, get(i).valueLength));
+      return res;
+    };
+
+    inline nw::vector<nw::string> getNames() const
+    {
+      nw::vector<nw::string> res;
+      for (size_t i=0; i<nbEntries; i++)
+      {
+        size_t j=0;
+        while (j < i && !(get(j).nameLength == get(i).nameLength
+                          && !memcmp(storage+get(j).name, storage+get(i).name, get(i).nameLength))) j++;
+        if (j == i)
+          res.push_back(str(get(i).name, get(i).nameLength));
+      }
+      return res;
+    };
+};
+
+class HttpRequest
+{
   const char *url;
   const char *origin;
   ClientSockData *clientSockData;
   nw::string httpAuthUsername;
   HttpRequestMethod httpMethod;
-  HttpRequestCookiesMap cookies;
-  HttpRequestParametersMap parameters;
+  const char *extensionMethodName;
+  const char *rawCookies, *rawParameters;
+  mutable HttpRequestEntries cookies;
+  mutable HttpRequestEntries parameters;
+  mutable bool cookiesDecoded, parametersDecoded;
+  RequestArena *arena;
   nw::string sessionId;
+  HttpPathParameter pathParameters[HTTP_MAX_PATH_PARAMETERS];
+  size_t nbPathParameters;
+  const HttpHeader *headers;
+  size_t nbHeaders;
 
   /**********************************************************************/
   /**
-  * decode all http parameters and fill the parameters Map
-  * @param p: raw string containing all the http parameters
+  * decode all http parameters ("name=value&...") on first use
   */
-  inline void decodParams( const nw::string& p )
+  inline void decodParams() const
   {
-    size_t start = 0, end = 0;
-    nw::string paramstr=p;
+    if (parametersDecoded) return;
+    parametersDecoded=true;
+    if (rawParameters == NULL) return;
 
-    while ((end = paramstr.find_first_of("%+", start)) != nw::string::npos)
+    parameters.reserve(strlen(rawParameters), arena);
+    for (const char *p=rawParameters; *p; )
     {
-      switch (paramstr[end])
-      {
-        case '%':
-          if (paramstr[end+1]=='%')
-            paramstr=paramstr.erase(end+1,1);
-          else
-          {
-            unsigned int specar;
-            nw::string hexChar=paramstr.substr(end+1,2);
-            sscanf(hexChar.c_str(), "%2X", &specar);
-/*          nw::stringstream ss; ss << nw::hex << hexChar.c_str();
-            ss >> specar; */
-            paramstr[end] = (char)specar;
-            paramstr=paramstr.erase(end+1,2);
-          }
-          break;
+      const char *end=strchr(p, '&');
+      if (end == NULL) end=p+strlen(p);
+      const char *eq=(const char*)memchr(p, '=', end-p);
 
-        case '+':
-          paramstr[end]=' ';
-          break;
+      if (end != p)
+      {
+        if (eq == NULL)
+          parameters.add(p, end-p, end, 0, true);
+        else
+          parameters.add(p, eq-p, eq+1, end-eq-1, true);
       }
 
-      start=end+1;
+      p = *end ? end+1 : end;
     }
+  };
 
-    start = 0; end = 0;
-    bool islastParam=false;
-    while (!islastParam)
-    {
-      islastParam= (end = paramstr.find('&', start)) == nw::string::npos;
-      if (islastParam) end=paramstr.size();
+  /**********************************************************************/
+  /**
+  * decode all http cookies ("name=value; ...") on first use
+  */
+  inline void decodCookies() const
+  {
+    if (cookiesDecoded) return;
+    cookiesDecoded=true;
+    if (rawCookies == NULL) return;
 
-      nw::string theParam=paramstr.substr(start, end - start);
+    cookies.reserve(strlen(rawCookies), arena);
+    for (const char *p=rawCookies; *p; )
+    {
+      const char *end=strchr(p, ';');
+      if (end == NULL) end=p+strlen(p);
+      while (p < end && !isgraph((unsigned char)*p)) p++;
+      const char *eq=(const char*)memchr(p, '=', end-p);
 
-      size_t posEq=0;
-      if ((posEq = theParam.find('=')) == nw::string::npos)
-        parameters[theParam]="";
-      else
-        parameters[theParam.substr(0,posEq)]=theParam.substr(posEq+1);
+      if (eq != NULL && eq != p)
+        cookies.add(p, eq-p, eq+1, end-eq-1, false);
 
-      start = end + 1;
+      p = *end ? end+1 : end;
     }
   };
 
   /**********************************************************************/
   /**
-  * decode all http cookies and fill the cookies Map
-  * @param c: raw string containing all the cockies definitions
+  * find a cookie in the raw cookies string, without decoding them
+  * @return true if found
   */
-
-  inline void decodCookies( const nw::string& c )
+  inline bool findRawCookie( const char *name, nw::string &value ) const
   {
-    nw::istringstream ss(c);
-    nw::string theCookie;
-    while (nw::getline(ss, theCookie, ';'))
+    size_t len=strlen(name);
+    for (const char *p=rawCookies; p != NULL && *p; )
     {
-      size_t posEq=0;
-      if ((posEq = theCookie.find('=')) != nw::string::npos)
+      while (*p && !isgraph((unsigned char)*p)) p++;
+      const char *end=strchr(p, ';');
+      if (end == NULL) end=p+strlen(p);
+      if (!strncmp(p, name, len) && p[len] == '=')
       {
-        size_t firstC=0; while (!isgraph(theCookie[firstC]) && firstC < posEq) { firstC++; };
-
-        if (posEq-firstC > 0 && theCookie.length()-posEq > 0) cookies[theCookie.substr(firstC,posEq-firstC)]=theCookie.substr(posEq+1, theCookie.length()-posEq);
+        value.assign(p+len+1, end-p-len-1);
+        return true;
       }
+      p = *end ? end+1 : end;
     }
+    return false;
   };
 
-
   public:
 
     /**********************************************************************/
@@ -162,16 +355,8 @@ class HttpRequest
     */
     inline bool getCookie( const nw::string& name, nw::string &value ) const
     {
-      if(!cookies.empty())
-      {
-        HttpRequestCookiesMap::const_iterator it;
-        if((it = cookies.find(name)) != cookies.end())
-        {
-          value=it->second;
-          return true;
-        }
-      }
-      return false;
+      decodCookies();
+      return cookies.find(name, value);
     }
 
     /**********************************************************************/
@@ -181,31 +366,21 @@ class HttpRequest
     */
     inline nw::vector<nw::string> getCookiesNames() const
     {
-      nw::vector<nw::string> res;
-      for(HttpRequestCookiesMap::const_iterator iter=cookies.begin(); iter!=cookies.end(); ++iter)
-       res.push_back(iter->first);
-      return res;
+      decodCookies();
+      return cookies.getNames();
     }
 
     /**********************************************************************/
     /**
     * get parameter value
     * @param name: the parameter name
-    * @param value: the parameter value
+    * @param value: the parameter value (the last one if the parameter is repeated)
     * @return true is the parameter exist
     */
     inline bool getParameter( const nw::string& name, nw::string &value ) const
     {
-      if(!parameters.empty())
-      {
-        HttpRequestParametersMap::const_iterator it;
-        if((it = parameters.find(name)) != parameters.end())
-        {
-          value=it->second;
-          return true;
-        }
-      }
-      return false;
+      decodParams();
+      return parameters.find(name, value);
     }
 
     /**********************************************************************/
@@ -221,6 +396,18 @@ class HttpRequest
       return res;
     }
 
+    /**********************************************************************/
+    /**
+    * get all the values of a repeated parameter ("a=1&a=2")
+    * @param name: the parameter name
+    * @return the values, in the request order
+    */
+    inline nw::vector<nw::string> getParameterValues( const nw::string& name ) const
+    {
+      decodParams();
+      return parameters.findAll(name);
+    }
+
     /**********************************************************************/
     /**
     * does the parameter exist ?
@@ -239,13 +426,112 @@ class HttpRequest
     * @return a vector containing all parameters names
     */
     inline nw::vector<nw::string> getParameterNames() const
+    {
+      decodParams();
+      return parameters.getNames();
+    }
+
+    /**********************************************************************/
+    /**
+    * decode now the parameters and the cookies (they are decoded on first use,
+    * which is not thread safe)
+    */
+    inline void decodeParametersAndCookies() const
+    {
+      decodParams();
+      decodCookies();
+    }
+
+    /**********************************************************************/
+    /**
+    * get a request header value
+    * @param name: the header name (case insensitive)
+    * @return the value, valid as long as the request, or NULL
+    */
+    inline const char* getHeader( const char *name ) const
+    {
+      for (size_t i=0; i<nbHeaders; i++)
+        if (!strcasecmp(headers[i].name, name))
+          return headers[i].value;
+      return NULL;
+    }
+
+    /**********************************************************************/
+    /**
+    * get a request header value
+    * @param name: the header name (case insensitive)
+    * @param value: the header value
+    * @return true is the header exist
+    */
+    inline bool getHeader( const nw::string& name, nw::string &value ) const
+    {
+      for (size_t i=0; i<nbHeaders; i++)
+        if (!strcasecmp(headers[i].name, name.c_str()))
+        {
+          value.assign(headers[i].value, headers[i].valueLength);
+          return true;
+        }
+      return false;
+    }
+
+    /**********************************************************************/
+    /**
+    * get headers list
+    * @return a vector containing all headers names
+    */
+    inline nw::vector<nw::string> getHeaderNames() const
     {
       nw::vector<nw::string> res;
-      for(HttpRequestParametersMap::const_iterator iter=parameters.begin(); iter!=parameters.end(); ++iter)
-       res.push_back(iter->first);
+      for (size_t i=0; i<nbHeaders; i++)
+        res.push_back(headers[i].name);
+      return res;
+    }
+
+    /**********************************************************************/
+    /**
+    * get path parameter value (see DynamicRepository routes)
+    * @param name: the parameter name ("*" for the wildcard)
+    * @param value: the parameter value
+    * @return true is the parameter exist
+    */
+    inline bool getPathParameter( const nw::string& name, nw::string &value ) const
+    {
+      for (size_t i=0; i<nbPathParameters; i++)
+        if (name == pathParameters[i].name)
+        {
+          value.assign(url+pathParameters[i].offset, pathParameters[i].length);
+          return true;
+        }
+      return false;
+    }
+
+    /**********************************************************************/
+    /**
+    * get path parameter value
+    * @param name: the parameter name
+    * @return the parameter value
+    */
+    inline nw::string getPathParameter( const nw::string& name ) const
+    {
+      nw::string res="";
+      getPathParameter(name, res);
       return res;
     }
 
+    /**********************************************************************/
+    /**
+    * set the path parameters found by the router
+    * @param params: the parameters (offsets in the url)
+    * @param nb: the number of parameters
+    */
+    inline void setPathParameters( const HttpPathParameter *params, size_t nb )
+    {
+      if (nb > HTTP_MAX_PATH_PARAMETERS) nb=HTTP_MAX_PATH_PARAMETERS;
+      for (size_t i=0; i<nb; i++)
+        pathParameters[i]=params[i];
+      nbPathParameters=nb;
+    }
+
     /**********************************************************************/
     /**
     * is there a session cookie
@@ -253,7 +539,8 @@ class HttpRequest
     */
     inline void getSession()
     {
-      sessionId = getCookie("SID");
+      if (!findRawCookie("SID", sessionId))
+        sessionId="";
 
       if (sessionId.length() && HttpSession::find(sessionId))
         return;
@@ -338,19 +625,28 @@ class HttpRequest
     * @param url:  the requested url
     * @param params:  raw http parameters string
     * @cookies params: raw http cookies string
+    * @param headers: the request headers
+    * @param nbHeaders: the number of headers
+    * @param arena: the request scoped memory (NULL if the request outlives it)
     */
-    HttpRequest(const HttpRequestMethod type, const char *url, const char *params, const char *cookies, const char *origin, const nw::string &username, ClientSockData *client)
+    HttpRequest(const HttpRequestMethod type, const char *url, const char *params, const char *cookies, const char *origin, const nw::string &username, ClientSockData *client,
+                const HttpHeader *headers=NULL, size_t nbHeaders=0, RequestArena *arena=NULL)
     {
       httpMethod = type;
+      extensionMethodName = NULL;
       this->url = url;
       this->origin = origin;
       httpAuthUsername=username;
       this->clientSockData=client;
-
-      if (params != NULL && strlen(params))
-        decodParams(params);
-      if (cookies != NULL && strlen(cookies))
-        decodCookies(cookies);
+      nbPathParameters=0;
+      this->headers=headers;
+      this->nbHeaders=nbHeaders;
+      this->arena=arena;
+
+      // decoded on first use: the strings must be valid as long as the request
+      rawParameters=params;
+      rawCookies=cookies;
+      parametersDecoded=cookiesDecoded=false;
       getSession();
     };
 
@@ -368,6 +664,38 @@ class HttpRequest
     */
     inline HttpRequestMethod getRequestType() const { return httpMethod; };
 
+    /**********************************************************************/
+    /**
+    * get a method name
+    * @param method: the Http Request Type
+    * @return the method token ("GET", "POST", ...), "" for the unknown and
+    *  extension methods
+    */
+    inline static const char* getMethodName(const HttpRequestMethod method)
+    {
+      static const char *names[HTTP_METHODS_COUNT] = { "", "GET", "POST", "PUT", "DELETE", "HEAD", "OPTIONS", "PATCH", "" };
+      return (size_t)method < HTTP_METHODS_COUNT ? names[method] : "";
+    };
+
+    /**********************************************************************/
+    /**
+    * get request method name
+    * @return the method token, as received for the extension methods
+    */
+    inline const char* getRequestMethodName() const
+    {
+      if (httpMethod == EXTENSION_METHOD && extensionMethodName != NULL)
+        return extensionMethodName;
+      return getMethodName(httpMethod);
+    };
+
+    /**********************************************************************/
+    /**
+    * set the method token of an extension method
+    * @param name: the token, which must be valid as long as the request
+    */
+    inline void setRequestMethodName(const char *name) { extensionMethodName=name; };
+
     /**********************************************************************/
     /**
     * get request origin
@@ -375,6 +703,13 @@ class HttpRequest
     */
     inline const char* getRequestOrigin() const { return origin; };
 
+    /**********************************************************************/
+    /**
+    * get the request scoped memory
+    * @return the arena, or NULL
+    */
+    inline RequestArena* getArena() const { return arena; };
+
     /**********************************************************************/
     /**
     * get peer IP address
@@ -0,0 +1,128 @@
+//****************************************************************************
+/**
+ * @file  HttpRequestBuffer.hh
+ *
+ * @brief The connection's read buffer and the http request header parser
+ *
+ * @author agent (agent@local)
+ *
+ * @version 1
+ * @date 19/10/26
+ */
+//****************************************************************************
+
+#ifndef HTTPREQUESTBUFFER_HH_
+#define HTTPREQUESTBUFFER_HH_
+
+#include <stdlib.h>
+#include <sys/types.h>
+
+#include "libnavajo/HttpRequest.hh"
+
+#define HTTP_REQUEST_BUFFER_SIZE 32768 // the request headers and its urlencoded form
+
+/**
+* HttpRequestBuffer - the data received on a connection. The request line
+* and the headers are parsed in place: the url, the query string and the
+* header values point in the buffer (nul terminated), until the next
+* request of the connection is read.
+*/
+class HttpRequestBuffer
+{
+    char data[HTTP_REQUEST_BUFFER_SIZE+1];
+    size_t start, end;     // received data not consumed yet
+    size_t scanned;        // headers end searched up to there
+    size_t requestLength;  // current request (headers + body)
+    size_t bodyLength;
+    size_t bodyToSkip;     // body bytes not received, to be discarded
+    ssize_t savedCharPos;  // char overwritten by the body's terminal nul
+    char savedChar;
+
+    HttpRequestMethod method;
+    const char *methodName;
+    const char *path, *query, *version;
+    HttpHeader headers[HTTP_MAX_HEADERS];
+    size_t nbHeaders;
+
+    char url[HTTP_REQUEST_BUFFER_SIZE+12];
+
+  public:
+    inline void init()
+    {
+      start=end=scanned=requestLength=bodyLength=bodyToSkip=0;
+      savedCharPos=-1;
+      nbHeaders=0;
+      methodName=path=query=version="";
+      method=UNKNOWN_METHOD;
+      *url='\0';
+    };
+
+    /**
+    * Release the previous request and move the pending data (pipelined
+    * request) at the beginning of the buffer
+    */
+    void next();
+
+    /**
+    * @return the free space where new data can be received
+    */
+    inline char *getFreeSpace() { return data+end; };
+    inline size_t getFreeSpaceLength() const { return HTTP_REQUEST_BUFFER_SIZE-end; };
+
+    /**
+    * new data has been received in the free space
+    * @param len: the number of bytes
+    */
+    void received(size_t len);
+
+    /**
+    * Search the end of the headers (empty line) in the received data
+    * @return the headers length (empty line included), 0 if not received yet
+    */
+    size_t findHeadersEnd();
+
+    /**
+    * Parse the request line and the headers, in place
+    * @param len: the headers length
+    * @return 0, or the http error code (400, 431)
+    */
+    int parse(size_t len);
+
+    /**
+    * The request body follows the headers: set its length
+    * @param len: the body length
+    * @param keep: if true the body must be received in the buffer (and nul
+    *  terminated), else it is discarded
+    * @return the number of bytes still to be received (0 if the body is complete
+    *  or is discarded), or -1 if the body doesn't fit in the buffer
+    */
+    ssize_t setBody(size_t len, bool keep);
+
+    /**
+    * @return the body (nul terminated) if it has been kept
+    */
+    inline const char *getBody() const { return data+start+requestLength-bodyLength; };
+
+    /**
+    * @return true if the end of the previous request's body must still be
+    *  received and discarded
+    */
+    inline bool hasBodyToSkip() const { return bodyToSkip != 0; };
+
+    inline HttpRequestMethod getMethod() const { return method; };
+    inline const char *getMethodName() const { return methodName; };
+    inline const char *getPath() const { return path; };
+    inline const char *getQuery() const { return query; };
+    inline const char *getVersion() const { return version; };
+    inline const HttpHeader *getHeaders() const { return headers; };
+    inline size_t getHeadersCount() const { return nbHeaders; };
+
+    /**
+    * @return the url buffer (the path without leading slashes, and completed
+    *  by "index.html" for a directory), which can be modified for forwards
+    */
+    inline char *getUrl() { return url; };
+    inline size_t getUrlSize() const { return sizeof url; };
+};
+
+#endif
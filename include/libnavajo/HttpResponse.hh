@@ -14,23 +14,55 @@
 #ifndef HTTPRESPONSE_HH_
 #define HTTPRESPONSE_HH_
 
+#include "libnavajo/RequestArena.hh"
 
 class HttpResponse
 {
   unsigned char *responseContent;
   size_t responseContentLength;
+  int responseContentFd;
+  RequestArena *arena;
+  unsigned char *arenaContent;
   nw::vector<nw::string> responseCookies;
+  nw::vector<nw::string> responseHeaders;
   bool zippedFile;
-  nw::string mimeType;
+  const char *mimeType;   // a constant string, NULL: customMimeType is used
+  size_t mimeTypeLength;
+  nw::string customMimeType;
   nw::string forwardToUrl;
   bool cors, corsCred;
   nw::string corsDomain;
 
   public:
-    HttpResponse(nw::string mime="") : responseContent (NULL), responseContentLength (0), zippedFile (false), mimeType(mime), forwardToUrl(""), cors(false), corsCred(false), corsDomain("")
+    HttpResponse(nw::string mime="", RequestArena *arena=NULL) : responseContent (NULL), responseContentLength (0), responseContentFd (-1), arena (arena), arenaContent (NULL), zippedFile (false), mimeType (NULL), mimeTypeLength (0), customMimeType(mime), forwardToUrl(""), cors(false), corsCred(false), corsDomain("")
     {
     }
 
+    /************************************************************************/
+    /**
+    * allocate a buffer for the response body, in the request arena when
+    * available (released by the webserver at the end of the request), else
+    * with malloc (released by the repository's freeFile())
+    * @param length: The buffer's length
+    * @return the buffer, or NULL
+    */
+    inline unsigned char* allocateContent(size_t length)
+    {
+      unsigned char *content=NULL;
+      if (arena != NULL && (content=(unsigned char*)arena->allocate(length)) != NULL)
+        return arenaContent=content;
+      return (unsigned char*)malloc(length);
+    }
+
+    /************************************************************************/
+    /**
+    * @return true if the response body has been allocated in the request arena
+    */
+    inline bool isArenaContent() const
+    {
+      return arenaContent != NULL && responseContent == arenaContent;
+    }
+
     /************************************************************************/
     /**
     * set the response body
@@ -43,6 +75,25 @@ class HttpResponse
       responseContentLength = length;
     }
 
+    /************************************************************************/
+    /**
+    * set the response body from an opened file, which can be sent without
+    * being copied in user space (sendfile)
+    * @param fd: The file descriptor, released by the repository's closeFile()
+    * @param length: The content's length
+    */
+    inline void setContentFile(int fd, size_t length)
+    {
+      responseContentFd = fd;
+      responseContentLength = length;
+    }
+
+    /************************************************************************/
+    /**
+    * Returns the file descriptor of the response body, or -1
+    */
+    inline int getContentFile() const { return responseContentFd; };
+
     /************************************************************************/
     /**
     * Returns the response body of the HTTP method
@@ -136,14 +187,50 @@ class HttpResponse
       return responseCookies;
     };
 
+    /************************************************************************/
+    /**
+    * insert a header line in the response
+    * @param name: the header's name
+    * @param value: the header's value
+    */
+    inline void addHeader(const nw::string& name, const nw::string& value)
+    {
+      responseHeaders.push_back(name+": "+value);
+    }
+
+    /************************************************************************/
+    /**
+    * get the additional header lines ("name: value")
+    * @return the headers vector
+    */
+    inline nw::vector<nw::string>& getHeaders()
+    {
+      return responseHeaders;
+    };
+
     /************************************************************************/
     /**
     * set a new mime type (by default, mime type is automatically set)
     * @param mime: the new mime type
     */
     inline void setMimeType(const nw::string& mime)
+    {
+      mimeType=NULL;
+      customMimeType=mime;
+    }
+
+    /************************************************************************/
+    /**
+    * set a new mime type, which is not copied
+    * @param mime: a constant string (never freed nor modified), or NULL
+    *   for no mime type
+    * @param length: its length
+    */
+    inline void setStaticMimeType(const char *mime, const size_t length)
     {
       mimeType=mime;
+      mimeTypeLength=length;
+      if (mime == NULL) customMimeType.clear();
     }
 
     /************************************************************************/
@@ -151,9 +238,18 @@ class HttpResponse
     * get the current mime type
     * @return the mime type
     */
-    inline const nw::string& getMimeType() const
+    inline const char* getMimeType() const
+    {
+      return mimeType != NULL ? mimeType : customMimeType.c_str();
+    }
+
+    /************************************************************************/
+    /**
+    * @return the length of the current mime type
+    */
+    inline size_t getMimeTypeLength() const
     {
-      return mimeType;
+      return mimeType != NULL ? mimeTypeLength : customMimeType.size();
     }
 
     /************************************************************************/
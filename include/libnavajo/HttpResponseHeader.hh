@@ -0,0 +1,100 @@
+//****************************************************************************
+/**
+ * @file  HttpResponseHeader.hh
+ *
+ * @brief The http response header builder
+ *
+ * @author agent (agent@local)
+ *
+ * @version 1
+ * @date 19/10/26
+ */
+//****************************************************************************
+
+#ifndef HTTPRESPONSEHEADER_HH_
+#define HTTPRESPONSEHEADER_HH_
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef USE_USTL
+#include <libnavajo/with_ustl.h>
+#else
+#include <string>
+#include <libnavajo/with_ustl.h>
+#endif // USE_USTL
+
+#define HTTP_RESPONSE_HEADER_SIZE 2048
+
+typedef enum
+{
+  HTTP_STATUS_SWITCHING_PROTOCOLS,
+  HTTP_STATUS_OK,
+  HTTP_STATUS_NO_CONTENT,
+  HTTP_STATUS_BAD_REQUEST,
+  HTTP_STATUS_UNAUTHORIZED,
+  HTTP_STATUS_NOT_FOUND,
+  HTTP_STATUS_METHOD_NOT_ALLOWED,
+  HTTP_STATUS_PAYLOAD_TOO_LARGE,
+  HTTP_STATUS_TOO_MANY_REQUESTS,
+  HTTP_STATUS_HEADER_FIELDS_TOO_LARGE,
+  HTTP_STATUS_INTERNAL_SERVER_ERROR,
+  HTTP_STATUS_NOT_IMPLEMENTED,
+  HTTP_STATUS_COUNT
+} HttpStatus;
+
+/**
+* HttpResponseHeader - writes a response header in a preallocated buffer.
+* Like snprintf, the header is truncated if the buffer is too small, but the
+* needed length is still computed.
+*/
+class HttpResponseHeader
+{
+    char *buffer;
+    size_t size, length;
+
+  public:
+    HttpResponseHeader(char *buf, size_t bufSize): buffer(buf), size(bufSize), length(0) {};
+
+    inline void append(const char *str, size_t len)
+    {
+      if (length < size)
+        memcpy(buffer+length, str, length+len <= size ? len : size-length);
+      length+=len;
+    };
+
+    inline void append(const char *str) { append(str, strlen(str)); };
+    inline void append(const nw::string& str) { append(str.data(), str.size()); };
+
+    /**
+    * Append a string literal (length known at compile time)
+    */
+    template<size_t N> inline void appendConstant(const char (&str)[N]) { append(str, N-1); };
+
+    /**
+    * Append a decimal number
+    */
+    inline void appendNumber(size_t n)
+    {
+      char digits[24], *p=digits+sizeof digits;
+      do { *--p='0' + n % 10; n/=10; } while (n);
+      append(p, digits+sizeof digits-p);
+    };
+
+    /**
+    * Append the status line ("HTTP/1.1 <code> <reason>\r\n")
+    */
+    void appendStatusLine(const HttpStatus status);
+
+    /**
+    * Append the "Date:" line, formatted once per second
+    */
+    void appendDate();
+
+    /**
+    * @return the header length (greater than the buffer size if truncated)
+    */
+    inline size_t getLength() const { return length; };
+};
+
+#endif
@@ -0,0 +1,93 @@
+//********************************************************
+/**
+ * @file  IpNetworkTrie.hh
+ *
+ * @brief Set of ip networks (path compressed binary trie)
+ *
+ * @author agent (agent@local)
+ *
+ * @version 1
+ * @date 19/10/26
+ */
+//********************************************************
+
+#ifndef IPNETWORKTRIE_HH_
+#define IPNETWORKTRIE_HH_
+
+#ifdef USE_USTL
+
+#include <libnavajo/with_ustl.h>
+
+#else
+
+#include <vector>
+#include <libnavajo/with_ustl.h>
+
+#endif // USE_USTL
+
+#include "libnavajo/IpAddress.hh"
+
+/**
+* IpNetworkTrie - a set of ip networks, the IpV4 and IpV6 ones in separate
+* tries. Each node holds a prefix (the bits skipped from its parent are
+* compared at once), so an address is looked up in at most as many steps
+* as its prefix length, whatever the number of networks.
+* The networks are added before the lookups start (not thread safe).
+*/
+class IpNetworkTrie
+{
+    struct Node
+    {
+      u_int8_t prefix[INET6_ADDRLEN];
+      u_int8_t length;   // in bits
+      bool network;      // a network of the set ends here
+      int child[2];      // nodes indexes, -1 if none
+    };
+
+    struct Trie
+    {
+      nw::vector<Node> nodes; // the root first (empty prefix)
+      u_int8_t maxLength;
+    };
+
+    Trie tries[2]; // IpV4, IpV6
+    size_t nbNetworks;
+
+    inline static int getBit(const u_int8_t *bytes, const unsigned i)
+      { return (bytes[i >> 3] >> (7 - (i & 7))) & 1; };
+
+    static unsigned commonLength(const u_int8_t *a, const u_int8_t *b, const unsigned maxLength);
+    static int newNode(Trie& trie, const u_int8_t *prefix, const unsigned length, const bool network);
+    static void insert(Trie& trie, const u_int8_t *prefix, unsigned length);
+
+    inline static const u_int8_t* getBytes(const IpAddress& ip)
+      { return ip.ipversion == 4 ? (const u_int8_t*)&ip.ip.v4 : ip.ip.v6.s6_addr; };
+
+  public:
+    IpNetworkTrie();
+
+    /**
+    * Add a network to the set
+    * @param net: the network (address and mask length)
+    */
+    void add(const IpNetwork& net);
+
+    /**
+    * @return true if no network has been added
+    */
+    inline bool empty() const { return !nbNetworks; };
+
+    /**
+    * @return the number of networks added
+    */
+    inline size_t size() const { return nbNetworks; };
+
+    /**
+    * Is an ip address inside one of the networks ?
+    * @param ip: the address
+    * @return true if it is
+    */
+    bool contains(const IpAddress& ip) const;
+};
+
+#endif
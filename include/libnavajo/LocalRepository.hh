@@ -23,6 +23,9 @@
 #else
 
 #include <set>
+#include <map>
+#include <list>
+#include <vector>
 #include <string>
 #include <libnavajo/with_ustl.h>
 
@@ -30,28 +33,157 @@
 
 #include "libnavajo/thread.h"
 
+#define LOCAL_REPOSITORY_SCAN_THREADS 8 // maximum number of threads scanning the directories
+#define LOCAL_REPOSITORY_OPEN_FILES 256  // default size of the open files cache
+#define LOCAL_REPOSITORY_PUBLISH_DELAY 50 // ms: the changes watched meanwhile are published together
+
 
 class LocalRepository : public WebRepository
 {
+    /**
+    * FilesIndex - the available files: their urls and their local
+    * filenames (hash map, by chaining). The copies share their buckets:
+    * a shared bucket is never modified, it is copied before the update.
+    */
+    class FilesIndex
+    {
+        typedef nw::pair<nw::string, nw::string> Entry; // url | filename
+        struct Bucket
+        {
+          nw::vector<Entry> entries;
+          unsigned refs;   // indexes sharing it
+        };
+        nw::vector<Bucket*> buckets; // NULL when empty
+        size_t count;
+
+        static size_t hash(const nw::string& s);
+        static void release(Bucket *bucket);
+        void rehash(const size_t nbBuckets);
+        Bucket* getWritableBucket(const size_t b);
+        FilesIndex& operator=(const FilesIndex&);
+
+      public:
+        FilesIndex() : buckets(64, (Bucket*)NULL), count(0) {};
+        FilesIndex(const FilesIndex& index);
+        ~FilesIndex();
+        const nw::string* find(const nw::string& url) const; // the filename, or NULL
+        void insert(const nw::string& url, const nw::string& filename);
+        void erase(const nw::string& url);
+        void eraseDirectory(const nw::string& dirname); // the urls under dirname/
+        void clear();
+        void getAll(nw::vector<nw::string>& urls) const;
+    };
+
+    struct DirectoryScan;
+
     pthread_mutex_t _mutex;
 
-    nw::set< nw::string > filenamesSet; // list of available files
+    // updated by the scans and the watch thread: the buckets refs are
+    // only changed with _mutex locked (copies, updates and deletions)
+    FilesIndex files;
     nw::set< nw::pair<nw::string,nw::string> > aliasesSet; // alias name | Path to local directory
 
+    // the requests read a copy of the files index, without lock (RCU like):
+    // a new copy is published once the index has been updated, and the
+    // previous one is deleted when the readers which may use it have left
+    pthread_mutex_t publishMutex;
+    const FilesIndex * volatile index;
+    volatile unsigned long readersEpoch;
+    volatile long readers[2];      // by epoch parity
+
+    inline unsigned enterIndex()
+    {
+      unsigned parity=readersEpoch & 1;
+      __sync_fetch_and_add(&readers[parity], 1);
+      return parity;
+    };
+    inline void leaveIndex(const unsigned parity)
+      { __sync_fetch_and_sub(&readers[parity], 1); };
+    void publishIndex();
+
+    /**
+    * OpenFile - a file kept open, shared by the requests: its descriptor is
+    * read with offsets (sendfile, pread) and released by closeFile()
+    */
+    struct OpenFile
+    {
+      nw::string url;
+      int fd;
+      off_t size;
+      unsigned refs;       // requests using it
+      bool cached;         // false once invalidated: closed by its last user
+      nw::list<OpenFile*>::iterator lruIt;
+    };
+
+    pthread_mutex_t openFilesMutex;
+    nw::map<nw::string, OpenFile*> openFiles; // by url
+    nw::map<int, OpenFile*> openFilesByFd;    // with the invalidated ones still in use
+    nw::list<OpenFile*> openFilesLru;         // least recently used first
+    size_t openFilesMax;
+    unsigned long openFilesGeneration;        // incremented by the invalidations
+
+    bool getOpenFile(const nw::string& url, int& fd, off_t& size, unsigned long& generation);
+    void addOpenFile(const nw::string& url, const int fd, const off_t size, const unsigned long generation);
+    void invalidateOpenFiles(const nw::string& url, const bool directory);
+    void releaseOpenFile(OpenFile *file);
+
+    bool hotReload;
+#ifdef LINUX
+    struct Watch
+    {
+      nw::string alias, path, subpath; // the directory is path+subpath
+    };
+    int inotifyFd, wakeupPipe[2];
+    nw::map<int, Watch> watches; // by watch descriptor
+    pthread_t watchThread;
+    bool watching;
+
+    bool startWatching();
+    void stopWatching();
+    void removeWatches(const nw::string& alias, const nw::string& path, const nw::string& subpath);
+    bool processEvents(const char *buf, const ssize_t len);
+    static void* startWatchThread(void *);
+    void watchProcessing();
+    // the changes of the files are only known when they are watched
+    inline bool isCachingOpenFiles() const { return watching && openFilesMax; };
+#else
+    inline bool isCachingOpenFiles() const { return false; };
+#endif
+
     bool loadFilename_dir(const nw::string& alias, const nw::string& path, const nw::string& subpath);
-    bool fileExist(const nw::string& url);
+    void scanDirectory(DirectoryScan& scan, const nw::string& subpath, nw::vector<nw::string>& subdirs);
+    static void* startScanThread(void *);
+    static nw::string getUrl(const nw::string& alias, const nw::string& subpath, const char *name);
 
 
   public:
-    LocalRepository () { pthread_mutex_init(&_mutex, NULL); };
-    virtual ~LocalRepository () { clearAliases(); };
+    LocalRepository ();
+    virtual ~LocalRepository ();
 
     virtual bool getFile(HttpRequest* request, HttpResponse *response);
     virtual void freeFile(unsigned char *webpage) { ::free(webpage); };
+    virtual void closeFile(int fd);
+
+    /**
+    * Follow the changes of the directories (Linux only, default: enabled):
+    * the created, deleted and renamed files are available at once. Set
+    * before adding the directories.
+    * @param hotReload: boolean
+    */
+    inline void setHotReload(const bool hotReload) { this->hotReload = hotReload; };
+
+    /**
+    * Set the maximum number of files kept open between the requests, with
+    * their size (default: LOCAL_REPOSITORY_OPEN_FILES). The cache is only
+    * used when the directories are watched (hot reload), which invalidates
+    * the changed files.
+    * @param nb: the number of files, 0 to disable the cache
+    */
+    inline void setOpenFilesCacheSize(const size_t nb) { openFilesMax = nb; };
+
     void addDirectory(const nw::string& alias, const nw::string& dirPath);
     void clearAliases();
     void printFilenames();
 };
 
 #endif
-
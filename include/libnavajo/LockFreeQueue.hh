@@ -0,0 +1,134 @@
+//****************************************************************************
+/**
+ * @file  LockFreeQueue.hh
+ *
+ * @brief A bounded lock-free multi-producer/multi-consumer queue
+ *
+ * @author agent (agent@local)
+ *
+ * @version 1
+ * @date 19/10/26
+ */
+//****************************************************************************
+
+#ifndef LOCKFREEQUEUE_HH_
+#define LOCKFREEQUEUE_HH_
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#define LOCKFREEQUEUE_CACHELINE_SIZE 64
+
+/**
+* LockFreeQueue - a fixed size ring of cells, each one with a sequence number
+* telling if it can be written (sequence == position) or read
+* (sequence == position + 1). Producers and consumers only contend on the
+* position counters (compare and swap).
+*/
+template <class T> class LockFreeQueue
+{
+    struct Cell
+    {
+      volatile size_t sequence;
+      T data;
+    };
+
+    Cell *cells;
+    size_t mask;
+    char pad0[LOCKFREEQUEUE_CACHELINE_SIZE];
+    volatile size_t enqueuePos;
+    char pad1[LOCKFREEQUEUE_CACHELINE_SIZE];
+    volatile size_t dequeuePos;
+    char pad2[LOCKFREEQUEUE_CACHELINE_SIZE];
+
+    LockFreeQueue(const LockFreeQueue&);
+    LockFreeQueue& operator=(const LockFreeQueue&);
+
+  public:
+    /**
+    * @param size: the queue capacity, rounded up to a power of two
+    */
+    LockFreeQueue(size_t size)
+    {
+      size_t capacity=2;
+      while (capacity < size) capacity<<=1;
+      cells=new Cell[capacity];
+      mask=capacity-1;
+      for (size_t i=0; i<capacity; i++)
+        cells[i].sequence=i;
+      enqueuePos=dequeuePos=0;
+    };
+
+    ~LockFreeQueue() { delete[] cells; };
+
+    /**
+    * Add an element
+    * @return false if the queue is full
+    */
+    inline bool push(const T& data)
+    {
+      Cell *cell;
+      size_t pos=enqueuePos;
+
+      for (;;)
+      {
+        cell=&cells[pos & mask];
+        size_t seq=cell->sequence;
+        __sync_synchronize();
+        intptr_t dif=(intptr_t)seq - (intptr_t)pos;
+        if (dif == 0)
+        {
+          if (__sync_bool_compare_and_swap(&enqueuePos, pos, pos+1))
+            break;
+        }
+        else
+          if (dif < 0)
+            return false;
+        pos=enqueuePos;
+      }
+
+      cell->data=data;
+      __sync_synchronize();
+      cell->sequence=pos+1;
+      return true;
+    };
+
+    /**
+    * Remove the oldest element
+    * @return false if the queue is empty
+    */
+    inline bool pop(T& data)
+    {
+      Cell *cell;
+      size_t pos=dequeuePos;
+
+      for (;;)
+      {
+        cell=&cells[pos & mask];
+        size_t seq=cell->sequence;
+        __sync_synchronize();
+        intptr_t dif=(intptr_t)seq - (intptr_t)(pos+1);
+        if (dif == 0)
+        {
+          if (__sync_bool_compare_and_swap(&dequeuePos, pos, pos+1))
+            break;
+        }
+        else
+          if (dif < 0)
+            return false;
+        pos=dequeuePos;
+      }
+
+      data=cell->data;
+      __sync_synchronize();
+      cell->sequence=pos+mask+1;
+      return true;
+    };
+
+    /**
+    * @return true if the queue seems empty (it may change at any time)
+    */
+    inline bool empty() const { return dequeuePos == enqueuePos; };
+};
+
+#endif
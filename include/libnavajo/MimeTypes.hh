@@ -0,0 +1,76 @@
+//********************************************************
+/**
+ * @file  MimeTypes.hh
+ *
+ * @brief The mime types of the files extensions (perfect hash table)
+ *
+ * @author agent (agent@local)
+ *
+ * @version 1
+ * @date 19/10/26
+ */
+//********************************************************
+
+#ifndef MIMETYPES_HH_
+#define MIMETYPES_HH_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define MIME_TYPES_EXTENSION_MAX 16 // longer extensions are unknown
+#define MIME_TYPES_SLOTS 512         // power of two, at least twice the extensions count
+#define MIME_TYPES_BUCKETS 64        // displacements of the perfect hash
+
+/**
+* MimeType - an extension and its type (constant strings)
+*/
+typedef struct
+{
+  const char *extension;   // lower case, without the dot
+  const char *type;
+  size_t length;           // of the type
+} MimeType;
+
+/**
+* MimeTypes - the known extensions (a mime.types set), found with a perfect
+* hash: the extensions of a bucket are placed with the displacement of the
+* bucket, so that each slot holds one extension. The displacements are
+* computed once, at startup, from the static table, and a lookup reads one
+* slot.
+*/
+class MimeTypes
+{
+    static const MimeType table[];
+    static const size_t tableSize;
+    static unsigned short slots[MIME_TYPES_SLOTS];          // table index + 1, 0: empty
+    static unsigned short displacements[MIME_TYPES_BUCKETS];
+    static bool initialized;
+
+    static u_int32_t hash(const char *ext, const size_t len, const u_int32_t seed);
+    static bool init();
+
+  public:
+    /**
+    * Get the mime type of an extension
+    * @param ext: the extension (without the dot), case insensitive
+    * @param len: its length
+    * @return the mime type, or NULL if unknown
+    */
+    static const MimeType* find(const char *ext, const size_t len);
+
+    /**
+    * Get the mime type of a file name or an url, from its extension
+    * @param name: the name
+    * @return the mime type, or NULL if unknown
+    */
+    static const MimeType* findByName(const char *name);
+
+    /**
+    * is it worth compressing a content of this mime type ? (the text and
+    * the uncompressed data formats)
+    * @param type: the mime type
+    */
+    static bool isCompressible(const char *type);
+};
+
+#endif
@@ -0,0 +1,101 @@
+//********************************************************
+/**
+ * @file  PeerIpHistory.hh
+ *
+ * @brief The recent clients ip addresses (bounded, lock free)
+ *
+ * @author agent (agent@local)
+ *
+ * @version 1
+ * @date 19/10/26
+ */
+//********************************************************
+
+#ifndef PEERIPHISTORY_HH_
+#define PEERIPHISTORY_HH_
+
+#ifdef USE_USTL
+
+#include <libnavajo/with_ustl.h>
+
+#else
+
+#include <map>
+#include <libnavajo/with_ustl.h>
+
+#endif // USE_USTL
+
+#include <time.h>
+
+#include "libnavajo/IpAddress.hh"
+
+#define PEER_IP_HISTORY_SIZE 4096  // power of two
+#define PEER_IP_HISTORY_PROBES 8   // slots an address can be stored in
+
+/**
+* PeerIpStats - what is known about a client
+*/
+typedef struct
+{
+  time_t lastSeen;
+  unsigned long connections;
+} PeerIpStats;
+
+/**
+* PeerIpHistory - a fixed size open addressing table. An address is stored
+* in one of the PEER_IP_HISTORY_PROBES slots following its hash, replacing
+* the least recently seen address when they are all used.
+* The slots are written without lock nor allocation: a writer marks the slot
+* (odd sequence number) by compare and swap, and retries a few times, then
+* gives up, if a slot is already marked. The readers copy the slots, and
+* retry if they have been written meanwhile.
+*/
+class PeerIpHistory
+{
+    struct Slot
+    {
+      volatile unsigned seq;
+      u_int8_t ipversion;   // 0: empty
+      IpAddress::IP ip;
+      time_t lastSeen;
+      unsigned long connections;
+    };
+
+    Slot *slots;
+
+    PeerIpHistory(const PeerIpHistory&);
+    PeerIpHistory& operator=(const PeerIpHistory&);
+
+    static size_t hash(const IpAddress& ip);
+    static bool isEqual(const Slot& slot, const IpAddress& ip);
+    static bool read(const Slot& slot, IpAddress& ip, PeerIpStats& stats);
+
+  public:
+    PeerIpHistory();
+    ~PeerIpHistory();
+
+    /**
+    * A new connection
+    * @param ip: the client address
+    * @param now: the current time
+    * @param expiration: the delay after which a client is new again
+    * @return true if the client is new (false if the update has been
+    *   dropped, the slots being written by other threads)
+    */
+    bool update(const IpAddress& ip, const time_t now, const time_t expiration);
+
+    /**
+    * Copy the recent clients
+    * @param history: filled with the clients and their last connection time
+    */
+    void getSnapshot(nw::map<IpAddress,time_t>& history) const;
+
+    /**
+    * Copy the recent clients
+    * @param history: filled with the clients, their last connection time and
+    *   connections count
+    */
+    void getSnapshot(nw::map<IpAddress,PeerIpStats>& history) const;
+};
+
+#endif
@@ -38,7 +38,10 @@ class PrecompiledRepository : public WebRepository
     {
       const unsigned char* data;
       size_t length;
-      WebStaticPage(const unsigned char* d,size_t l) : data(d), length(l) {};
+      const char* mimeType;  // set by navajoPrecompiler, NULL if unknown
+      size_t mimeTypeLength;
+      WebStaticPage(const unsigned char* d,size_t l) : data(d), length(l), mimeType(NULL), mimeTypeLength(0) {};
+      WebStaticPage(const unsigned char* d,size_t l,const char* m,size_t ml) : data(d), length(l), mimeType(m), mimeTypeLength(ml) {};
     } ;
 
     typedef nw::map<nw::string, const WebStaticPage> IndexMap;
@@ -62,6 +65,10 @@ class PrecompiledRepository : public WebRepository
 
     inline virtual bool getFile(HttpRequest* request, HttpResponse *response)
     {
+      HttpRequestMethod method=request->getRequestType();
+      if (method == PATCH_METHOD || method == EXTENSION_METHOD)
+        return false;
+
       nw::string url = request->getUrl();
       if (url.compare(0, location.length(), location) != 0)
         return false;
@@ -87,7 +94,17 @@ class PrecompiledRepository : public WebRepository
       }
 
       webpage=(unsigned char*)((i->second).data); webpageLen=(i->second).length;
+      if ((i->second).mimeType != NULL && getMimeType(url.c_str()) == NULL)
+        response->setStaticMimeType((i->second).mimeType, (i->second).mimeTypeLength);
       pthread_mutex_unlock( &_mutex );
+
+      if (method == OPTIONS_METHOD)
+      {
+        response->setIsZipped(false);
+        response->addHeader("Allow", "GET, HEAD, OPTIONS");
+        return true;
+      }
+
       response->setContent (webpage, webpageLen);
       return true;
 
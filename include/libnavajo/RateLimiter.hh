@@ -0,0 +1,150 @@
+//********************************************************
+/**
+ * @file  RateLimiter.hh
+ *
+ * @brief Requests rate limiting (token buckets per client)
+ *
+ * @author agent (agent@local)
+ *
+ * @version 1
+ * @date 19/10/26
+ */
+//********************************************************
+
+#ifndef RATELIMITER_HH_
+#define RATELIMITER_HH_
+
+#ifdef USE_USTL
+
+#include <libnavajo/with_ustl.h>
+
+#else
+
+#include <string>
+#include <map>
+#include <list>
+#include <vector>
+#include <libnavajo/with_ustl.h>
+
+#endif // USE_USTL
+
+#include <pthread.h>
+
+#include "libnavajo/IpAddress.hh"
+
+#define RATE_LIMITER_SHARDS 16
+#define RATE_LIMITER_MAX_BUCKETS_PER_SHARD 4096
+
+/**
+* The clients a rate limit applies to, separately: by default each ip address
+* has its own bucket
+*/
+typedef enum
+{
+  RATE_LIMIT_BY_IP = 0,
+  RATE_LIMIT_BY_USER = 1,  // the authenticated users, instead of their ip address
+  RATE_LIMIT_BY_ROUTE = 2  // and each url has its own bucket
+} RateLimitKey;
+
+/**
+* RateLimiterStats - rate limiting statistics
+*/
+typedef struct
+{
+  unsigned long requests;  // requests checked
+  unsigned long rejected;  // requests rejected (429)
+  size_t buckets;          // number of clients tracked
+} RateLimiterStats;
+
+class RateLimiter
+{
+    struct Policy
+    {
+      nw::string urlPrefix;
+      double rate, burst;
+      int keys;
+    };
+    nw::vector<Policy> policies; // the longest url prefix first
+
+    struct Bucket
+    {
+      double tokens;
+      unsigned long long time;   // last refill (monotonic, in µs)
+      unsigned long long fullTime; // when the bucket will be full again
+      nw::list<nw::string>::iterator lruIt;
+    };
+
+    typedef nw::map<nw::string, Bucket> BucketsMap;
+
+    struct Shard
+    {
+      pthread_mutex_t mutex;
+      BucketsMap buckets;
+      nw::list<nw::string> lru; // least recently refilled first
+    };
+
+    Shard shards[RATE_LIMITER_SHARDS];
+
+    volatile unsigned long requests, rejected;
+
+    RateLimiter(const RateLimiter&);
+    RateLimiter& operator=(const RateLimiter&);
+
+    inline Shard& getShard(const nw::string& key)
+    {
+      unsigned h = 0;
+      for (size_t i = 0; i < key.size(); i++) h = h * 31 + (unsigned char)key[i];
+      return shards[h % RATE_LIMITER_SHARDS];
+    };
+
+    const Policy* getPolicy(const char *url) const;
+    nw::string getKey(const Policy *policy, const IpAddress& ip, const nw::string& username, const char *url) const;
+    unsigned takeToken(const Policy *policy, const nw::string& key, const bool take);
+    static void purge(Shard& shard, const unsigned long long now);
+
+  public:
+    RateLimiter();
+    ~RateLimiter();
+
+    /**
+    * Limit the requests rate of the clients
+    * @param urlPrefix: the urls concerned (the longest matching prefix
+    *   applies), "" for all. The leading slashes are ignored: "/api" and
+    *   "api" are the same prefix.
+    * @param rate: the requests per second, 0 for no limit
+    * @param burst: the requests accepted at once
+    * @param keys: RateLimitKey values, or-ed
+    */
+    void setLimit(const nw::string& urlPrefix, const double rate, const size_t burst, const int keys=RATE_LIMIT_BY_IP);
+
+    inline bool isEnabled() const { return !policies.empty(); };
+
+    /**
+    * Check a request before the credentials are verified: a token is taken
+    * from the bucket of the client's ip address. For the policies by user,
+    * the bucket is only tested: it is used by the requests without valid
+    * credentials (see checkUser), so that the passwords guessing is limited
+    * before it reaches the authentification.
+    * @param ip: the client address
+    * @param url: the requested url (its leading slashes are ignored)
+    * @return 0 if the request is accepted, else the delay (in seconds)
+    *   before a token is available
+    */
+    unsigned checkClient(const IpAddress& ip, const char *url);
+
+    /**
+    * Check a request after the credentials are verified, for the policies
+    * by user only: a token is taken from the user's bucket, or from the
+    * bucket of the ip address if the request is not authenticated.
+    * @param ip: the client address
+    * @param username: the authenticated user, or ""
+    * @param url: the requested url (its leading slashes are ignored)
+    * @return 0 if the request is accepted, else the delay (in seconds)
+    *   before a token is available
+    */
+    unsigned checkUser(const IpAddress& ip, const nw::string& username, const char *url);
+
+    void getStats(RateLimiterStats& stats);
+};
+
+#endif
@@ -0,0 +1,119 @@
+//****************************************************************************
+/**
+ * @file  RequestArena.hh
+ *
+ * @brief Request scoped memory (bump allocator)
+ *
+ * @author agent (agent@local)
+ *
+ * @version 1
+ * @date 19/10/26
+ */
+//****************************************************************************
+
+#ifndef REQUESTARENA_HH_
+#define REQUESTARENA_HH_
+
+#include <stdlib.h>
+#include <string.h>
+
+#define REQUEST_ARENA_CHUNK_SIZE 16384
+
+/**
+* RequestArena - memory owned by a pool thread and released all at once at
+* the end of each request: allocations are a pointer increment and never
+* contend with the other threads.
+*/
+class RequestArena
+{
+    struct Chunk
+    {
+      Chunk *next;
+      size_t size, used;
+    };
+
+    Chunk *first, *current;
+
+    RequestArena(const RequestArena&);
+    RequestArena& operator=(const RequestArena&);
+
+    inline static char* chunkData(Chunk *c) { return (char*)c + sizeof(Chunk); };
+
+    inline Chunk* newChunk(size_t size)
+    {
+      Chunk *c=(Chunk*)malloc(sizeof(Chunk)+size);
+      if (c == NULL) return NULL;
+      c->next=NULL;
+      c->size=size;
+      c->used=0;
+      return c;
+    };
+
+  public:
+    RequestArena(): first(NULL), current(NULL) {};
+    ~RequestArena()
+    {
+      reset();
+      free(first);
+    };
+
+    /**
+    * Allocate memory, valid until the next reset
+    * @param size: the number of bytes
+    * @return the memory (aligned on 8 bytes) or NULL
+    */
+    inline void* allocate(size_t size)
+    {
+      size=(size + 7) & ~(size_t)7;
+
+      if (current == NULL)
+      {
+        if (first == NULL && (first=newChunk(REQUEST_ARENA_CHUNK_SIZE)) == NULL)
+          return NULL;
+        current=first;
+      }
+
+      if (current->used + size > current->size)
+      {
+        Chunk *c=newChunk(size > REQUEST_ARENA_CHUNK_SIZE ? size : REQUEST_ARENA_CHUNK_SIZE);
+        if (c == NULL) return NULL;
+        current->next=c;
+        current=c;
+      }
+
+      void *res=chunkData(current) + current->used;
+      current->used+=size;
+      return res;
+    };
+
+    /**
+    * Copy a string in the arena
+    */
+    inline char* strndup(const char *str, size_t len)
+    {
+      char *res=(char*)allocate(len+1);
+      if (res == NULL) return NULL;
+      memcpy(res, str, len);
+      res[len]='\0';
+      return res;
+    };
+
+    /**
+    * Release all the allocations (the first chunk is kept for the next request)
+    */
+    inline void reset()
+    {
+      if (first == NULL) return;
+      for (Chunk *c=first->next; c != NULL; )
+      {
+        Chunk *next=c->next;
+        free(c);
+        c=next;
+      }
+      first->next=NULL;
+      first->used=0;
+      current=first;
+    };
+};
+
+#endif
@@ -0,0 +1,143 @@
+//********************************************************
+/**
+ * @file  SslSessionCache.hh
+ *
+ * @brief TLS session resumption: server side sessions cache
+ *        and session tickets keys management
+ *
+ * @author agent (agent@local)
+ *
+ * @version 1
+ * @date 19/10/26
+ */
+//********************************************************
+
+#ifndef SSLSESSIONCACHE_HH_
+#define SSLSESSIONCACHE_HH_
+
+#ifdef USE_USTL
+
+#include <libnavajo/with_ustl.h>
+
+#else
+
+#include <string>
+#include <map>
+#include <list>
+#include <libnavajo/with_ustl.h>
+
+#endif // USE_USTL
+
+#include <time.h>
+#include <openssl/ssl.h>
+
+#include "libnavajo/thread.h"
+
+#define SSL_SESSION_CACHE_SHARDS 16
+
+/**
+* SslSessionStats - TLS handshakes statistics
+*/
+typedef struct
+{
+  unsigned long handshakes;          // successful handshakes
+  unsigned long resumedHandshakes;   // handshakes resumed (session cache or ticket)
+  unsigned long cacheHits;           // session ids found in the cache
+  unsigned long cacheMisses;         // session ids not found in the cache
+  unsigned long ticketKeysRotations;
+  size_t cacheSize;                  // number of cached sessions
+} SslSessionStats;
+
+class SslSessionCache
+{
+    struct TicketKey
+    {
+      unsigned char name[16];
+      unsigned char aesKey[32];
+      unsigned char hmacKey[32];
+      time_t creation;
+    };
+
+    struct CachedSession
+    {
+      SSL_SESSION *session;
+      time_t expiration;
+      nw::list<nw::string>::iterator lruIt;
+    };
+
+    typedef nw::map<nw::string, CachedSession> SessionsMap;
+
+    struct Shard
+    {
+      pthread_mutex_t mutex;
+      SessionsMap sessions;
+      nw::list<nw::string> lru; // least recently used first
+    };
+
+    Shard shards[SSL_SESSION_CACHE_SHARDS];
+    size_t maxSessionsPerShard;
+    time_t sessionTimeout;
+
+    // current key first, then the previous one (still accepted for decryption)
+    TicketKey ticketKeys[2];
+    size_t nbTicketKeys;
+    time_t ticketKeyLifetime;
+    pthread_mutex_t ticketKeys_mutex;
+
+    volatile unsigned long handshakes, resumedHandshakes, cacheHits, cacheMisses, ticketKeysRotations;
+
+    static int exDataIndex;
+
+    inline Shard& getShard(const unsigned char *id, unsigned int len)
+    {
+      unsigned h = 0;
+      for (unsigned int i = 0; i < len; i++) h = h * 31 + id[i];
+      return shards[h % SSL_SESSION_CACHE_SHARDS];
+    };
+
+    void removeSession(const unsigned char *id, unsigned int len);
+    bool generateTicketKey(TicketKey& key);
+    bool getTicketKey(const unsigned char *name, bool encrypt, TicketKey& key, bool& isCurrent);
+
+    static SslSessionCache* fromSSL(SSL *ssl);
+    static int newSessionCallback(SSL *ssl, SSL_SESSION *session);
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    static SSL_SESSION* getSessionCallback(SSL *ssl, const unsigned char *id, int len, int *copy);
+#else
+    static SSL_SESSION* getSessionCallback(SSL *ssl, unsigned char *id, int len, int *copy);
+#endif
+    static void removeSessionCallback(SSL_CTX *ctx, SSL_SESSION *session);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    static int ticketKeyCallback(SSL *ssl, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *ectx, EVP_MAC_CTX *hctx, int enc);
+#else
+    static int ticketKeyCallback(SSL *ssl, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *ectx, HMAC_CTX *hctx, int enc);
+#endif
+
+  public:
+    SslSessionCache();
+    ~SslSessionCache();
+
+    /**
+    * Install the sessions cache and/or the session tickets handling
+    * @param ctx: the SSL context
+    * @param maxSessions: cache size (0 disables the server side cache)
+    * @param timeout: sessions lifetime in seconds
+    * @param ticketKeyLifetime: tickets keys rotation period in seconds
+    *   (0 disables the session tickets)
+    */
+    void attach(SSL_CTX *ctx, const size_t maxSessions, const time_t timeout, const time_t ticketKeyLifetime);
+
+    /**
+    * Record a successful handshake
+    * @param resumed: true if the session has been resumed
+    */
+    inline void recordHandshake(const bool resumed)
+    {
+      __sync_fetch_and_add(&handshakes, 1);
+      if (resumed) __sync_fetch_and_add(&resumedHandshakes, 1);
+    };
+
+    void getStats(SslSessionStats& stats);
+};
+
+#endif
@@ -14,15 +14,61 @@
 #ifndef WEBREPOSITORY_HH_
 #define WEBREPOSITORY_HH_
 
+#include <unistd.h>
+#include <ctype.h>
+#include <string.h>
+
 #include "HttpRequest.hh"
 #include "HttpResponse.hh"
 
 
 class WebRepository
 {
+    nw::map<nw::string, nw::string> mimeTypes; // extension (lower case) | mime type
+
   public:
     virtual bool getFile(HttpRequest* request, HttpResponse *response) = 0;
     virtual void freeFile(unsigned char *webpage) = 0;
+    // release a file descriptor given with HttpResponse::setContentFile()
+    virtual void closeFile(int fd) { ::close(fd); };
+
+    /**
+    * Get the methods answered for an url which has not been found for the
+    * request method (405 Method Not Allowed)
+    * @param url: the url
+    * @return the "Allow" header value, or an empty string if the url is unknown
+    */
+    virtual nw::string getAllowedMethods(const char *url) const { return ""; };
+
+    /**
+    * Set the mime type of an extension for the files of this repository,
+    * instead of the default one (set before the webserver starts)
+    * @param extension: the extension, without the dot
+    * @param type: the mime type
+    */
+    void setMimeType(nw::string extension, const nw::string& type)
+    {
+      for (size_t i=0; i<extension.size(); i++)
+        extension[i]=tolower(extension[i]);
+      mimeTypes[extension]=type;
+    };
+
+    /**
+    * Get the mime type set for the extension of an url
+    * @param url: the url
+    * @return the mime type, or NULL if none has been set
+    */
+    const nw::string* getMimeType(const char *url) const
+    {
+      if (mimeTypes.empty()) return NULL;
+      const char *ext=strrchr(url, '.');
+      if (ext == NULL || strchr(ext, '/') != NULL) return NULL;
+      nw::string extension(ext+1);
+      for (size_t i=0; i<extension.size(); i++)
+        extension[i]=tolower(extension[i]);
+      nw::map<nw::string, nw::string>::const_iterator it=mimeTypes.find(extension);
+      return it != mimeTypes.end() ? &it->second : NULL;
+    };
 };
 
 #endif
@@ -22,6 +22,26 @@
 #define SO_NOSIGPIPE    0x0800
 #endif
 
+#define GZIP_MIN_CONTENT_LENGTH 2048 // smaller contents are not compressed
+#define POOL_THREADS_PER_CPU 4        // default pool maximum size, per online cpu
+#define POOL_THREADS_MIN_PER_CPU 1    // default pool minimum size, per online cpu
+#define POOL_THREAD_QUEUE_SIZE 256    // clients waiting for a pool thread
+#define POOL_THREAD_IDLE_TIMEOUT 60   // seconds before an idle thread exits
+#define POOL_GROW_QUEUE_WAIT 10000    // queue wait (µs) adding a pool thread
+#define DEFAULT_LISTEN_BACKLOG 128
+#define DEFAULT_REQUEST_HEADER_TIMEOUT 10 // seconds to receive the request header
+#define DEFAULT_REQUEST_BODY_TIMEOUT 30   // seconds to receive the request body
+#define DEFAULT_KEEPALIVE_TIMEOUT 1       // seconds waiting for the next request
+#define DEFAULT_KEEPALIVE_MAX_REQUESTS 100
+#define WEBSOCKET_CLIENT_KEY_MAX 128      // longer Sec-WebSocket-Key are refused
+#define WEBSOCKET_SERVER_KEY_LENGTH 28    // base64 of a SHA-1
+#define BASE64_ENCODED_LENGTH(n) (((n) + 2) / 3 * 4)
+#define BASE64_DECODED_MAX_LENGTH(n) (((n) + 3) / 4 * 3)
+#define DEFAULT_AUTH_CACHE_SIZE 4096
+#define DEFAULT_AUTH_ALLOWED_TIMEOUT 600  // seconds a successful authentification is kept
+#define DEFAULT_AUTH_DENIED_TIMEOUT 5     // seconds a failed authentification is kept
+#define DEFAULT_PAM_AUTH_TIMEOUT 10       // seconds the PAM verification of another request is waited for
+
 #ifdef USE_USTL
 
 #include <libnavajo/with_ustl.h>
@@ -29,6 +49,7 @@
 #else
 
 #include <queue>
+#include <vector>
 #include <string>
 #include <map>
 #include <libnavajo/with_ustl.h>
@@ -40,29 +61,87 @@
 
 #include "libnavajo/LogRecorder.hh"
 #include "libnavajo/IpAddress.hh"
+#include "libnavajo/IpNetworkTrie.hh"
+#include "libnavajo/PeerIpHistory.hh"
+#include "libnavajo/SslSessionCache.hh"
+#include "libnavajo/ConnectionManager.hh"
+#include "libnavajo/RateLimiter.hh"
+#include "libnavajo/AuthCache.hh"
+#include "libnavajo/MimeTypes.hh"
 #include "libnavajo/WebRepository.hh"
+#include "libnavajo/HttpResponseHeader.hh"
 #include "libnavajo/thread.h"
+#include "libnavajo/LockFreeQueue.hh"
 #include "libnavajo/nvj_gzip.h"
 
 class WebSocket;
+class AuthPAMVerifications;
 class WebServer
 {
     SSL_CTX *sslCtx;
     int s_server_session_id_context;
     static char *certpass;
+    SslSessionCache *sslSessionCache;
 
-    inline static void freeClientSockData(ClientSockData *c)
+    inline void freeClientSockData(ClientSockData *c)
     {
       if (c == NULL) return;
+      connections.cancelDeadline(c->timer);
+      connections.release(c->ip);
       closeSocket(c);
       if (c->peerDN != NULL) { delete c->peerDN; c->peerDN=NULL; }
+      if (c->requestBuffer != NULL) free(c->requestBuffer);
       free(c);
       c=NULL;
     };
 
-    nw::queue<ClientSockData *> clientsQueue;
-    pthread_cond_t clientsQueue_cond;
+    /**
+    * PoolThread - a pool thread slot and its clients queue. The idle threads
+    * steal the clients queued for the busy ones. There is a slot for each
+    * thread the pool can grow to, the stopped ones are not given clients.
+    */
+    typedef enum { POOL_THREAD_STOPPED, POOL_THREAD_RUNNING, POOL_THREAD_EXITING } PoolThreadState;
+    struct PoolThread
+    {
+      WebServer *webServer;
+      size_t index;
+      LockFreeQueue<ClientSockData *> queue;
+      volatile int sleeping;   // waiting for clients
+      volatile PoolThreadState state;
+      pthread_t thread;
+      pthread_mutex_t mutex;
+      pthread_cond_t cond;
+
+      PoolThread(WebServer *w, size_t i): webServer(w), index(i), queue(POOL_THREAD_QUEUE_SIZE), sleeping(0), state(POOL_THREAD_STOPPED)
+        { pthread_mutex_init(&mutex, NULL); pthread_cond_init(&cond, NULL); };
+      ~PoolThread() { pthread_cond_destroy(&cond); pthread_mutex_destroy(&mutex); };
+    };
+    nw::vector<PoolThread *> poolThreads;
+    pthread_mutex_t poolThreads_mutex; // threads creation
+    volatile size_t nextPoolThread;
+    volatile size_t nbPoolThreads;     // running threads
+    volatile size_t queuedClients;
+    volatile unsigned long queueWaitTime; // average, in µs
+
+    nw::queue<ClientSockData *> clientsQueue; // when the pool threads queues are full
+    volatile size_t clientsQueueSize;
     pthread_mutex_t clientsQueue_mutex;
+    void pushClient(ClientSockData* client);
+    ClientSockData* popClient(PoolThread *thread);
+    bool hasQueuedClient();
+    bool wakePoolThread(size_t index);
+    bool waitClient(PoolThread *thread);
+    void addPoolThread();
+    bool retirePoolThread(PoolThread *thread);
+
+    typedef struct
+    {
+      ClientSockData* client;
+      short events;    // poll events the handshake is waiting for
+      time_t deadline;
+    } TlsHandshake;
+    bool startTlsHandshake(ClientSockData* client);
+    int continueTlsHandshake(TlsHandshake& handshake);
 
     void initialize_ctx(const char *certfile, const char *cafile, const char *password);
     static int password_cb(char *buf, int num, int rwflag, void *userdata);
@@ -71,45 +150,86 @@ class WebServer
     bool isAuthorizedDN(const nw::string str);
 
     void httpSend(ClientSockData *client, const void *buf, size_t len);
+    bool httpSendFile(ClientSockData *client, int fd, size_t len);
+    bool isSendFileAvailable(ClientSockData *client);
+    static unsigned char* readFileContent(int fd, size_t len);
+    static bool getGunzippedLength(const unsigned char *content, int fd, size_t len, size_t& gunzippedLen);
 
-    size_t recvLine(int client, char *bufLine, size_t);
-    bool accept_request(ClientSockData* client);
+    bool recvRequestData(ClientSockData *client, HttpRequestBuffer *buffer);
+    bool accept_request(ClientSockData* client, RequestArena *arena);
     void fatalError(const char *);
     int setSocketRcvTimeout(int connectSocket, int seconds);
-    static nw::string getHttpHeader(const char *messageType, const size_t len=0, const bool keepAlive=true, const bool zipped=false, HttpResponse* response=NULL);
-    static const char* get_mime_type(const char *name);
+    static size_t buildHttpHeader(char *buf, const size_t size, const HttpStatus status, const size_t len, const bool keepAlive, const bool zipped, HttpResponse* response);
+    static nw::string getHttpHeader(const HttpStatus status, const size_t len=0, const bool keepAlive=true, const bool zipped=false, HttpResponse* response=NULL);
+    void sendHttpHeader(ClientSockData *client, const HttpStatus status, const size_t len, const bool keepAlive, const bool zipped,
+                        HttpResponse* response, RequestArena *arena);
     u_short init();
 
-    static nw::string getNoContentErrorMsg();
     static nw::string getBadRequestErrorMsg();
     static nw::string getNotFoundErrorMsg();
     static nw::string getInternalServerErrorMsg();
     static nw::string getNotImplementedErrorMsg();
 
     void initPoolThreads();
+    void stopPoolThreads();
     inline static void *startPoolThread(void *t)
     {
-      static_cast<WebServer *>(t)->poolThreadProcessing();
+      PoolThread *thread=static_cast<PoolThread *>(t);
+      thread->webServer->poolThreadProcessing(thread);
       pthread_exit(NULL);
       return NULL;
     };
-    void poolThreadProcessing();
+    void poolThreadProcessing(PoolThread *thread);
+    static void setCpuAffinity(size_t index);
+
+    /**
+    * Acceptor - a thread accepting the connections on its listening sockets
+    * (one per address family), and driving the TLS handshakes. The requests
+    * are then read and written by the pool threads, with blocking I/O.
+    */
+    struct Acceptor
+    {
+      WebServer *webServer;
+      size_t index;
+      nw::vector<int> sockets;
+      pthread_t thread;
+
+      Acceptor(WebServer *w, size_t i): webServer(w), index(i) {};
+    };
+    nw::vector<Acceptor *> acceptors;
+    size_t nbAcceptors;  // 0: the default
+    int listenBacklog;
+
+    inline static void *startAcceptorThread(void *t)
+    {
+      Acceptor *acceptor=static_cast<Acceptor *>(t);
+      acceptor->webServer->acceptorProcessing(acceptor);
+      pthread_exit(NULL);
+      return NULL;
+    };
+    void acceptorProcessing(Acceptor *acceptor);
+    void openListeningSockets(nw::vector<int>& sockets, const bool reusePort);
+    int acceptClient(int serverSocket, struct sockaddr_storage *address);
 
     bool httpdAuth;
 
+    ConnectionManager connections;
+    RateLimiter rateLimiter;
+    time_t requestHeaderTimeout, requestBodyTimeout, keepAliveTimeout;
+    size_t keepAliveMaxRequests;
+
     volatile bool exiting;
-    volatile size_t exitedThread;
-    volatile int server_sock [ 3 ];
-    volatile size_t nbServerSock;
+    nw::vector<int> serverSockets;
 
-    const static char authStr[];
 
-    nw::map<nw::string,time_t> usersAuthHistory;
-    pthread_mutex_t usersAuthHistory_mutex;
-    nw::map<IpAddress,time_t> peerIpHistory;
+    AuthCache authCache;
+    size_t authCacheSize;
+    time_t authAllowedTimeout, authDeniedTimeout;
+    AuthPAMVerifications *pamVerifications;
+    PeerIpHistory peerIpHistory;
     nw::map<nw::string,time_t> peerDnHistory;
     pthread_mutex_t peerDnHistory_mutex;
-    void updatePeerIpHistory(IpAddress&);
+    void updatePeerIpHistory(const IpAddress&);
     void updatePeerDnHistory(nw::string);
     static int verify_callback(int preverify_ok, X509_STORE_CTX *ctx);
     static const int verify_depth;
@@ -122,31 +242,36 @@ class WebServer
     static nw::string webServerName;
     bool disableIpV4, disableIpV6;
     ushort tcpPort;
-    size_t threadsPoolSize;
+    size_t threadsPoolSize, threadsPoolMinSize;
+    time_t threadsPoolIdleTimeout;
+    bool threadsAffinity;
     nw::string device;
 
     bool sslEnabled;
     nw::string sslCertFile, sslCaFile, sslCertPwd;
+    size_t sslSessionCacheSize;
+    time_t sslSessionTimeout, sslTicketKeyLifetime;
+    bool useKtls;
     nw::vector<nw::string> authLoginPwdList;
     bool authPeerSsl;
     nw::vector<nw::string> authDnList;
     bool authPam;
     nw::string pamService;
     nw::vector<nw::string> authPamUsersList;
+    time_t pamTimeout;
     inline bool isAuthPam() { return authPam; };
-    nw::vector<IpNetwork> hostsAllowed;
+    IpNetworkTrie hostsAllowed, hostsDenied;
     nw::vector<WebRepository *> webRepositories;
-    static inline bool is_base64(unsigned char c)
-      { return (isalnum(c) || (c == '+') || (c == '/')); };
-    static const nw::string base64_chars;
+    static const char base64_chars[];
+    static const signed char base64_values[256]; // -1: not a base64 character
+    static size_t base64_decode(const char *in, const size_t len, unsigned char *out);
     static nw::string base64_decode(const nw::string& encoded_string);
-    static nw::string base64_encode(unsigned char const* bytes_to_encode, unsigned int in_len);
+    static size_t base64_encode(const unsigned char *in, const size_t len, char *out);
     static void closeSocket(ClientSockData* client);
     nw::map<nw::string, WebSocket *> webSocketEndPoints;
-    static nw::string SHA1_encode(const nw::string& input);
-    static const nw::string webSocketMagicString;
-    static nw::string generateWebSocketServerKey(nw::string webSocketKey);
-    static nw::string getHttpWebSocketHeader(const char *messageType, const char* webSocketClientKey, const bool webSocketDeflate);
+    static const char webSocketMagicString[];
+    static bool generateWebSocketServerKey(const char *webSocketKey, char *serverKey);
+    static nw::string getHttpWebSocketHeader(const HttpStatus status, const char* webSocketClientKey, const bool webSocketDeflate);
     void listenWebSocket(WebSocket *websocket, HttpRequest* request);
     void startWebSocketListener(WebSocket *websocket, HttpRequest* request);
     nw::list<int> webSocketClientList;
@@ -168,6 +293,14 @@ class WebServer
 
   public:
     WebServer();
+
+    /**
+    * is it worth compressing a content of this mime type ?
+    * @param mime: the mime type
+    */
+    inline static bool isCompressibleMimeType(const char *mime) { return MimeTypes::isCompressible(mime); };
+    inline static bool isCompressibleMimeType(const nw::string& mime) { return MimeTypes::isCompressible(mime.c_str()); };
+
     static void webSocketSend(HttpRequest* request, const u_int8_t opcode, const unsigned char* message, size_t length, bool fin);
     static void webSocketSendTextMessage(HttpRequest* request, const nw::string &message, bool fin=true);
     static void webSocketSendBinaryMessage(HttpRequest* request, const unsigned char* message, size_t length, bool fin=true);
@@ -185,11 +318,128 @@ class WebServer
     inline void setWebServerName(const nw::string& name) { webServerName = name; }
 
     /**
-    * Set the size of the listener thread pool.
-    * @param nbThread: the number of thread available (Default value: 5)
+    * Set the maximum size of the listener thread pool. The pool grows when
+    * the clients have to wait for a thread.
+    * @param nbThread: the number of thread available, 0 for the default value
+    *  (POOL_THREADS_PER_CPU threads per online cpu)
     */
     inline void setThreadsPoolSize(const size_t nbThread) { threadsPoolSize = nbThread; };
 
+    /**
+    * Set the minimum size of the listener thread pool, started with the server
+    * @param nbThread: the number of thread, 0 for the default value
+    *  (POOL_THREADS_MIN_PER_CPU threads per online cpu)
+    */
+    inline void setThreadsPoolMinSize(const size_t nbThread) { threadsPoolMinSize = nbThread; };
+
+    /**
+    * Set the delay after which an idle thread exits (down to the minimum size)
+    * @param seconds: the delay (Default value: POOL_THREAD_IDLE_TIMEOUT)
+    */
+    inline void setThreadsPoolIdleTimeout(const time_t seconds) { threadsPoolIdleTimeout = seconds; };
+
+    /**
+    * @return the number of running pool threads
+    */
+    inline size_t getThreadsPoolCount() const { return nbPoolThreads; };
+
+    /**
+    * @return the average time the clients wait for a pool thread, in µs
+    */
+    inline unsigned long getQueueWaitTime() const { return queueWaitTime; };
+
+    /**
+    * @return the number of clients waiting for a pool thread
+    */
+    inline size_t getQueuedClientsCount() const { return queuedClients; };
+
+    /**
+    * Pin the pool threads on the cpus (round robin). Linux only.
+    * @param a: enabled or not (Default value: false)
+    */
+    inline void setThreadsAffinity(const bool a=true) { threadsAffinity = a; };
+
+    /**
+    * Set the number of acceptor threads. With more than one, each acceptor
+    * has its own listening sockets (SO_REUSEPORT: the kernel balances the
+    * connections between them) and is pinned on a cpu if the threads
+    * affinity is enabled. The acceptors run the TLS handshakes. Linux only.
+    * @param n: the number of acceptors (Default value: 1, one per cpu if
+    *   SSL is enabled)
+    */
+    inline void setAcceptorsCount(const size_t n) { nbAcceptors = n ? n : 1; };
+
+    /**
+    * Set the maximum number of connections. Once reached, the new
+    * connections are closed.
+    * @param n: the connections count, 0 for no limit (Default value: 0)
+    */
+    inline void setMaxConnections(const size_t n) { connections.setMaxConnections(n); };
+
+    /**
+    * Set the maximum number of connections from an ip address
+    * @param n: the connections count, 0 for no limit (Default value: 0)
+    */
+    inline void setMaxConnectionsPerIp(const size_t n) { connections.setMaxConnectionsPerIp(n); };
+
+    /**
+    * @return the number of open connections
+    */
+    inline size_t getConnectionsCount() const { return connections.getConnectionsCount(); };
+
+    /**
+    * Limit the requests rate of each client (token bucket). The requests
+    * over the limit are answered "429 Too Many Requests", before their
+    * credentials are verified. To be set before the server is started.
+    * @param urlPrefix: the urls concerned (the longest matching prefix
+    *   applies), "" for all. The leading slashes are ignored.
+    * @param rate: the requests per second, 0 for no limit
+    * @param burst: the requests accepted at once
+    * @param keys: RateLimitKey values, or-ed (Default value: RATE_LIMIT_BY_IP,
+    *   each ip address has its own bucket). With RATE_LIMIT_BY_USER, the
+    *   requests without valid credentials use the bucket of their ip address.
+    */
+    inline void setRateLimit(const nw::string& urlPrefix, const double rate, const size_t burst, const int keys=RATE_LIMIT_BY_IP)
+      { rateLimiter.setLimit(urlPrefix, rate, burst, keys); };
+
+    /**
+    * Get the rate limiting statistics
+    * @param stats: the requests checked and rejected, the clients tracked
+    */
+    inline void getRateLimiterStats(RateLimiterStats& stats) { rateLimiter.getStats(stats); };
+
+    /**
+    * Set the delay to receive a request header (from its first byte for the
+    * next requests of a persistent connection). The connection is closed
+    * once expired.
+    * @param seconds: the delay, 0 for no limit (Default value: DEFAULT_REQUEST_HEADER_TIMEOUT)
+    */
+    inline void setRequestHeaderTimeout(const time_t seconds) { requestHeaderTimeout = seconds; };
+
+    /**
+    * Set the delay to receive a request body (and a websocket message)
+    * @param seconds: the delay, 0 for no limit (Default value: DEFAULT_REQUEST_BODY_TIMEOUT)
+    */
+    inline void setRequestBodyTimeout(const time_t seconds) { requestBodyTimeout = seconds; };
+
+    /**
+    * Set the delay a persistent connection waits for the next request
+    * @param seconds: the delay, 0 for no limit (Default value: DEFAULT_KEEPALIVE_TIMEOUT)
+    */
+    inline void setKeepAliveTimeout(const time_t seconds) { keepAliveTimeout = seconds; };
+
+    /**
+    * Set the number of requests served by a persistent connection
+    * @param n: the requests count, 0 for no limit (Default value: DEFAULT_KEEPALIVE_MAX_REQUESTS)
+    */
+    inline void setKeepAliveMaxRequests(const size_t n) { keepAliveMaxRequests = n; };
+
+    /**
+    * Set the maximum length of the pending connections queue (listen backlog)
+    * @param backlog: the queue length (Default value: 128)
+    */
+    inline void setListenBacklog(const int backlog) { listenBacklog = backlog; };
+
     /**
     * Set the tcp port to listen.
     * @param p: the port number, from 1 to 65535 (Default value: 8080)
@@ -211,6 +461,37 @@ class WebServer
     inline void setUseSSL(bool ssl, const char* certFile = "", const char* certPwd = "")
         { sslEnabled = ssl; sslCertFile = certFile; sslCertPwd = certPwd; };
 
+    /**
+    * Configure the server side TLS sessions cache (sharded, in-process)
+    * @param maxSessions: the maximum number of cached sessions, 0 to disable the cache (Default value: 20480)
+    * @param timeout: the sessions lifetime in seconds (Default value: 300)
+    */
+    inline void setSslSessionCache(const size_t maxSessions, const time_t timeout = 300)
+        { sslSessionCacheSize = maxSessions; sslSessionTimeout = timeout; };
+
+    /**
+    * Configure the TLS session tickets
+    * @param keyLifetime: the ticket keys rotation period in seconds, 0 to disable the tickets (Default value: 3600)
+    */
+    inline void setSslSessionTickets(const time_t keyLifetime) { sslTicketKeyLifetime = keyLifetime; };
+
+    /**
+    * Enable the kernel TLS offload (OpenSSL 3 and Linux "tls" module needed,
+    *   plain OpenSSL is used otherwise): static files are then sent with sendfile()
+    * @param ktls: boolean (Default value: false)
+    */
+    inline void setUseKtls(bool ktls = true) { useKtls = ktls; };
+
+    /**
+    * Get the TLS handshakes and sessions resumption statistics
+    * @param stats: filled with the current values (zeroed if SSL is not used)
+    */
+    inline void getSslSessionStats(SslSessionStats& stats)
+    {
+      if (sslSessionCache != NULL) sslSessionCache->getStats(stats);
+      else memset(&stats, 0, sizeof stats);
+    };
+
     /**
     * Enabled or disabled X509 authentification
     * @param a: boolean. X509 authentification is required if a is true.
@@ -243,6 +524,32 @@ class WebServer
     */
     inline void addAuthPamUser(const char* user) { authPamUsersList.push_back(nw::string(user)); };
 
+    /**
+    * Configure the PAM verifications: they are run by the request threads,
+    *   a single one at a time for the same credentials, the other requests
+    *   wait for its result
+    * @param timeout: the delay in seconds after which a request waiting for
+    *   the verification of another request is refused
+    *   (Default value: DEFAULT_PAM_AUTH_TIMEOUT)
+    */
+    inline void setPamAuthTimeout(const time_t timeout) { pamTimeout = timeout; };
+
+    /**
+    * Configure the http authentifications cache: the results are found by a
+    *   salted hash of the credentials
+    * @param maxEntries: the maximum number of cached results, 0 to disable the cache (Default value: DEFAULT_AUTH_CACHE_SIZE)
+    * @param allowedTimeout: the lifetime of a successful authentification in seconds (Default value: DEFAULT_AUTH_ALLOWED_TIMEOUT)
+    * @param deniedTimeout: the lifetime of a failed authentification in seconds, 0 to not keep them (Default value: DEFAULT_AUTH_DENIED_TIMEOUT)
+    */
+    inline void setAuthCache(const size_t maxEntries, const time_t allowedTimeout = DEFAULT_AUTH_ALLOWED_TIMEOUT, const time_t deniedTimeout = DEFAULT_AUTH_DENIED_TIMEOUT)
+        { authCacheSize = maxEntries; authAllowedTimeout = allowedTimeout; authDeniedTimeout = deniedTimeout; };
+
+    /**
+    * Get the http authentifications cache statistics
+    * @param stats: the hits, misses and cached results
+    */
+    inline void getAuthCacheStats(AuthCacheStats& stats) { authCache.getStats(stats); };
+
     /**
     * Add a web repository (containing web pages)
     * @param repo : a pointer to a WebRepository instance
@@ -270,13 +577,32 @@ class WebServer
     * set network access restriction to webserver.
     * @param ipnet: an IpNetwork of allowed web client to add
     */
-    inline void addHostsAllowed(const IpNetwork &ipnet) { hostsAllowed.push_back(ipnet); };
+    inline void addHostsAllowed(const IpNetwork &ipnet) { hostsAllowed.add(ipnet); };
 
     /**
-    * Get the list of http client peer IP address.
+    * set network access restriction to webserver (checked after the allowed
+    * networks)
+    * @param ipnet: an IpNetwork of denied web client to add
+    */
+    inline void addHostsDenied(const IpNetwork &ipnet) { hostsDenied.add(ipnet); };
+
+    /**
+    * Get the list of http client peer IP address (the most recent ones).
     * @return a map of every IP address and last connection to the webserver
     */
-    inline nw::map<IpAddress,time_t>& getPeerIpHistory() { return peerIpHistory; };
+    inline nw::map<IpAddress,time_t> getPeerIpHistory() const
+    {
+      nw::map<IpAddress,time_t> history;
+      peerIpHistory.getSnapshot(history);
+      return history;
+    };
+
+    /**
+    * Get the recent http clients, with their connections count
+    * @param history: filled with every IP address, its last connection and
+    *   its number of connections
+    */
+    inline void getPeerIpStats(nw::map<IpAddress,PeerIpStats>& history) const { peerIpHistory.getSnapshot(history); };
 
     /**
     * Get the list of http client DN (work with X509 authentification)
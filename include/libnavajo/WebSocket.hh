@@ -21,25 +21,114 @@
 #else
 
 #include <algorithm>
-#include <list>
+#include <map>
+#include <set>
 #include <libnavajo/with_ustl.h>
 
 #endif // USE_USTL
 
 #include "libnavajo/HttpRequest.hh"
 #include "libnavajo/WebServer.hh"
+#include "libnavajo/WebSocketClient.hh"
 
 class WebSocket
 {
-    nw::list<HttpRequest*> wsclients;
+    typedef nw::set<HttpRequest*> ClientsSet;
+    typedef nw::map<nw::string, ClientsSet> TopicsMap;
+    typedef nw::map<HttpRequest*, nw::set<nw::string> > SubscriptionsMap;
+
+    ClientsSet wsclients;
+    TopicsMap topics; // topic name | subscribers
+    SubscriptionsMap subscriptions; // client | subscribed topics
     pthread_mutex_t wsclients_mutex;
+    size_t outboundQueueLowWatermark, outboundQueueHighWatermark;
+    WebSocketOverflowPolicy overflowPolicy;
+
+    /**
+    * Send the same frame to a set of clients (wsclients_mutex must be locked).
+    * The frame is encoded once per compression mode and shared by the
+    * clients's outbound queues.
+    */
+    inline static void sendFrameToClients(const ClientsSet& clients, const u_int8_t opcode, const unsigned char* message, size_t length, bool fin)
+    {
+      WebSocketFrame *frame=NULL, *deflatedFrame=NULL;
+
+      for (ClientsSet::const_iterator it = clients.begin(); it != clients.end(); it++)
+      {
+        ClientSockData *client=(*it)->getClientSockData();
+        if (client->webSocketClient == NULL) continue;
+
+        WebSocketFrame **f = client->compression == ZLIB ? &deflatedFrame : &frame;
+        if (*f == NULL && (*f = WebSocketFrame::create(opcode, message, length, fin, client->compression == ZLIB)) == NULL)
+          continue;
+        client->webSocketClient->send(*f);
+      }
+
+      if (frame != NULL) frame->release();
+      if (deflatedFrame != NULL) deflatedFrame->release();
+    };
+
+    inline void sendBroadcast(const u_int8_t opcode, const unsigned char* message, size_t length, bool fin)
+    {
+      pthread_mutex_lock(&wsclients_mutex);
+      sendFrameToClients(wsclients, opcode, message, length, fin);
+      pthread_mutex_unlock(&wsclients_mutex);
+    };
+
+    inline void publish(const nw::string& topic, const u_int8_t opcode, const unsigned char* message, size_t length, bool fin)
+    {
+      pthread_mutex_lock(&wsclients_mutex);
+      TopicsMap::const_iterator it = topics.find(topic);
+      if (it != topics.end())
+        sendFrameToClients(it->second, opcode, message, length, fin);
+      pthread_mutex_unlock(&wsclients_mutex);
+    };
+
+    inline void unsubscribeLocked(HttpRequest* request, const nw::string& topic)
+    {
+      TopicsMap::iterator it = topics.find(topic);
+      if (it == topics.end()) return;
+      it->second.erase(request);
+      if (it->second.empty()) topics.erase(it);
+    };
 
   public:
-    WebSocket()
+    WebSocket(): outboundQueueLowWatermark(256*1024), outboundQueueHighWatermark(1024*1024), overflowPolicy(WS_OVERFLOW_DROP)
     {
       pthread_mutex_init(&wsclients_mutex, NULL);
     }
 
+    /**
+    * Set the outbound queue limits of each client connection (in bytes).
+    * When a slow client has more than high bytes pending, the overflow policy
+    * is applied. onWritable() is called once the queue is below low again.
+    * @param low: the low watermark (Default value: 256KB)
+    * @param high: the high watermark (Default value: 1MB)
+    */
+    inline void setOutboundQueueWatermarks(const size_t low, const size_t high)
+      { outboundQueueLowWatermark = low < high ? low : high; outboundQueueHighWatermark = high; };
+
+    inline size_t getOutboundQueueLowWatermark() const { return outboundQueueLowWatermark; };
+    inline size_t getOutboundQueueHighWatermark() const { return outboundQueueHighWatermark; };
+
+    /**
+    * Set the policy applied to slow clients when their outbound queue is full
+    * @param p: WS_OVERFLOW_DROP (Default value), WS_OVERFLOW_COALESCE or WS_OVERFLOW_CLOSE
+    */
+    inline void setOverflowPolicy(const WebSocketOverflowPolicy p) { overflowPolicy = p; };
+    inline WebSocketOverflowPolicy getOverflowPolicy() const { return overflowPolicy; };
+
+    /**
+    * get the number of bytes waiting in the client outbound queue
+    * @param request: the http request object
+    * @return the queue depth in bytes
+    */
+    inline static size_t getOutboundQueueSize(HttpRequest* request)
+    {
+      WebSocketClient *wsClient=request->getClientSockData()->webSocketClient;
+      return wsClient != NULL ? wsClient->getQueuedBytes() : 0;
+    };
+
     /**
     * Callback on new websocket client connection
     * @param request: the http request object
@@ -99,6 +188,26 @@ class WebSocket
     virtual bool onCloseCtrlFrame(HttpRequest* request, const unsigned char* message, size_t len)
     { return true; };
 
+    /**
+    * Callback when the client outbound queue reached the high watermark.
+    * Called afterwards from the connection's thread (as onTextMessage()),
+    * not from the thread whose frame has been refused: the clients and the
+    * topics can be updated, and messages sent or broadcast, from here.
+    * @param request: the http request object
+    * @param queuedBytes: the current queue depth in bytes
+    */
+    virtual void onQueueOverflow(HttpRequest* request, size_t queuedBytes)
+    { };
+
+    /**
+    * Callback when the client outbound queue went down to the low watermark,
+    * after having reached the high watermark.
+    * Called from the connection's thread.
+    * @param request: the http request object
+    */
+    virtual void onWritable(HttpRequest* request)
+    { };
+
     /**
     * Send Text Message on the websocket
     * @param request: the http request object
@@ -110,12 +219,14 @@ class WebSocket
       WebServer::webSocketSendTextMessage(request, message, fin);
     };
 
+    /**
+    * Send Text Message to all the websocket clients
+    * @param message: the text message
+    * @param fin: is-it the final fragment of the message ?
+    */
     inline void sendBroadcastTextMessage(const nw::string &message, bool fin=true)
     {
-      pthread_mutex_lock(&wsclients_mutex);
-      for (nw::list<HttpRequest*>::iterator it = wsclients.begin(); it != wsclients.end(); it++)
-        WebServer::webSocketSendTextMessage(*it, message, fin);
-      pthread_mutex_unlock(&wsclients_mutex);
+      sendBroadcast(0x1, (const unsigned char*)(message.c_str()), message.length(), fin);
     };
 
     /**
@@ -130,6 +241,17 @@ class WebSocket
       WebServer::webSocketSendBinaryMessage(request, message, length, fin);
     };
 
+    /**
+    * Send Binary Message to all the websocket clients
+    * @param message: the content
+    * @param length: the message length
+    * @param fin: is-it the final fragment of the message ?
+    */
+    inline void sendBroadcastBinaryMessage(const unsigned char* message, size_t length, bool fin=true)
+    {
+      sendBroadcast(0x2, message, length, fin);
+    };
+
     /**
     * Send Close Message Notification on the websocket
     * @param request: the http request object
@@ -194,18 +316,111 @@ class WebSocket
       WebServer::webSocketSendPongCtrlFrame(request, message);
     };
 
+    /**
+    * Subscribe a client to a topic (the topic is created if needed)
+    * @param request: the http request object
+    * @param topic: the topic name
+    * @return false if the client has been removed (not subscribed)
+    */
+    inline bool subscribe(HttpRequest* request, const nw::string& topic)
+    {
+      pthread_mutex_lock(&wsclients_mutex);
+      bool connected = wsclients.count(request) != 0;
+      if (connected)
+      {
+        topics[topic].insert(request);
+        subscriptions[request].insert(topic);
+      }
+      pthread_mutex_unlock(&wsclients_mutex);
+      return connected;
+    };
+
+    /**
+    * Unsubscribe a client from a topic
+    * @param request: the http request object
+    * @param topic: the topic name
+    */
+    inline void unsubscribe(HttpRequest* request, const nw::string& topic)
+    {
+      pthread_mutex_lock(&wsclients_mutex);
+      unsubscribeLocked(request, topic);
+      SubscriptionsMap::iterator it = subscriptions.find(request);
+      if (it != subscriptions.end())
+      {
+        it->second.erase(topic);
+        if (it->second.empty()) subscriptions.erase(it);
+      }
+      pthread_mutex_unlock(&wsclients_mutex);
+    };
+
+    /**
+    * Is the client subscribed to the topic ?
+    * @param request: the http request object
+    * @param topic: the topic name
+    */
+    inline bool isSubscribed(HttpRequest* request, const nw::string& topic)
+    {
+      pthread_mutex_lock(&wsclients_mutex);
+      TopicsMap::const_iterator it = topics.find(topic);
+      bool res = it != topics.end() && it->second.count(request);
+      pthread_mutex_unlock(&wsclients_mutex);
+      return res;
+    };
+
+    /**
+    * get the number of clients subscribed to a topic
+    * @param topic: the topic name
+    */
+    inline size_t getSubscribersCount(const nw::string& topic)
+    {
+      pthread_mutex_lock(&wsclients_mutex);
+      TopicsMap::const_iterator it = topics.find(topic);
+      size_t res = it != topics.end() ? it->second.size() : 0;
+      pthread_mutex_unlock(&wsclients_mutex);
+      return res;
+    };
+
+    /**
+    * Send Text Message to the clients subscribed to a topic
+    * @param topic: the topic name
+    * @param message: the text message
+    * @param fin: is-it the final fragment of the message ?
+    */
+    inline void publishTextMessage(const nw::string& topic, const nw::string &message, bool fin=true)
+    {
+      publish(topic, 0x1, (const unsigned char*)(message.c_str()), message.length(), fin);
+    };
+
+    /**
+    * Send Binary Message to the clients subscribed to a topic
+    * @param topic: the topic name
+    * @param message: the content
+    * @param length: the message length
+    * @param fin: is-it the final fragment of the message ?
+    */
+    inline void publishBinaryMessage(const nw::string& topic, const unsigned char* message, size_t length, bool fin=true)
+    {
+      publish(topic, 0x2, message, length, fin);
+    };
+
     inline void addNewClient(HttpRequest* request)
     {
       pthread_mutex_lock(&wsclients_mutex);
-      wsclients.push_back(request);
+      wsclients.insert(request);
       pthread_mutex_unlock(&wsclients_mutex);
     };
 
     inline void removeClient(HttpRequest* request)
     {
       pthread_mutex_lock(&wsclients_mutex);
-      nw::list<HttpRequest*>::iterator it = nw::find(wsclients.begin(), wsclients.end(), request);
-      if (it != wsclients.end()) wsclients.erase(it);
+      wsclients.erase(request);
+      SubscriptionsMap::iterator it = subscriptions.find(request);
+      if (it != subscriptions.end())
+      {
+        for (nw::set<nw::string>::const_iterator t = it->second.begin(); t != it->second.end(); t++)
+          unsubscribeLocked(request, *t);
+        subscriptions.erase(it);
+      }
       pthread_mutex_unlock(&wsclients_mutex);
     };
 
@@ -213,8 +428,7 @@ class WebSocket
     {
       bool res;
       pthread_mutex_lock(&wsclients_mutex);
-      nw::list<HttpRequest*>::iterator it = nw::find(wsclients.begin(), wsclients.end(), request);
-      res = it != wsclients.end();
+      res = wsclients.find(request) != wsclients.end();
       pthread_mutex_unlock(&wsclients_mutex);
       return res;
     };
@@ -0,0 +1,128 @@
+//****************************************************************************
+/**
+ * @file  WebSocketClient.hh
+ *
+ * @brief Websocket client connection and its outbound frames queue
+ *
+ * @author agent (agent@local)
+ *
+ * @version 1
+ * @date 19/10/26
+ */
+//****************************************************************************
+
+#ifndef WEBSOCKETCLIENT_HH_
+#define WEBSOCKETCLIENT_HH_
+
+#ifdef USE_USTL
+
+#include <libnavajo/with_ustl.h>
+
+#else
+
+#include <list>
+#include <libnavajo/with_ustl.h>
+
+#endif // USE_USTL
+
+#include <stdlib.h>
+#include <sys/types.h>
+
+#include "libnavajo/HttpRequest.hh"
+#include "libnavajo/thread.h"
+
+class WebSocket;
+
+typedef enum
+{
+  WS_OVERFLOW_DROP,     // the new message is discarded
+  WS_OVERFLOW_COALESCE, // the oldest pending messages are discarded
+  WS_OVERFLOW_CLOSE     // the slow client is disconnected
+} WebSocketOverflowPolicy;
+
+/**
+* WebSocketFrame - an encoded websocket frame (header + payload), shared by
+* all the clients's queues it has been pushed to (reference counted).
+*/
+class WebSocketFrame
+{
+    unsigned char *data;
+    size_t length;
+    bool ctrlFrame;
+    volatile int refCount;
+
+    WebSocketFrame(unsigned char *d, size_t l, bool ctrl): data(d), length(l), ctrlFrame(ctrl), refCount(1) {};
+    ~WebSocketFrame() { free(data); };
+
+  public:
+    static WebSocketFrame* create(const u_int8_t opcode, const unsigned char* message, size_t length, bool fin, bool deflate);
+
+    inline void retain() { __sync_fetch_and_add(&refCount, 1); };
+    inline void release() { if (__sync_sub_and_fetch(&refCount, 1) == 0) delete this; };
+
+    inline const unsigned char* getData() const { return data; };
+    inline size_t getLength() const { return length; };
+    inline bool isCtrlFrame() const { return ctrlFrame; };
+};
+
+/**
+* WebSocketClient - a websocket connection. Outgoing frames are queued by
+* the senders, and written by the connection's thread (the websocket
+* listener), which waits for both the client data and the queued frames:
+* the socket (and its TLS session) is only used by this thread, and the
+* senders never block on a slow peer.
+*/
+class WebSocketClient
+{
+    WebSocket *websocket;
+    HttpRequest *request;
+    ClientSockData *client;
+
+    nw::list<WebSocketFrame*> framesQueue;
+    size_t queuedBytes;
+    bool highWatermarkReached;
+    bool overflowPending;  // onQueueOverflow() to be called by the connection's thread
+    size_t overflowQueuedBytes;
+    bool wakeupPending;    // a byte is in the wakeup pipe
+    volatile bool closing;
+    pthread_mutex_t framesQueue_mutex;
+    int wakeupPipe[2];
+    pthread_t connectionThread;
+    bool connectionThreadStarted;
+
+    void wakeup();
+    bool writeQueuedFrames(const bool notify);
+    void dropQueuedFrames();
+
+  public:
+    WebSocketClient(WebSocket *ws, HttpRequest *req);
+    ~WebSocketClient();
+
+    /**
+    * Push a frame in the outbound queue, according to the websocket
+    * watermarks and overflow policy
+    * @param frame: the frame to send
+    * @return false if the frame has been discarded
+    */
+    bool send(WebSocketFrame *frame);
+
+    /**
+    * Disconnect the client: pending frames are discarded
+    */
+    void close();
+
+    /**
+    * Wait for the client data, writing the queued frames meanwhile. To be
+    * called by the connection's thread only, before each read.
+    * @return false if the connection is broken
+    */
+    bool waitForData();
+
+    static bool writeFrame(ClientSockData *client, const WebSocketFrame *frame);
+
+    inline HttpRequest* getRequest() { return request; };
+    size_t getQueuedBytes();
+    size_t getQueueDepth();
+};
+
+#endif
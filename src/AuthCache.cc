@@ -0,0 +1,161 @@
+//********************************************************
+/**
+ * @file  AuthCache.cc
+ *
+ * @brief Http authentification results cache (sharded, bounded)
+ *
+ * @author agent (agent@local)
+ *
+ * @version 1
+ * @date 19/10/26
+ */
+//********************************************************
+
+#include <string.h>
+#include <stdlib.h>
+
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+#include <openssl/crypto.h>
+
+#include "libnavajo/AuthCache.hh"
+
+/**********************************************************************/
+
+AuthCache::AuthCache()
+{
+  for (unsigned i=0; i<AUTH_CACHE_SHARDS; i++)
+    pthread_mutex_init(&shards[i].mutex, NULL);
+
+  maxEntriesPerShard=0;
+  allowedTimeout=deniedTimeout=0;
+  hits=misses=0;
+
+  if (RAND_bytes(salt, sizeof salt) != 1)
+  {
+    // not cryptographically strong, but still unknown to the clients
+    srand(time(NULL) ^ (unsigned long)this);
+    for (unsigned i=0; i<sizeof salt; i++)
+      salt[i]=rand();
+  }
+}
+
+/**********************************************************************/
+
+AuthCache::~AuthCache()
+{
+  for (unsigned i=0; i<AUTH_CACHE_SHARDS; i++)
+  {
+    shards[i].entries.clear();
+    shards[i].lru.clear();
+    pthread_mutex_destroy(&shards[i].mutex);
+  }
+  OPENSSL_cleanse(salt, sizeof salt);
+}
+
+/**********************************************************************/
+
+void AuthCache::setup(const size_t maxEntries, const time_t allowedTimeout, const time_t deniedTimeout)
+{
+  maxEntriesPerShard=(maxEntries + AUTH_CACHE_SHARDS - 1) / AUTH_CACHE_SHARDS;
+  this->allowedTimeout=allowedTimeout;
+  this->deniedTimeout=deniedTimeout;
+}
+
+/**********************************************************************/
+
+nw::string AuthCache::getKey(const nw::string& credentials) const
+{
+  unsigned char md[SHA256_DIGEST_LENGTH];
+  nw::string salted((const char*)salt, sizeof salt);
+  salted+=credentials;
+  SHA256((const unsigned char*)salted.data(), salted.size(), md);
+  OPENSSL_cleanse(&salted[0], salted.size());
+  return nw::string((const char*)md, sizeof md);
+}
+
+/**********************************************************************/
+
+AuthCacheResult AuthCache::lookup(const nw::string& key, nw::string& username)
+{
+  if (!maxEntriesPerShard)
+    return AUTH_CACHE_MISS;
+
+  Shard& shard=getShard(key);
+  AuthCacheResult res=AUTH_CACHE_MISS;
+
+  pthread_mutex_lock(&shard.mutex);
+  EntriesMap::iterator it=shard.entries.find(key);
+  if (it != shard.entries.end())
+  {
+    if (it->second.expiration > time(NULL))
+    {
+      res=it->second.allowed ? AUTH_CACHE_ALLOWED : AUTH_CACHE_DENIED;
+      username=it->second.username;
+      shard.lru.splice(shard.lru.end(), shard.lru, it->second.lruIt);
+    }
+    else
+    {
+      shard.lru.erase(it->second.lruIt);
+      shard.entries.erase(it);
+    }
+  }
+  pthread_mutex_unlock(&shard.mutex);
+
+  if (res == AUTH_CACHE_MISS)
+    __sync_fetch_and_add(&misses, 1);
+  else
+    __sync_fetch_and_add(&hits, 1);
+  return res;
+}
+
+/**********************************************************************/
+
+void AuthCache::store(const nw::string& key, const nw::string& username, const bool allowed)
+{
+  time_t timeout=allowed ? allowedTimeout : deniedTimeout;
+  if (!maxEntriesPerShard || timeout <= 0)
+    return;
+
+  Shard& shard=getShard(key);
+
+  pthread_mutex_lock(&shard.mutex);
+
+  EntriesMap::iterator it=shard.entries.find(key);
+  if (it != shard.entries.end())
+  {
+    shard.lru.erase(it->second.lruIt);
+    shard.entries.erase(it);
+  }
+
+  // evict the least recently used entries
+  while (shard.entries.size() >= maxEntriesPerShard && !shard.lru.empty())
+  {
+    shard.entries.erase(shard.lru.front());
+    shard.lru.pop_front();
+  }
+
+  Entry& entry=shard.entries[key];
+  entry.allowed=allowed;
+  entry.username=username;
+  entry.expiration=time(NULL)+timeout;
+  entry.lruIt=shard.lru.insert(shard.lru.end(), key);
+
+  pthread_mutex_unlock(&shard.mutex);
+}
+
+/**********************************************************************/
+
+void AuthCache::getStats(AuthCacheStats& stats)
+{
+  stats.hits=hits;
+  stats.misses=misses;
+  stats.entries=0;
+  for (unsigned i=0; i<AUTH_CACHE_SHARDS; i++)
+  {
+    pthread_mutex_lock(&shards[i].mutex);
+    stats.entries+=shards[i].entries.size();
+    pthread_mutex_unlock(&shards[i].mutex);
+  }
+}
+
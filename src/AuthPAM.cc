@@ -11,6 +11,8 @@
  */
 //********************************************************
 
+#include <errno.h>
+
 #include "libnavajo/LogRecorder.hh"
 #include "libnavajo/AuthPAM.hh"
 
@@ -144,3 +146,69 @@ int AuthPAM::authentificate(const char *username, const char *password, const ch
   return ret;
 }
 
+
+//------------------------------------------------------------------------------
+
+AuthPAMVerifications::AuthPAMVerifications()
+{
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&doneCond, NULL);
+}
+
+//------------------------------------------------------------------------------
+
+AuthPAMVerifications::~AuthPAMVerifications()
+{
+  pthread_cond_destroy(&doneCond);
+  pthread_mutex_destroy(&mutex);
+}
+
+//------------------------------------------------------------------------------
+
+int AuthPAMVerifications::authentificate(const nw::string& key, const char *username, const char *password, const char *service, const time_t timeout)
+{
+  Verification *verification;
+  int res;
+
+  pthread_mutex_lock(&mutex);
+
+  nw::map<nw::string, Verification*>::iterator it=verifications.find(key);
+  if (it != verifications.end())
+  {
+    // verified by another request
+    verification=it->second;
+    verification->refs++;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec+=timeout;
+    int rc=0;
+    while (!verification->done && rc != ETIMEDOUT)
+      rc=pthread_cond_timedwait(&doneCond, &mutex, &deadline);
+
+    res=verification->done ? verification->allowed : -1;
+  }
+  else
+  {
+    verification=new Verification;
+    verification->done=false;
+    verification->allowed=false;
+    verification->refs=1;
+    verifications[key]=verification;
+    pthread_mutex_unlock(&mutex);
+
+    res=AuthPAM::authentificate(username, password, service);
+
+    pthread_mutex_lock(&mutex);
+    verifications.erase(key);
+    verification->done=true;
+    verification->allowed=res == 1;
+    pthread_cond_broadcast(&doneCond);
+  }
+
+  if (!--verification->refs)
+    delete verification;
+
+  pthread_mutex_unlock(&mutex);
+  return res;
+}
@@ -0,0 +1,261 @@
+//********************************************************
+/**
+ * @file  ConnectionManager.cc
+ *
+ * @brief Connections limits (total and per ip address)
+ *        and read deadlines (timer wheel)
+ *
+ * @author agent (agent@local)
+ *
+ * @version 1
+ * @date 19/10/26
+ */
+//********************************************************
+
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "libnavajo/ConnectionManager.hh"
+#include "libnavajo/thread.h"
+
+/**********************************************************************/
+
+ConnectionManager::ConnectionManager()
+{
+  maxConnections=0;
+  maxConnectionsPerIp=0;
+  nbConnections=0;
+  pthread_mutex_init(&connectionsPerIp_mutex, NULL);
+
+  for (unsigned i=0; i<CONNECTION_TIMER_WHEEL_SLOTS; i++)
+    wheel[i].prev=wheel[i].next=&wheel[i];
+  currentTick=getTick();
+  closing=false;
+  running=false;
+  pthread_mutex_init(&wheel_mutex, NULL);
+  pthread_cond_init(&wheel_cond, NULL);
+}
+
+/**********************************************************************/
+
+ConnectionManager::~ConnectionManager()
+{
+  stop();
+  pthread_cond_destroy(&wheel_cond);
+  pthread_mutex_destroy(&wheel_mutex);
+  pthread_mutex_destroy(&connectionsPerIp_mutex);
+}
+
+/**********************************************************************/
+
+bool ConnectionManager::acquire(const IpAddress& ip)
+{
+  size_t n=__sync_add_and_fetch(&nbConnections, 1);
+  if (maxConnections && n > maxConnections)
+  {
+    __sync_sub_and_fetch(&nbConnections, 1);
+    return false;
+  }
+
+  if (!maxConnectionsPerIp)
+    return true;
+
+  pthread_mutex_lock(&connectionsPerIp_mutex);
+  size_t &nbIpConnections=connectionsPerIp[ip];
+  bool accepted=nbIpConnections < maxConnectionsPerIp;
+  if (accepted)
+    nbIpConnections++;
+  else
+    if (!nbIpConnections)
+      connectionsPerIp.erase(ip);
+  pthread_mutex_unlock(&connectionsPerIp_mutex);
+
+  if (!accepted)
+    __sync_sub_and_fetch(&nbConnections, 1);
+  return accepted;
+}
+
+/**********************************************************************/
+
+void ConnectionManager::release(const IpAddress& ip)
+{
+  __sync_sub_and_fetch(&nbConnections, 1);
+
+  if (!maxConnectionsPerIp)
+    return;
+
+  pthread_mutex_lock(&connectionsPerIp_mutex);
+  nw::map<IpAddress,size_t>::iterator it=connectionsPerIp.find(ip);
+  if (it != connectionsPerIp.end() && !--it->second)
+    connectionsPerIp.erase(it);
+  pthread_mutex_unlock(&connectionsPerIp_mutex);
+}
+
+/***********************************************************************
+* getTick: \return the monotonic clock, in timer wheel ticks
+***********************************************************************/
+
+unsigned long long ConnectionManager::getTick()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / CONNECTION_TIMER_WHEEL_TICK;
+}
+
+/**********************************************************************/
+
+void ConnectionManager::unlink(ConnectionTimer &timer)
+{
+  timer.prev->next=timer.next;
+  timer.next->prev=timer.prev;
+  timer.prev=timer.next=NULL;
+  timer.armed=false;
+}
+
+/***********************************************************************
+* expire: the deadline is reached, the blocked reads return (the socket
+*  can't be closed and reused meanwhile: the owner cancels the deadline,
+*  under the same lock, before closing it)
+***********************************************************************/
+
+void ConnectionManager::expire(ConnectionTimer &timer)
+{
+  unlink(timer);
+  shutdown(timer.socketId, SHUT_RD);
+}
+
+/**********************************************************************/
+
+void ConnectionManager::setDeadline(ConnectionTimer &timer, const time_t seconds)
+{
+  pthread_mutex_lock(&wheel_mutex);
+
+  if (timer.armed)
+    unlink(timer);
+
+  if (closing)
+    shutdown(timer.socketId, SHUT_RD);
+  else
+    if (seconds > 0)
+    {
+      timer.expiration=getTick() + (seconds * 1000 + CONNECTION_TIMER_WHEEL_TICK - 1) / CONNECTION_TIMER_WHEEL_TICK;
+      ConnectionTimer *head=&wheel[timer.expiration & (CONNECTION_TIMER_WHEEL_SLOTS-1)];
+      timer.prev=head;
+      timer.next=head->next;
+      head->next->prev=&timer;
+      head->next=&timer;
+      timer.armed=true;
+    }
+
+  pthread_mutex_unlock(&wheel_mutex);
+}
+
+/**********************************************************************/
+
+void ConnectionManager::cancelDeadline(ConnectionTimer &timer)
+{
+  pthread_mutex_lock(&wheel_mutex);
+  if (timer.armed)
+    unlink(timer);
+  pthread_mutex_unlock(&wheel_mutex);
+}
+
+/***********************************************************************
+* expireTimers: expire the timers of the slots elapsed since the last
+*  call, wheel_mutex locked
+* @param tick - the current tick
+***********************************************************************/
+
+void ConnectionManager::expireTimers(const unsigned long long tick)
+{
+  // each slot is visited once, even after a long delay
+  unsigned long long first=currentTick+1;
+  if (tick >= CONNECTION_TIMER_WHEEL_SLOTS && first < tick-CONNECTION_TIMER_WHEEL_SLOTS+1)
+    first=tick-CONNECTION_TIMER_WHEEL_SLOTS+1;
+
+  for (unsigned long long t=first; t<=tick; t++)
+  {
+    ConnectionTimer *head=&wheel[t & (CONNECTION_TIMER_WHEEL_SLOTS-1)];
+    for (ConnectionTimer *timer=head->next; timer != head; )
+    {
+      ConnectionTimer *next=timer->next;
+      if (timer->expiration <= tick) // else, in a next turn of the wheel
+        expire(*timer);
+      timer=next;
+    }
+  }
+  currentTick=tick;
+}
+
+/**********************************************************************/
+
+void* ConnectionManager::startThread(void* t)
+{
+  static_cast<ConnectionManager *>(t)->threadProcessing();
+  pthread_exit(NULL);
+  return NULL;
+}
+
+/**********************************************************************/
+
+void ConnectionManager::threadProcessing()
+{
+  pthread_mutex_lock(&wheel_mutex);
+  while (running)
+  {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec+=CONNECTION_TIMER_WHEEL_TICK * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec-=1000000000L;
+    }
+    pthread_cond_timedwait(&wheel_cond, &wheel_mutex, &deadline);
+
+    expireTimers(getTick());
+  }
+  pthread_mutex_unlock(&wheel_mutex);
+}
+
+/**********************************************************************/
+
+void ConnectionManager::start()
+{
+  pthread_mutex_lock(&wheel_mutex);
+  closing=false;
+  currentTick=getTick();
+  bool started=running;
+  running=true;
+  pthread_mutex_unlock(&wheel_mutex);
+
+  if (!started)
+    create_thread(&thread, ConnectionManager::startThread, static_cast<void *>(this));
+}
+
+/**********************************************************************/
+
+void ConnectionManager::shutdownConnections()
+{
+  pthread_mutex_lock(&wheel_mutex);
+  closing=true;
+  for (unsigned i=0; i<CONNECTION_TIMER_WHEEL_SLOTS; i++)
+    while (wheel[i].next != &wheel[i])
+      expire(*wheel[i].next);
+  pthread_mutex_unlock(&wheel_mutex);
+}
+
+/**********************************************************************/
+
+void ConnectionManager::stop()
+{
+  pthread_mutex_lock(&wheel_mutex);
+  bool started=running;
+  running=false;
+  pthread_cond_signal(&wheel_cond);
+  pthread_mutex_unlock(&wheel_mutex);
+
+  if (started)
+    wait_for_thread(thread);
+}
+
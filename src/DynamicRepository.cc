@@ -0,0 +1,614 @@
+//********************************************************
+/**
+ * @file  DynamicRepository.cc
+ *
+ * @brief Handles dynamic web repository
+ *
+ * @author agent (agent@local)
+ *
+ * @version 1
+ * @date 19/10/26
+ */
+//********************************************************
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "libnavajo/LogRecorder.hh"
+#include "libnavajo/DynamicRepository.hh"
+#include "libnavajo/DynamicPage.hh"
+#include "libnavajo/WebServer.hh"
+
+static const char wildcardParamName[]="*";
+
+/**********************************************************************/
+
+DynamicRepository::RouteNode::~RouteNode()
+{
+  for (size_t i=0; i<children.size(); i++)
+    delete children[i];
+  if (paramChild != NULL) delete paramChild;
+  if (wildcardChild != NULL) delete wildcardChild;
+  if (cors != NULL) delete cors;
+  if (cache != NULL) delete cache;
+}
+
+/**********************************************************************/
+
+DynamicRepository::ResponseCache::~ResponseCache()
+{
+  for (nw::map<nw::string, CacheEntry*>::iterator it=entries.begin(); it != entries.end(); it++)
+    delete it->second;
+  pthread_cond_destroy(&updated);
+  pthread_mutex_destroy(&mutex);
+}
+
+/**********************************************************************/
+
+DynamicPage* DynamicRepository::RouteNode::getPage(const HttpRequestMethod method) const
+{
+  if ((size_t)method < HTTP_METHODS_COUNT && pages[method] != NULL)
+    return pages[method];
+  if (method == OPTIONS_METHOD) // answered automatically
+    return NULL;
+  if (method == HEAD_METHOD && pages[GET_METHOD] != NULL)
+    return pages[GET_METHOD];
+  return pages[UNKNOWN_METHOD];
+}
+
+/***********************************************************************
+* hasPage: can the node answer a method (OPTIONS: any page)
+***********************************************************************/
+
+bool DynamicRepository::RouteNode::hasPage(const HttpRequestMethod method) const
+{
+  if (method == OPTIONS_METHOD)
+    for (size_t i=0; i<HTTP_METHODS_COUNT; i++)
+      if (pages[i] != NULL) return true;
+  return getPage(method) != NULL;
+}
+
+/***********************************************************************
+* insertStatic: insert a static string in the radix tree
+* @param node - the starting node
+* @param str - the string
+* @param len - the string length
+* \return the node matching the end of the string
+***********************************************************************/
+
+DynamicRepository::RouteNode* DynamicRepository::insertStatic(RouteNode *node, const char *str, size_t len)
+{
+  while (len)
+  {
+    size_t i=0;
+    while (i < node->children.size() && node->children[i]->label[0] != str[0]) i++;
+
+    if (i == node->children.size())
+    {
+      RouteNode *child=new RouteNode(nw::string(str, len));
+      node->children.push_back(child);
+      return child;
+    }
+
+    RouteNode *child=node->children[i];
+    size_t common=1;
+    while (common < len && common < child->label.size() && child->label[common] == str[common]) common++;
+
+    // split the child label
+    if (common < child->label.size())
+    {
+      RouteNode *split=new RouteNode(child->label.substr(0, common));
+      child->label.erase(0, common);
+      split->children.push_back(child);
+      node->children[i]=split;
+      child=split;
+    }
+
+    node=child;
+    str+=common;
+    len-=common;
+  }
+
+  return node;
+}
+
+/***********************************************************************
+* insert: insert a route in the radix tree
+* @param url - the route
+* \return the node matching the route, or NULL if the route is invalid
+***********************************************************************/
+
+DynamicRepository::RouteNode* DynamicRepository::insert(const nw::string& url)
+{
+  RouteNode *node=&root;
+  size_t i=0, size=url.size();
+
+  while (i < size && url[i]=='/') i++;
+
+  while (i < size)
+  {
+    if (url[i] == '{')
+    {
+      size_t end=url.find('}', i);
+      if (end == nw::string::npos || end == i+1)
+        return NULL;
+
+      nw::string name=url.substr(i+1, end-i-1);
+      if (node->paramChild == NULL)
+      {
+        node->paramChild=new RouteNode();
+        node->paramChild->paramName=name;
+      }
+      else
+        if (node->paramChild->paramName != name)
+          NVJ_LOG->append(NVJ_WARNING, "DynamicRepository: parameter '"+name+"' is already named '"+node->paramChild->paramName+"' in route "+url);
+
+      node=node->paramChild;
+      i=end+1;
+      continue;
+    }
+
+    if (url[i] == '*' && i+1 == size)
+    {
+      if (node->wildcardChild == NULL)
+        node->wildcardChild=new RouteNode();
+      node=node->wildcardChild;
+      i++;
+      continue;
+    }
+
+    size_t end=i+1;
+    while (end < size && url[end] != '{' && !(url[end] == '*' && end+1 == size)) end++;
+    node=insertStatic(node, url.c_str()+i, end-i);
+    i=end;
+  }
+
+  return node;
+}
+
+/**********************************************************************/
+
+void DynamicRepository::add(const HttpRequestMethod method, const nw::string& url, DynamicPage *page)
+{
+  pthread_mutex_lock( &_mutex );
+
+  RouteNode *node=insert(url);
+  if (node == NULL)
+    NVJ_LOG->append(NVJ_ERROR, "DynamicRepository: invalid route "+url);
+  else
+    if ((size_t)method < HTTP_METHODS_COUNT && node->pages[method] == NULL)
+      node->pages[method]=page;
+
+  pthread_mutex_unlock( &_mutex );
+}
+
+/**********************************************************************/
+
+void DynamicRepository::setCorsPolicy(const nw::string& url, const CorsPolicy& policy)
+{
+  pthread_mutex_lock( &_mutex );
+
+  RouteNode *node=insert(url);
+  if (node == NULL)
+    NVJ_LOG->append(NVJ_ERROR, "DynamicRepository: invalid route "+url);
+  else
+  {
+    if (node->cors != NULL) delete node->cors;
+    node->cors=new CorsPolicy(policy);
+  }
+
+  pthread_mutex_unlock( &_mutex );
+}
+
+/**********************************************************************/
+
+void DynamicRepository::setCachePolicy(const nw::string& url, const CachePolicy& policy)
+{
+  pthread_mutex_lock( &_mutex );
+
+  RouteNode *node=insert(url);
+  if (node == NULL)
+    NVJ_LOG->append(NVJ_ERROR, "DynamicRepository: invalid route "+url);
+  else
+  {
+    if (node->cache != NULL) delete node->cache;
+    node->cache=new ResponseCache(policy);
+  }
+
+  pthread_mutex_unlock( &_mutex );
+}
+
+/***********************************************************************
+* lookup: find the node matching the end of the url, with a page for
+*  the method (static children first, then the parameter, then the
+*  wildcard)
+* @param node - the current node (its label is matched)
+* @param url - the url (parameters offsets origin)
+* @param path - the remaining part of the url
+* \return the node or NULL
+***********************************************************************/
+
+const DynamicRepository::RouteNode* DynamicRepository::lookup(const RouteNode *node, const char *url, const char *path, const HttpRequestMethod method,
+                                                             HttpPathParameter *params, size_t& nbParams) const
+{
+  const RouteNode *res=NULL;
+
+  if (*path == '\0' && node->hasPage(method))
+    return node;
+
+  if (*path != '\0')
+    for (size_t i=0; i < node->children.size(); i++)
+    {
+      const RouteNode *child=node->children[i];
+      if (child->label[0] != *path) continue;
+      if (!strncmp(path, child->label.c_str(), child->label.size()))
+        res=lookup(child, url, path + child->label.size(), method, params, nbParams);
+      if (res != NULL) return res;
+      break;
+    }
+
+  if (node->paramChild != NULL && nbParams < HTTP_MAX_PATH_PARAMETERS)
+  {
+    const char *end=path;
+    while (*end != '\0' && *end != '/') end++;
+    if (end != path)
+    {
+      size_t saved=nbParams;
+      params[nbParams].name=node->paramChild->paramName.c_str();
+      params[nbParams].offset=path-url;
+      params[nbParams].length=end-path;
+      nbParams++;
+      if ((res=lookup(node->paramChild, url, end, method, params, nbParams)) != NULL)
+        return res;
+      nbParams=saved;
+    }
+  }
+
+  if (node->wildcardChild != NULL && node->wildcardChild->hasPage(method)
+      && nbParams < HTTP_MAX_PATH_PARAMETERS)
+  {
+    params[nbParams].name=wildcardParamName;
+    params[nbParams].offset=path-url;
+    params[nbParams].length=strlen(path);
+    nbParams++;
+    return node->wildcardChild;
+  }
+
+  return NULL;
+}
+
+/**********************************************************************/
+
+const DynamicRepository::RouteNode* DynamicRepository::findNode(const HttpRequestMethod method, const char *url, HttpPathParameter *params, size_t& nbParams) const
+{
+  const char *path=url;
+  while (*path == '/') path++;
+
+  nbParams=0;
+  return lookup(&root, url, path, method, params, nbParams);
+}
+
+/**********************************************************************/
+
+DynamicPage* DynamicRepository::find(const HttpRequestMethod method, const char *url, HttpPathParameter *params, size_t& nbParams) const
+{
+  const RouteNode *node=findNode(method, url, params, nbParams);
+  return node != NULL ? node->getPage(method) : NULL;
+}
+
+/***********************************************************************
+* getAllowedMethods: the methods answered by a route ("Allow" header)
+***********************************************************************/
+
+nw::string DynamicRepository::getAllowedMethods(const RouteNode *node)
+{
+  static const HttpRequestMethod methods[]={ GET_METHOD, HEAD_METHOD, POST_METHOD, PUT_METHOD, PATCH_METHOD, DELETE_METHOD };
+  nw::string res;
+
+  for (size_t i=0; i<sizeof methods / sizeof methods[0]; i++)
+    if (node->getPage(methods[i]) != NULL)
+    {
+      res+=HttpRequest::getMethodName(methods[i]);
+      res+=", ";
+    }
+
+  return res+"OPTIONS";
+}
+
+/***********************************************************************
+* getAllowedMethods: the methods answered for an url, if it has a route
+*   (any page matches for OPTIONS)
+***********************************************************************/
+
+nw::string DynamicRepository::getAllowedMethods(const char *url) const
+{
+  HttpPathParameter params[HTTP_MAX_PATH_PARAMETERS];
+  size_t nbParams=0;
+
+  const RouteNode *node=findNode(OPTIONS_METHOD, url, params, nbParams);
+  return node != NULL ? getAllowedMethods(node) : "";
+}
+
+/***********************************************************************
+* setCorsHeaders: allow a cross origin request according to a policy
+* \return false if the request origin is not allowed
+***********************************************************************/
+
+bool DynamicRepository::setCorsHeaders(const CorsPolicy *cors, HttpRequest* request, HttpResponse *response)
+{
+  const char *origin=request->getRequestOrigin();
+  if (cors == NULL || origin == NULL || *origin == '\0')
+    return false;
+
+  if (cors->allowedOrigin == "*" && !cors->allowCredentials)
+    response->setCORS(true, false, "*");
+  else
+  {
+    if (cors->allowedOrigin != "*" && cors->allowedOrigin != origin)
+      return false;
+    response->setCORS(true, cors->allowCredentials, origin);
+    response->addHeader("Vary", "Origin");
+  }
+  return true;
+}
+
+/***********************************************************************
+* getOptions: automatic OPTIONS response (204 No Content), with the CORS
+*   preflight headers
+***********************************************************************/
+
+bool DynamicRepository::getOptions(const RouteNode *node, HttpRequest* request, HttpResponse *response)
+{
+  nw::string allowed=getAllowedMethods(node);
+  response->addHeader("Allow", allowed);
+
+  if (request->getHeader("Access-Control-Request-Method") != NULL
+      && setCorsHeaders(node->cors, request, response))
+  {
+    response->addHeader("Access-Control-Allow-Methods", allowed);
+
+    const char *requestedHeaders=request->getHeader("Access-Control-Request-Headers");
+    if (node->cors->allowedHeaders.size())
+      response->addHeader("Access-Control-Allow-Headers", node->cors->allowedHeaders);
+    else
+      if (requestedHeaders != NULL && *requestedHeaders)
+        response->addHeader("Access-Control-Allow-Headers", requestedHeaders);
+
+    if (node->cors->maxAge)
+    {
+      char maxAge[24];
+      snprintf(maxAge, sizeof maxAge, "%lu", (unsigned long)node->cors->maxAge);
+      response->addHeader("Access-Control-Max-Age", maxAge);
+    }
+  }
+
+  response->setContent(NULL, 0);
+  return true;
+}
+
+/***********************************************************************
+* getCacheKey: the url, and the values of the key parameters and headers
+***********************************************************************/
+
+nw::string DynamicRepository::getCacheKey(const CachePolicy& policy, HttpRequest* request)
+{
+  nw::string key=request->getUrl(), value;
+
+  for (size_t i=0; i<policy.keyParameters.size(); i++)
+  {
+    key+='\0';
+    if (request->getParameter(policy.keyParameters[i], value))
+      key+='='+value;
+  }
+
+  for (size_t i=0; i<policy.keyHeaders.size(); i++)
+  {
+    key+='\0';
+    const char *header=request->getHeader(policy.keyHeaders[i].c_str());
+    if (header != NULL)
+      (key+='=')+=header;
+  }
+
+  return key;
+}
+
+/***********************************************************************
+* storeCacheEntry: copy a response in a cache entry (which must not be
+*   in use), with its gzipped version if it's worth it
+* @param entry - the entry
+* @param response - the response, whose content is not modified
+* @param expiration - the entry expiration time
+***********************************************************************/
+
+void DynamicRepository::storeCacheEntry(CacheEntry *entry, HttpResponse *response, const time_t expiration)
+{
+  unsigned char *content;
+  size_t length;
+  bool zipped;
+  response->getContent(&content, &length, &zipped);
+
+  unsigned char *copy=(unsigned char*)malloc(length);
+  if (copy == NULL) return;
+  memcpy(copy, content, length);
+
+  unsigned char *gzipContent=NULL;
+  int gzipLength=0;
+  if (!zipped && length > GZIP_MIN_CONTENT_LENGTH && WebServer::isCompressibleMimeType(response->getMimeType()))
+  {
+    try
+    {
+      gzipLength=nvj_gzip(&gzipContent, content, length);
+    }
+    catch(...)
+    {
+      gzipContent=NULL;
+      gzipLength=0;
+    }
+    if (gzipContent != NULL && (gzipLength <= 0 || (size_t)gzipLength >= length))
+    {
+      free(gzipContent);
+      gzipContent=NULL;
+    }
+  }
+
+  free(entry->content);
+  free(entry->gzipContent);
+  entry->content=copy;
+  entry->contentLength=length;
+  entry->gzipContent=gzipContent;
+  entry->gzipContentLength=gzipContent != NULL ? gzipLength : 0;
+  entry->zipped=zipped;
+  entry->mimeType=response->getMimeType();
+  entry->headers=response->getHeaders();
+  entry->cors=response->isCORS();
+  entry->corsCred=response->isCORSwithCredentials();
+  entry->corsDomain=response->getCORSdomain();
+  entry->expiration=expiration;
+}
+
+/***********************************************************************
+* getCacheEntry: set the response from a cache entry (the content is
+*   copied: the entry can be updated as soon as the cache is unlocked)
+* \return false if the content can't be allocated
+***********************************************************************/
+
+bool DynamicRepository::getCacheEntry(const CacheEntry *entry, HttpRequest* request, HttpResponse *response)
+{
+  bool gzip = entry->gzipContent != NULL && request->getCompressionMode() == GZIP;
+  size_t length = gzip ? entry->gzipContentLength : entry->contentLength;
+
+  unsigned char *content=response->allocateContent(length);
+  if (content == NULL) return false;
+  memcpy(content, gzip ? entry->gzipContent : entry->content, length);
+
+  response->setContent(content, length);
+  response->setIsZipped(gzip || entry->zipped);
+  response->setMimeType(entry->mimeType);
+  for (size_t i=0; i<entry->headers.size(); i++)
+    response->getHeaders().push_back(entry->headers[i]);
+  if (entry->cors)
+    response->setCORS(true, entry->corsCred, entry->corsDomain);
+  return true;
+}
+
+/***********************************************************************
+* getCachedPage: get a page through the route's cache. An expired entry
+*   is regenerated by a single thread: the others get the stale entry
+*   (if allowed by the policy) or wait for the new one.
+***********************************************************************/
+
+bool DynamicRepository::getCachedPage(ResponseCache *cache, DynamicPage *page, HttpRequest* request, HttpResponse *response)
+{
+  nw::string key=getCacheKey(cache->policy, request);
+  CacheEntry *entry=NULL;
+
+  pthread_mutex_lock( &cache->mutex );
+
+  for (;;)
+  {
+    time_t now=time(NULL);
+    nw::map<nw::string, CacheEntry*>::iterator it=cache->entries.find(key);
+
+    if (it == cache->entries.end())
+    {
+      if (cache->entries.size() >= cache->policy.maxEntries)
+      {
+        // purge the expired entries
+        for (nw::map<nw::string, CacheEntry*>::iterator e=cache->entries.begin(); e != cache->entries.end(); )
+          if (!e->second->updating && e->second->expiration <= now)
+          {
+            delete e->second;
+            cache->entries.erase(e++);
+          }
+          else
+            e++;
+      }
+
+      if (cache->entries.size() >= cache->policy.maxEntries)
+      {
+        // cache full: not cached
+        pthread_mutex_unlock( &cache->mutex );
+        return page->getPage( request, response );
+      }
+
+      entry=new CacheEntry();
+      cache->entries[key]=entry;
+      entry->updating=true;
+      break;
+    }
+
+    entry=it->second;
+    if ( entry->content != NULL
+      && ( entry->expiration > now || ( entry->updating && cache->policy.serveStale ) )
+      && getCacheEntry(entry, request, response) )
+    {
+      pthread_mutex_unlock( &cache->mutex );
+      return true;
+    }
+
+    if (!entry->updating)
+    {
+      entry->updating=true;
+      break;
+    }
+
+    pthread_cond_wait( &cache->updated, &cache->mutex );
+  }
+
+  pthread_mutex_unlock( &cache->mutex );
+
+  bool res = page->getPage( request, response );
+
+  unsigned char *content;
+  size_t length;
+  bool zipped;
+  response->getContent(&content, &length, &zipped);
+  bool cacheable = res && content != NULL && length && response->getContentFile() == -1
+                && response->getCookies().empty() && response->getForwardedUrl() == "";
+
+  pthread_mutex_lock( &cache->mutex );
+
+  if (cacheable)
+    storeCacheEntry(entry, response, time(NULL) + cache->policy.ttl);
+  entry->updating=false;
+  if (entry->content == NULL)
+  {
+    cache->entries.erase(key);
+    delete entry;
+  }
+  pthread_cond_broadcast( &cache->updated );
+
+  pthread_mutex_unlock( &cache->mutex );
+
+  return res;
+}
+
+/**********************************************************************/
+
+bool DynamicRepository::getFile(HttpRequest* request, HttpResponse *response)
+{
+  HttpPathParameter params[HTTP_MAX_PATH_PARAMETERS];
+  size_t nbParams=0;
+
+  const RouteNode *node=findNode(request->getRequestType(), request->getUrl(), params, nbParams);
+  if (node == NULL)
+    return false;
+
+  request->setPathParameters(params, nbParams);
+
+  DynamicPage *page=node->getPage(request->getRequestType());
+  if (page == NULL)
+    return getOptions(node, request, response);
+
+  HttpRequestMethod method=request->getRequestType();
+  bool res = node->cache != NULL && (method == GET_METHOD || method == HEAD_METHOD)
+             ? getCachedPage(node->cache, page, request, response)
+             : page->getPage( request, response );
+  if (!response->isCORS())
+    setCorsHeaders(node->cors, request, response);
+  if (request->getSessionId().size())
+    response->addSessionCookie(request->getSessionId());
+  return res;
+}
+
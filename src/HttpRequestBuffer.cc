@@ -0,0 +1,262 @@
+//********************************************************
+/**
+ * @file  HttpRequestBuffer.cc
+ *
+ * @brief The connection's read buffer and the http request header parser
+ *
+ * @author agent (agent@local)
+ *
+ * @version 1
+ * @date 19/10/26
+ */
+//********************************************************
+
+#include <string.h>
+
+#include "libnavajo/HttpRequestBuffer.hh"
+
+/**********************************************************************/
+
+void HttpRequestBuffer::next()
+{
+  if (savedCharPos >= 0)
+  {
+    data[savedCharPos]=savedChar;
+    savedCharPos=-1;
+  }
+
+  start+=requestLength;
+  requestLength=bodyLength=0;
+
+  if (start == end)
+    start=end=0;
+  else
+    if (start)
+    {
+      memmove(data, data+start, end-start);
+      end-=start;
+      start=0;
+    }
+
+  scanned=0;
+  nbHeaders=0;
+  methodName=path=query=version="";
+  method=UNKNOWN_METHOD;
+}
+
+/***********************************************************************
+* received: new data has been received. The end of a previous body is
+*  discarded
+***********************************************************************/
+
+void HttpRequestBuffer::received(size_t len)
+{
+  if (bodyToSkip)
+  {
+    size_t n = len < bodyToSkip ? len : bodyToSkip;
+    bodyToSkip-=n;
+    len-=n;
+    if (len)
+      memmove(data+end, data+end+n, len);
+  }
+  end+=len;
+}
+
+/**********************************************************************/
+
+size_t HttpRequestBuffer::findHeadersEnd()
+{
+  // empty lines are allowed before the request line: they are dropped, the
+  // request starts at the beginning of the buffer (next() moves the pipelined
+  // data there), so its body can use all the buffer
+  size_t skipped=start;
+  while (skipped < end && (data[skipped] == '\r' || data[skipped] == '\n'))
+    skipped++;
+  if (skipped)
+  {
+    memmove(data, data+skipped, end-skipped);
+    end-=skipped;
+    scanned = scanned > skipped ? scanned-skipped : 0;
+    start=0;
+  }
+
+  for (size_t i=scanned; i < end; i++)
+  {
+    if (data[i] != '\n') continue;
+
+    if (i+1 < end && data[i+1] == '\n')
+      return i+2-start;
+
+    if (i+2 < end && data[i+1] == '\r' && data[i+2] == '\n')
+      return i+3-start;
+
+    if (i+2 >= end)
+    {
+      scanned=i;
+      return 0;
+    }
+  }
+
+  scanned=end;
+  return 0;
+}
+
+/***********************************************************************
+* terminateLine: nul terminate a line
+* @param line - the line beginning
+* @param eol - the '\n' position
+***********************************************************************/
+
+static inline void terminateLine(char *line, char *eol)
+{
+  if (eol > line && *(eol-1) == '\r') eol--;
+  *eol='\0';
+}
+
+/***********************************************************************
+* isTokenChar: is a char allowed in a method token (rfc7230 tchar)
+***********************************************************************/
+
+static inline bool isTokenChar(unsigned char c)
+{
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+      || (c > ' ' && c < 127 && strchr("!#$%&'*+-.^_`|~", c) != NULL);
+}
+
+/***********************************************************************
+* parseMethod: the method token
+* @param m - the token (nul terminated)
+* \return the method, EXTENSION_METHOD if unknown, UNKNOWN_METHOD if invalid
+***********************************************************************/
+
+static HttpRequestMethod parseMethod(const char *m)
+{
+  static const struct { const char *name; HttpRequestMethod method; } methods[]=
+  {
+    { "GET", GET_METHOD }, { "POST", POST_METHOD }, { "PUT", PUT_METHOD }, { "DELETE", DELETE_METHOD },
+    { "HEAD", HEAD_METHOD }, { "OPTIONS", OPTIONS_METHOD }, { "PATCH", PATCH_METHOD }
+  };
+
+  for (size_t i=0; i<sizeof methods / sizeof methods[0]; i++)
+    if (*m == *methods[i].name && !strcmp(m, methods[i].name))
+      return methods[i].method;
+
+  if (*m == '\0') return UNKNOWN_METHOD;
+  for (const char *c=m; *c; c++)
+    if (!isTokenChar(*c)) return UNKNOWN_METHOD;
+  return EXTENSION_METHOD;
+}
+
+/**********************************************************************/
+
+int HttpRequestBuffer::parse(size_t len)
+{
+  char *p=data+start, *blockEnd=data+start+len;
+  char *eol=(char*)memchr(p, '\n', blockEnd-p);
+
+  requestLength=len;
+  nbHeaders=0;
+
+  // Request line: METHOD SP target [SP HTTP/x.y]
+  terminateLine(p, eol);
+
+  char *sp=strchr(p, ' ');
+  if (sp == NULL) return 400;
+  *sp='\0';
+
+  methodName=p;
+  if ((method=parseMethod(p)) == UNKNOWN_METHOD) return 400;
+
+  p=sp+1; while (*p == ' ') p++;
+  if (*p == '\0') return 400;
+
+  char *target=p;
+  if ((sp=strchr(target, ' ')) != NULL)
+  {
+    *sp='\0';
+    p=sp+1; while (*p == ' ') p++;
+    if (strncmp(p, "HTTP/", 5)) return 400;
+    version=p+5;
+  }
+
+  char *q=strchr(target, '?');
+  if (q != NULL)
+  {
+    *q='\0';
+    query=q+1;
+  }
+  path=target;
+
+  // Headers: name ":" OWS value OWS
+  for (p=eol+1; p < blockEnd; p=eol+1)
+  {
+    eol=(char*)memchr(p, '\n', blockEnd-p);
+    if (eol == NULL) break;
+    terminateLine(p, eol);
+
+    if (*p == '\0') break; // empty line
+
+    if (*p == ' ' || *p == '\t') continue; // obsolete line folding: ignored
+
+    char *colon=strchr(p, ':');
+    if (colon == NULL || colon == p) return 400;
+    if (nbHeaders == HTTP_MAX_HEADERS) return 431;
+
+    char *nameEnd=colon;
+    while (nameEnd > p && (*(nameEnd-1) == ' ' || *(nameEnd-1) == '\t')) nameEnd--;
+    *nameEnd='\0';
+
+    char *value=colon+1;
+    while (*value == ' ' || *value == '\t') value++;
+    char *valueEnd=value+strlen(value);
+    while (valueEnd > value && (*(valueEnd-1) == ' ' || *(valueEnd-1) == '\t')) valueEnd--;
+    *valueEnd='\0';
+
+    headers[nbHeaders].name=p;
+    headers[nbHeaders].value=value;
+    headers[nbHeaders].valueLength=valueEnd-value;
+    nbHeaders++;
+  }
+
+  return 0;
+}
+
+/**********************************************************************/
+
+ssize_t HttpRequestBuffer::setBody(size_t len, bool keep)
+{
+  size_t headersLength=requestLength-bodyLength;
+  size_t available=end-start-headersLength;
+
+  if (!keep)
+  {
+    if (available >= len)
+      requestLength=headersLength+len;
+    else
+    {
+      requestLength=end-start;
+      bodyToSkip=len-available;
+    }
+    bodyLength=requestLength-headersLength;
+    return 0;
+  }
+
+  if (start+headersLength+len > HTTP_REQUEST_BUFFER_SIZE)
+    return -1;
+
+  requestLength=headersLength+len;
+  bodyLength=len;
+
+  if (available < len)
+    return len-available;
+
+  // nul terminate the body (the char is restored for the next request)
+  if (savedCharPos < 0)
+  {
+    savedCharPos=start+requestLength;
+    savedChar=data[savedCharPos];
+    data[savedCharPos]='\0';
+  }
+  return 0;
+}
+
@@ -0,0 +1,87 @@
+//********************************************************
+/**
+ * @file  HttpResponseHeader.cc
+ *
+ * @brief The http response header builder
+ *
+ * @author agent (agent@local)
+ *
+ * @version 1
+ * @date 19/10/26
+ */
+//********************************************************
+
+#include <time.h>
+#include <pthread.h>
+
+#include "libnavajo/HttpResponseHeader.hh"
+
+#define STATUS_LINE(s) { s, sizeof(s)-1 }
+
+static const struct { const char *line; size_t length; } statusLines[HTTP_STATUS_COUNT] =
+{
+  STATUS_LINE("HTTP/1.1 101 Switching Protocols\r\n"),
+  STATUS_LINE("HTTP/1.1 200 OK\r\n"),
+  STATUS_LINE("HTTP/1.1 204 No Content\r\n"),
+  STATUS_LINE("HTTP/1.1 400 Bad Request\r\n"),
+  STATUS_LINE("HTTP/1.1 401 Authorization Required\r\n"),
+  STATUS_LINE("HTTP/1.1 404 Not Found\r\n"),
+  STATUS_LINE("HTTP/1.1 405 Method Not Allowed\r\n"),
+  STATUS_LINE("HTTP/1.1 413 Request Entity Too Large\r\n"),
+  STATUS_LINE("HTTP/1.1 429 Too Many Requests\r\n"),
+  STATUS_LINE("HTTP/1.1 431 Request Header Fields Too Large\r\n"),
+  STATUS_LINE("HTTP/1.1 500 Internal Server Error\r\n"),
+  STATUS_LINE("HTTP/1.1 501 Method Not Implemented\r\n")
+};
+
+#define DATE_LINE_LENGTH 37 // "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+
+// The date line is shared by all the threads: it is rewritten once per second
+// by a single writer, and read without lock (sequence counter, odd while the
+// line is being written, 0 until the first write)
+static char dateLine[DATE_LINE_LENGTH+1];
+static volatile time_t dateLineTime=0;
+static volatile unsigned dateLineSeq=0;
+static pthread_mutex_t dateLine_mutex=PTHREAD_MUTEX_INITIALIZER;
+
+/**********************************************************************/
+
+void HttpResponseHeader::appendStatusLine(const HttpStatus status)
+{
+  append(statusLines[status].line, statusLines[status].length);
+}
+
+/**********************************************************************/
+
+void HttpResponseHeader::appendDate()
+{
+  time_t now=time(NULL);
+
+  if (now != dateLineTime && pthread_mutex_trylock(&dateLine_mutex) == 0)
+  {
+    if (now != dateLineTime)
+    {
+      struct tm timeinfo;
+      gmtime_r(&now, &timeinfo);
+      __sync_add_and_fetch(&dateLineSeq, 1);
+      strftime(dateLine, sizeof dateLine, "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &timeinfo);
+      dateLineTime=now;
+      __sync_add_and_fetch(&dateLineSeq, 1);
+    }
+    pthread_mutex_unlock(&dateLine_mutex);
+  }
+
+  char line[DATE_LINE_LENGTH];
+  unsigned seq;
+  do
+  {
+    seq=dateLineSeq;
+    __sync_synchronize();
+    memcpy(line, dateLine, DATE_LINE_LENGTH);
+    __sync_synchronize();
+  }
+  while (!seq || (seq & 1) || seq != dateLineSeq);
+
+  append(line, DATE_LINE_LENGTH);
+}
+
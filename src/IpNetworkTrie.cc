@@ -0,0 +1,155 @@
+//********************************************************
+/**
+ * @file  IpNetworkTrie.cc
+ *
+ * @brief Set of ip networks (path compressed binary trie)
+ *
+ * @author agent (agent@local)
+ *
+ * @version 1
+ * @date 19/10/26
+ */
+//********************************************************
+
+#include <string.h>
+
+#include "libnavajo/IpNetworkTrie.hh"
+
+/**********************************************************************/
+
+IpNetworkTrie::IpNetworkTrie()
+{
+  tries[0].maxLength=32;
+  tries[1].maxLength=128;
+  for (unsigned i=0; i<2; i++)
+  {
+    u_int8_t none[INET6_ADDRLEN];
+    memset(none, 0, sizeof none);
+    newNode(tries[i], none, 0, false);
+  }
+  nbNetworks=0;
+}
+
+/***********************************************************************
+* commonLength: \return the length (in bits) of the common prefix of two
+*  addresses, up to maxLength
+***********************************************************************/
+
+unsigned IpNetworkTrie::commonLength(const u_int8_t *a, const u_int8_t *b, const unsigned maxLength)
+{
+  unsigned i=0;
+  while (i + 8 <= maxLength && a[i >> 3] == b[i >> 3])
+    i+=8;
+  while (i < maxLength && getBit(a, i) == getBit(b, i))
+    i++;
+  return i;
+}
+
+/***********************************************************************
+* newNode: add a node to a trie, its prefix bits beyond its length are
+*  cleared
+* \return the node index
+***********************************************************************/
+
+int IpNetworkTrie::newNode(Trie& trie, const u_int8_t *prefix, const unsigned length, const bool network)
+{
+  Node node;
+  memset(node.prefix, 0, sizeof node.prefix);
+  memcpy(node.prefix, prefix, (length + 7) >> 3);
+  if (length & 7)
+    node.prefix[length >> 3] &= (u_int8_t)(0xff << (8 - (length & 7)));
+  node.length=length;
+  node.network=network;
+  node.child[0]=node.child[1]=-1;
+  trie.nodes.push_back(node);
+  return trie.nodes.size() - 1;
+}
+
+/**********************************************************************/
+
+void IpNetworkTrie::insert(Trie& trie, const u_int8_t *prefix, unsigned length)
+{
+  if (length > trie.maxLength)
+    length=trie.maxLength;
+
+  // the prefix of the current node is a prefix of the network
+  int n=0;
+  for (;;)
+  {
+    if (trie.nodes[n].length == length)
+    {
+      trie.nodes[n].network=true;
+      return;
+    }
+
+    int b=getBit(prefix, trie.nodes[n].length);
+    int c=trie.nodes[n].child[b];
+    if (c < 0)
+    {
+      int leaf=newNode(trie, prefix, length, true);
+      trie.nodes[n].child[b]=leaf;
+      return;
+    }
+
+    unsigned childLength=trie.nodes[c].length;
+    unsigned common=commonLength(prefix, trie.nodes[c].prefix, length < childLength ? length : childLength);
+    if (common == childLength)
+    {
+      n=c;
+      continue;
+    }
+
+    // split the edge to the child
+    int parent;
+    if (common == length)
+      parent=newNode(trie, prefix, length, true);
+    else
+    {
+      parent=newNode(trie, prefix, common, false);
+      int leaf=newNode(trie, prefix, length, true);
+      trie.nodes[parent].child[getBit(prefix, common)]=leaf;
+    }
+    trie.nodes[parent].child[getBit(trie.nodes[c].prefix, common)]=c;
+    trie.nodes[n].child[b]=parent;
+    return;
+  }
+}
+
+/**********************************************************************/
+
+void IpNetworkTrie::add(const IpNetwork& net)
+{
+  if (net.addr.ipversion != 4 && net.addr.ipversion != 6)
+    return;
+  insert(tries[net.addr.ipversion == 4 ? 0 : 1], getBytes(net.addr), net.mask);
+  nbNetworks++;
+}
+
+/***********************************************************************
+* contains: the nodes on the address path are visited until a network
+*  ends (the shortest matching prefix is enough)
+***********************************************************************/
+
+bool IpNetworkTrie::contains(const IpAddress& ip) const
+{
+  if (ip.ipversion != 4 && ip.ipversion != 6)
+    return false;
+
+  const Trie& trie=tries[ip.ipversion == 4 ? 0 : 1];
+  const u_int8_t *bytes=getBytes(ip);
+  int n=0;
+
+  for (;;)
+  {
+    const Node& node=trie.nodes[n];
+    if (commonLength(bytes, node.prefix, node.length) != node.length)
+      return false;
+    if (node.network)
+      return true;
+    if (node.length >= trie.maxLength)
+      return false;
+    if ((n=node.child[getBit(bytes, node.length)]) < 0)
+      return false;
+  }
+}
+
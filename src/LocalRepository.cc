@@ -15,7 +15,16 @@
 #include <stdlib.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <time.h>
+#ifdef LINUX
+#include <sys/inotify.h>
+#endif
 
 #ifdef USE_USTL
 
@@ -26,6 +35,7 @@
 #include <fstream>
 #include <streambuf>
 #include <sstream>
+#include <algorithm>
 #include <libnavajo/with_ustl.h>
 
 #endif // USE_USTL
@@ -34,42 +44,461 @@
 #include "libnavajo/LocalRepository.hh"
 
 
+#ifdef LINUX
+#define LOCAL_REPOSITORY_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ONLYDIR)
+#endif
+
+/**
+* DirectoryScan - the directories of a tree are scanned by several threads:
+* each one takes a pending directory, and adds its subdirectories.
+*/
+struct LocalRepository::DirectoryScan
+{
+  LocalRepository *repository;
+  nw::string alias, path;
+  int rootFd;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  nw::vector<nw::string> pending; // subpaths to scan
+  size_t scanning;                // directories being scanned
+};
+
+/***********************************************************************
+* FilesIndex::hash: FNV-1a
+***********************************************************************/
+
+size_t LocalRepository::FilesIndex::hash(const nw::string& s)
+{
+  size_t h=2166136261u;
+  for (size_t i=0; i<s.size(); i++)
+    h=(h ^ (unsigned char)s[i]) * 16777619u;
+  return h;
+}
+
 /**********************************************************************/
 
-bool LocalRepository::loadFilename_dir (const nw::string& alias, const nw::string& path, const nw::string& subpath="")
+LocalRepository::FilesIndex::FilesIndex(const FilesIndex& index) : buckets(index.buckets), count(index.count)
 {
-    struct dirent *entry;
-    DIR *dir;
-    struct stat s;
-    nw::string fullPath=path+subpath;
+  for (size_t b=0; b<buckets.size(); b++)
+    if (buckets[b] != NULL)
+      buckets[b]->refs++;
+}
 
-    dir = opendir (fullPath.c_str());
-    if (dir == NULL) return false;
-    while ((entry = readdir (dir)) != NULL )
-    {
-      if (!strcmp(entry->d_name,".") || !strcmp(entry->d_name,"..") || !strlen(entry->d_name)) continue;
+/**********************************************************************/
+
+LocalRepository::FilesIndex::~FilesIndex()
+{
+  for (size_t b=0; b<buckets.size(); b++)
+    release(buckets[b]);
+}
+
+/**********************************************************************/
+
+void LocalRepository::FilesIndex::release(Bucket *bucket)
+{
+  if (bucket != NULL && !--bucket->refs)
+    delete bucket;
+}
+
+/***********************************************************************
+* getWritableBucket: the bucket b, created or copied if it is shared
+***********************************************************************/
 
-      nw::string filepath=fullPath + "/" + entry->d_name;
+LocalRepository::FilesIndex::Bucket* LocalRepository::FilesIndex::getWritableBucket(const size_t b)
+{
+  Bucket *bucket=buckets[b];
+  if (bucket != NULL && bucket->refs == 1)
+    return bucket;
+
+  Bucket *copy=new Bucket();
+  copy->refs=1;
+  if (bucket != NULL)
+  {
+    copy->entries=bucket->entries;
+    bucket->refs--;
+  }
+  buckets[b]=copy;
+  return copy;
+}
 
-      if (stat(filepath.c_str(), &s) == -1)
+/**********************************************************************/
+
+void LocalRepository::FilesIndex::rehash(const size_t nbBuckets)
+{
+  nw::vector<Bucket*> newBuckets(nbBuckets, (Bucket*)NULL);
+  for (size_t b=0; b<buckets.size(); b++)
+  {
+    Bucket *bucket=buckets[b];
+    if (bucket == NULL)
+      continue;
+    for (size_t i=0; i<bucket->entries.size(); i++)
+    {
+      Entry& entry=bucket->entries[i];
+      Bucket*& newBucket=newBuckets[hash(entry.first) & (nbBuckets - 1)];
+      if (newBucket == NULL)
       {
-	NVJ_LOG->append(NVJ_ERROR,nw::string("LocalRepository - stat error : ")+nw::string(strerror(errno)));
-        continue;
+        newBucket=new Bucket();
+        newBucket->refs=1;
+      }
+      if (bucket->refs > 1)
+        newBucket->entries.push_back(entry);
+      else
+      {
+        newBucket->entries.push_back(Entry());
+        newBucket->entries.back().first.swap(entry.first);
+        newBucket->entries.back().second.swap(entry.second);
       }
+    }
+    release(bucket);
+  }
+  buckets.swap(newBuckets);
+}
+
+/**********************************************************************/
 
-      int type=s.st_mode & S_IFMT;
-      if (type == S_IFREG || type == S_IFLNK)
+const nw::string* LocalRepository::FilesIndex::find(const nw::string& url) const
+{
+  const Bucket *bucket=buckets[hash(url) & (buckets.size() - 1)];
+  if (bucket == NULL)
+    return NULL;
+  for (size_t i=0; i<bucket->entries.size(); i++)
+    if (bucket->entries[i].first == url)
+      return &bucket->entries[i].second;
+  return NULL;
+}
+
+/**********************************************************************/
+
+void LocalRepository::FilesIndex::insert(const nw::string& url, const nw::string& filename)
+{
+  const nw::string *current=find(url);
+  if (current != NULL)
+  {
+    if (*current == filename)
+      return;
+    Bucket *bucket=getWritableBucket(hash(url) & (buckets.size() - 1));
+    for (size_t i=0; i<bucket->entries.size(); i++)
+      if (bucket->entries[i].first == url)
+        bucket->entries[i].second=filename;
+    return;
+  }
+
+  if (count >= buckets.size())
+    rehash(buckets.size() * 2);
+  getWritableBucket(hash(url) & (buckets.size() - 1))->entries.push_back(Entry(url, filename));
+  count++;
+}
+
+/**********************************************************************/
+
+void LocalRepository::FilesIndex::erase(const nw::string& url)
+{
+  if (find(url) == NULL)
+    return;
+
+  size_t b=hash(url) & (buckets.size() - 1);
+  nw::vector<Entry>& entries=getWritableBucket(b)->entries;
+  for (size_t i=0; i<entries.size(); i++)
+    if (entries[i].first == url)
+    {
+      entries[i].first.swap(entries.back().first);
+      entries[i].second.swap(entries.back().second);
+      entries.pop_back();
+      count--;
+      break;
+    }
+  if (entries.empty())
+  {
+    release(buckets[b]);
+    buckets[b]=NULL;
+  }
+}
+
+/**********************************************************************/
+
+void LocalRepository::FilesIndex::eraseDirectory(const nw::string& dirname)
+{
+  nw::string prefix=dirname.size() ? dirname+'/' : "";
+  for (size_t b=0; b<buckets.size(); b++)
+  {
+    if (buckets[b] == NULL)
+      continue;
+
+    size_t i=0;
+    while (i < buckets[b]->entries.size() && buckets[b]->entries[i].first.compare(0, prefix.size(), prefix))
+      i++;
+    if (i == buckets[b]->entries.size())
+      continue;
+
+    nw::vector<Entry>& entries=getWritableBucket(b)->entries;
+    while (i < entries.size())
+      if (!entries[i].first.compare(0, prefix.size(), prefix))
       {
-	nw::string filename=alias+subpath+"/"+entry->d_name;
-	while (filename.size() && filename[0]=='/') filename.erase(0, 1);
-	filenamesSet.insert(filename);
+        entries[i].first.swap(entries.back().first);
+        entries[i].second.swap(entries.back().second);
+        entries.pop_back();
+        count--;
       }
+      else
+        i++;
+    if (entries.empty())
+    {
+      release(buckets[b]);
+      buckets[b]=NULL;
+    }
+  }
+}
+
+/**********************************************************************/
+
+void LocalRepository::FilesIndex::clear()
+{
+  for (size_t b=0; b<buckets.size(); b++)
+    release(buckets[b]);
+  buckets.assign(64, (Bucket*)NULL);
+  count=0;
+}
+
+/**********************************************************************/
+
+void LocalRepository::FilesIndex::getAll(nw::vector<nw::string>& urls) const
+{
+  for (size_t b=0; b<buckets.size(); b++)
+    if (buckets[b] != NULL)
+      for (size_t i=0; i<buckets[b]->entries.size(); i++)
+        urls.push_back(buckets[b]->entries[i].first);
+}
+
+/**********************************************************************/
+
+LocalRepository::LocalRepository()
+{
+  pthread_mutex_init(&_mutex, NULL);
+  pthread_mutex_init(&publishMutex, NULL);
+  index=new FilesIndex();
+  readersEpoch=0;
+  readers[0]=readers[1]=0;
+  pthread_mutex_init(&openFilesMutex, NULL);
+  openFilesMax=LOCAL_REPOSITORY_OPEN_FILES;
+  openFilesGeneration=0;
+#ifdef LINUX
+  hotReload=true;
+  inotifyFd=-1;
+  wakeupPipe[0]=wakeupPipe[1]=-1;
+  watching=false;
+#else
+  hotReload=false;
+#endif
+}
+
+/**********************************************************************/
+
+LocalRepository::~LocalRepository()
+{
+#ifdef LINUX
+  stopWatching();
+#endif
+  clearAliases();
+  delete index;
+  pthread_mutex_destroy(&publishMutex);
+  pthread_mutex_destroy(&_mutex);
+
+  for (nw::map<int, OpenFile*>::iterator it=openFilesByFd.begin(); it != openFilesByFd.end(); it++)
+  {
+    close(it->first);
+    delete it->second;
+  }
+  pthread_mutex_destroy(&openFilesMutex);
+}
+
+/***********************************************************************
+* publishIndex: replace the index read by the requests with a copy of
+*   the files index (it shares the buckets, only the updated ones are
+*   copied later), then wait for the readers of the previous one: each
+*   parity of the epoch is drained in turn, the readers which entered
+*   meanwhile count on the other one and read the new index.
+***********************************************************************/
+
+void LocalRepository::publishIndex()
+{
+  pthread_mutex_lock( &publishMutex );
+
+  pthread_mutex_lock( &_mutex );
+  const FilesIndex *previous=index;
+  FilesIndex *current=new FilesIndex(files);
+  __sync_synchronize();
+  index=current;
+  pthread_mutex_unlock( &_mutex );
+
+  // the files index can be updated meanwhile
+  for (int i=0; i<2; i++)
+  {
+    unsigned parity=__sync_fetch_and_add(&readersEpoch, 1) & 1;
+    for (unsigned spins=0; readers[parity]; spins++)
+      if (spins < 64)
+        sched_yield();
+      else
+        usleep(1000);
+  }
+
+  pthread_mutex_lock( &_mutex );
+  delete previous;
+  pthread_mutex_unlock( &_mutex );
+
+  pthread_mutex_unlock( &publishMutex );
+}
+
+/**********************************************************************/
 
-      if (type == S_IFDIR)
-        loadFilename_dir(alias, path, subpath+"/"+entry->d_name);
+nw::string LocalRepository::getUrl(const nw::string& alias, const nw::string& subpath, const char *name)
+{
+  nw::string url=alias+subpath+"/"+name;
+  size_t i=0;
+  while (i < url.size() && url[i]=='/') i++;
+  return i ? url.substr(i) : url;
+}
+
+/***********************************************************************
+* scanDirectory: add the files of a directory (its entry types are read
+*   with the names, a stat is only needed for the links), and watch it
+* @param scan - the tree scan
+* @param subpath - the directory, relative to the tree root
+* @param subdirs - filled with its subdirectories
+***********************************************************************/
+
+void LocalRepository::scanDirectory(DirectoryScan& scan, const nw::string& subpath, nw::vector<nw::string>& subdirs)
+{
+  int dirFd=openat(scan.rootFd, subpath.size() ? subpath.c_str() + 1 : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dirFd == -1)
+    return;
+
+#ifdef LINUX
+  // watched before being read: no file can be missed
+  if (watching)
+  {
+    int wd=inotify_add_watch(inotifyFd, (scan.path+subpath).c_str(), LOCAL_REPOSITORY_WATCH_MASK);
+    if (wd == -1)
+      NVJ_LOG->append(NVJ_WARNING, nw::string("LocalRepository - can't watch '")+scan.path+subpath+"': "+strerror(errno));
+    else
+    {
+      pthread_mutex_lock( &_mutex );
+      Watch& watch=watches[wd];
+      watch.alias=scan.alias;
+      watch.path=scan.path;
+      watch.subpath=subpath;
+      pthread_mutex_unlock( &_mutex );
     }
+  }
+#endif
 
-    return true;
+  DIR *dir=fdopendir(dirFd);
+  if (dir == NULL)
+  {
+    close(dirFd);
+    return;
+  }
+
+  nw::vector< nw::pair<nw::string, nw::string> > found; // url | filename
+  struct dirent *entry;
+  while ((entry = readdir (dir)) != NULL )
+  {
+    if (!strcmp(entry->d_name,".") || !strcmp(entry->d_name,"..") || !strlen(entry->d_name)) continue;
+
+    unsigned char type=entry->d_type;
+    if (type == DT_UNKNOWN || type == DT_LNK)
+    {
+      struct stat s;
+      if (fstatat(dirFd, entry->d_name, &s, 0) == -1)
+      {
+        NVJ_LOG->append(NVJ_ERROR,nw::string("LocalRepository - stat error : ")+nw::string(strerror(errno)));
+        continue;
+      }
+      type = S_ISREG(s.st_mode) ? DT_REG : S_ISDIR(s.st_mode) ? DT_DIR : DT_UNKNOWN;
+    }
+
+    if (type == DT_REG)
+      found.push_back(nw::pair<nw::string, nw::string>(getUrl(scan.alias, subpath, entry->d_name),
+                                                         scan.path+subpath+"/"+entry->d_name));
+    else if (type == DT_DIR)
+      subdirs.push_back(subpath+"/"+entry->d_name);
+  }
+  closedir(dir);
+
+  pthread_mutex_lock( &_mutex );
+  for (size_t i=0; i<found.size(); i++)
+    files.insert(found[i].first, found[i].second);
+  pthread_mutex_unlock( &_mutex );
+}
+
+/**********************************************************************/
+
+void* LocalRepository::startScanThread(void *p)
+{
+  DirectoryScan *scan=static_cast<DirectoryScan *>(p);
+  nw::vector<nw::string> subdirs;
+
+  pthread_mutex_lock(&scan->mutex);
+  for (;;)
+  {
+    while (scan->pending.empty() && scan->scanning)
+      pthread_cond_wait(&scan->cond, &scan->mutex);
+    if (scan->pending.empty())
+      break;
+
+    nw::string subpath=scan->pending.back();
+    scan->pending.pop_back();
+    scan->scanning++;
+    pthread_mutex_unlock(&scan->mutex);
+
+    subdirs.clear();
+    scan->repository->scanDirectory(*scan, subpath, subdirs);
+
+    pthread_mutex_lock(&scan->mutex);
+    scan->scanning--;
+    scan->pending.insert(scan->pending.end(), subdirs.begin(), subdirs.end());
+    pthread_cond_broadcast(&scan->cond);
+  }
+  pthread_mutex_unlock(&scan->mutex);
+
+  return NULL;
+}
+
+/***********************************************************************
+* loadFilename_dir: add the files of a tree, scanned by up to
+*   LOCAL_REPOSITORY_SCAN_THREADS threads
+* \return false if the directory can't be opened
+***********************************************************************/
+
+bool LocalRepository::loadFilename_dir (const nw::string& alias, const nw::string& path, const nw::string& subpath="")
+{
+  DirectoryScan scan;
+  scan.repository=this;
+  scan.alias=alias;
+  scan.path=path;
+  if ((scan.rootFd=open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+    return false;
+  scan.pending.push_back(subpath);
+  scan.scanning=0;
+  pthread_mutex_init(&scan.mutex, NULL);
+  pthread_cond_init(&scan.cond, NULL);
+
+  long nbCpus=sysconf(_SC_NPROCESSORS_ONLN);
+  size_t nbThreads = nbCpus > 1 ? nbCpus : 1;
+  if (nbThreads > LOCAL_REPOSITORY_SCAN_THREADS)
+    nbThreads=LOCAL_REPOSITORY_SCAN_THREADS;
+
+  // this thread is one of them
+  nw::vector<pthread_t> threads(nbThreads - 1);
+  for (size_t i=0; i<threads.size(); i++)
+    create_thread(&threads[i], LocalRepository::startScanThread, static_cast<void *>(&scan));
+  startScanThread(&scan);
+  for (size_t i=0; i<threads.size(); i++)
+    wait_for_thread(threads[i]);
+
+  pthread_cond_destroy(&scan.cond);
+  pthread_mutex_destroy(&scan.mutex);
+  close(scan.rootFd);
+  return true;
 }
 
 /**********************************************************************/
@@ -85,99 +514,489 @@ void LocalRepository::addDirectory( const nw::string& alias, const nw::string& d
   if (realpath(dirPath.c_str(), resolved_path) == NULL)
     return ;
 
+#ifdef LINUX
+  if (hotReload && !watching)
+    startWatching();
+#endif
+
   if (!loadFilename_dir(newalias, resolved_path))
 	  return ;
 
+  pthread_mutex_lock( &_mutex );
   aliasesSet.insert( nw::pair<nw::string, nw::string>(newalias, resolved_path) );
-
+  pthread_mutex_unlock( &_mutex );
+  publishIndex();
 }
 
 /**********************************************************************/
 
 void LocalRepository::clearAliases()
 {
-  filenamesSet.clear();
+  pthread_mutex_lock( &_mutex );
+  files.clear();
   aliasesSet.clear();
+#ifdef LINUX
+  for (nw::map<int, Watch>::iterator it=watches.begin(); it != watches.end(); it++)
+    inotify_rm_watch(inotifyFd, it->first);
+  watches.clear();
+#endif
+  pthread_mutex_unlock( &_mutex );
+  invalidateOpenFiles("", true);
+  publishIndex();
 }
 
+#ifdef LINUX
+
 /**********************************************************************/
 
-bool LocalRepository::fileExist(const nw::string& url)
+bool LocalRepository::startWatching()
 {
-  return filenamesSet.find(url) != filenamesSet.end();
+  if ((inotifyFd=inotify_init1(IN_CLOEXEC)) == -1)
+  {
+    NVJ_LOG->append(NVJ_WARNING, nw::string("LocalRepository - inotify_init1 error : ")+strerror(errno));
+    return false;
+  }
+  if (pipe(wakeupPipe) == -1)
+  {
+    close(inotifyFd);
+    inotifyFd=-1;
+    return false;
+  }
+
+  watching=true;
+  create_thread(&watchThread, LocalRepository::startWatchThread, static_cast<void *>(this));
+  return true;
 }
 
 /**********************************************************************/
 
-void LocalRepository::printFilenames()
+void LocalRepository::stopWatching()
 {
-  for (nw::set<nw::string>::iterator it = filenamesSet.begin(); it != filenamesSet.end(); it++)
-    printf ("%s\n", it->c_str() );
+  if (!watching)
+    return;
+
+  watching=false;
+  if (write(wakeupPipe[1], "", 1) != 1)
+    NVJ_LOG->append(NVJ_ERROR, "LocalRepository - can't stop the watch thread");
+  wait_for_thread(watchThread);
+
+  pthread_mutex_lock( &_mutex );
+  watches.clear();
+  pthread_mutex_unlock( &_mutex );
+
+  close(inotifyFd);
+  close(wakeupPipe[0]);
+  close(wakeupPipe[1]);
+  inotifyFd=wakeupPipe[0]=wakeupPipe[1]=-1;
 }
 
-/**********************************************************************/
+/***********************************************************************
+* removeWatches: stop watching a directory and its subdirectories
+***********************************************************************/
 
-bool LocalRepository::getFile(HttpRequest* request, HttpResponse *response)
+void LocalRepository::removeWatches(const nw::string& alias, const nw::string& path, const nw::string& subpath)
 {
-  bool found=false;
-  const nw::string *alias=NULL, *path=NULL;
-  nw::string url = request->getUrl();
-  size_t webpageLen;
-  unsigned char *webpage;
+  nw::string prefix=subpath+'/';
+
   pthread_mutex_lock( &_mutex );
+  for (nw::map<int, Watch>::iterator it=watches.begin(); it != watches.end(); )
+    if (it->second.alias == alias && it->second.path == path
+        && (it->second.subpath == subpath || !it->second.subpath.compare(0, prefix.size(), prefix)))
+    {
+      inotify_rm_watch(inotifyFd, it->first);
+      watches.erase(it++);
+    }
+    else
+      it++;
+  pthread_mutex_unlock( &_mutex );
+}
+
+/***********************************************************************
+* processEvents: update the files index
+* @param buf - the inotify events
+* @param len - their length
+* @return true if the files index has been updated
+***********************************************************************/
 
-  if (!fileExist(url)) { pthread_mutex_unlock( &_mutex); return false; };
+bool LocalRepository::processEvents(const char *buf, const ssize_t len)
+{
+  bool updated=false;
 
-  for (nw::set< nw::pair<nw::string,nw::string> >::iterator it = aliasesSet.begin(); it != aliasesSet.end() && !found; it++)
+  for (const char *p=buf; p < buf + len; p+=sizeof(struct inotify_event) + ((const struct inotify_event *)p)->len)
   {
-    alias=&(it->first);
-    if (!(url.compare(0, alias->size(), *alias)))
+    const struct inotify_event *event=(const struct inotify_event *)p;
+
+    // events have been lost: everything is scanned again
+    if (event->mask & IN_Q_OVERFLOW)
+    {
+      NVJ_LOG->append(NVJ_WARNING, "LocalRepository - inotify queue overflow, the directories are scanned again");
+      pthread_mutex_lock( &_mutex );
+      nw::set< nw::pair<nw::string,nw::string> > aliases=aliasesSet;
+      files.clear();
+      for (nw::map<int, Watch>::iterator it=watches.begin(); it != watches.end(); it++)
+        inotify_rm_watch(inotifyFd, it->first);
+      watches.clear();
+      pthread_mutex_unlock( &_mutex );
+
+      for (nw::set< nw::pair<nw::string,nw::string> >::iterator it=aliases.begin(); it != aliases.end(); it++)
+        loadFilename_dir(it->first, it->second);
+      invalidateOpenFiles("", true);
+      updated=true;
+      continue;
+    }
+
+    pthread_mutex_lock( &_mutex );
+    nw::map<int, Watch>::iterator it=watches.find(event->wd);
+    if (it == watches.end())
     {
-      path=&(it->second);
-      found= true;
+      pthread_mutex_unlock( &_mutex );
+      continue;
+    }
+    Watch watch=it->second;
+    if (event->mask & IN_IGNORED)
+      watches.erase(it);
+    pthread_mutex_unlock( &_mutex );
+
+    if (!event->len)
+      continue;
+
+    nw::string url=getUrl(watch.alias, watch.subpath, event->name);
+    nw::string subpath=watch.subpath+"/"+event->name;
+
+    // written, replaced or removed: its descriptor is closed
+    invalidateOpenFiles(url, (event->mask & IN_ISDIR) != 0);
+
+    if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+    {
+      if (event->mask & IN_ISDIR)
+      {
+        removeWatches(watch.alias, watch.path, subpath);
+        pthread_mutex_lock( &_mutex );
+        files.eraseDirectory(url);
+        pthread_mutex_unlock( &_mutex );
+      }
+      else
+      {
+        pthread_mutex_lock( &_mutex );
+        files.erase(url);
+        pthread_mutex_unlock( &_mutex );
+      }
+      updated=true;
+    }
+
+    if (event->mask & (IN_CREATE | IN_MOVED_TO))
+    {
+      struct stat s;
+      if (stat((watch.path+subpath).c_str(), &s) == -1)
+        continue;
+
+      if (S_ISDIR(s.st_mode))
+        loadFilename_dir(watch.alias, watch.path, subpath);
+      else if (S_ISREG(s.st_mode))
+      {
+        pthread_mutex_lock( &_mutex );
+        files.insert(url, watch.path+subpath);
+        pthread_mutex_unlock( &_mutex );
+      }
+      updated=true;
     }
   }
 
-  pthread_mutex_unlock( &_mutex);
-  if (!found) return false;
+  return updated;
+}
+
+/**********************************************************************/
+
+void* LocalRepository::startWatchThread(void *p)
+{
+  static_cast<LocalRepository *>(p)->watchProcessing();
+  pthread_exit(NULL);
+  return NULL;
+}
+
+/***********************************************************************
+* watchProcessing: process the inotify events. The index is published
+*   LOCAL_REPOSITORY_PUBLISH_DELAY ms after its first unpublished update,
+*   with the updates of the events read meanwhile.
+***********************************************************************/
+
+void LocalRepository::watchProcessing()
+{
+  char buf[16384] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  struct pollfd fds[2];
+  fds[0].fd=inotifyFd;
+  fds[0].events=POLLIN;
+  fds[1].fd=wakeupPipe[0];
+  fds[1].events=POLLIN;
+  bool updated=false;
+  struct timespec publishTime;
+
+  while (watching)
+  {
+    int timeout=-1;
+    if (updated)
+    {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      long remaining=(publishTime.tv_sec - now.tv_sec) * 1000 + (publishTime.tv_nsec - now.tv_nsec) / 1000000;
+      if (remaining <= 0)
+      {
+        publishIndex();
+        updated=false;
+      }
+      else
+        timeout=(int)remaining;
+    }
+
+    int n=poll(fds, 2, timeout);
+    if (n == -1)
+    {
+      if (errno == EINTR) continue;
+      NVJ_LOG->append(NVJ_ERROR, nw::string("LocalRepository - poll error : ")+strerror(errno));
+      break;
+    }
+    if (!n)
+      continue;
+    if (fds[1].revents)
+      break;
+
+    ssize_t len=read(inotifyFd, buf, sizeof buf);
+    if (len > 0 && processEvents(buf, len) && !updated)
+    {
+      clock_gettime(CLOCK_MONOTONIC, &publishTime);
+      publishTime.tv_nsec+=LOCAL_REPOSITORY_PUBLISH_DELAY * 1000000L;
+      publishTime.tv_sec+=publishTime.tv_nsec / 1000000000L;
+      publishTime.tv_nsec%=1000000000L;
+      updated=true;
+    }
+  }
+
+  if (updated)
+    publishIndex();
+}
+
+#endif
+
+
+/**********************************************************************/
+
+void LocalRepository::printFilenames()
+{
+  nw::vector<nw::string> urls;
+  pthread_mutex_lock( &_mutex );
+  files.getAll(urls);
+  pthread_mutex_unlock( &_mutex );
+
+  nw::sort(urls.begin(), urls.end());
+  for (nw::vector<nw::string>::iterator it = urls.begin(); it != urls.end(); it++)
+    printf ("%s\n", it->c_str() );
+}
 
-  nw::string resultat, filename=url;
+/***********************************************************************
+* getOpenFile: take a reference to a cached file
+* @param generation - set to the invalidations count, to be given to
+*   addOpenFile() if the file is not cached
+* \return false if the file is not cached
+***********************************************************************/
 
-  if (alias->size())
-    filename.replace(0, alias->size(), *path);
+bool LocalRepository::getOpenFile(const nw::string& url, int& fd, off_t& size, unsigned long& generation)
+{
+  if (!isCachingOpenFiles())
+    return false;
+
+  pthread_mutex_lock( &openFilesMutex );
+  generation=openFilesGeneration;
+  nw::map<nw::string, OpenFile*>::iterator it=openFiles.find(url);
+  if (it == openFiles.end())
+  {
+    pthread_mutex_unlock( &openFilesMutex );
+    return false;
+  }
+
+  OpenFile *file=it->second;
+  file->refs++;
+  openFilesLru.splice(openFilesLru.end(), openFilesLru, file->lruIt);
+  fd=file->fd;
+  size=file->size;
+  pthread_mutex_unlock( &openFilesMutex );
+  return true;
+}
+
+/***********************************************************************
+* addOpenFile: cache a file opened by a request (which holds its first
+*   reference). It is not cached if it may have been changed since
+*   getOpenFile(), or if the cached files are all in use: its descriptor
+*   is then closed by closeFile().
+***********************************************************************/
+
+void LocalRepository::addOpenFile(const nw::string& url, const int fd, const off_t size, const unsigned long generation)
+{
+  if (!isCachingOpenFiles())
+    return;
+
+  pthread_mutex_lock( &openFilesMutex );
+
+  if (generation != openFilesGeneration || openFiles.count(url))
+  {
+    pthread_mutex_unlock( &openFilesMutex );
+    return;
+  }
+
+  // evict the least recently used files which are not in use
+  nw::list<OpenFile*>::iterator lruIt=openFilesLru.begin();
+  while (openFiles.size() >= openFilesMax && lruIt != openFilesLru.end())
+  {
+    OpenFile *file=*lruIt++;
+    if (!file->refs)
+      releaseOpenFile(file);
+  }
+  if (openFiles.size() >= openFilesMax)
+  {
+    pthread_mutex_unlock( &openFilesMutex );
+    return;
+  }
+
+  OpenFile *file=new OpenFile();
+  file->url=url;
+  file->fd=fd;
+  file->size=size;
+  file->refs=1;
+  file->cached=true;
+  file->lruIt=openFilesLru.insert(openFilesLru.end(), file);
+  openFiles[url]=file;
+  openFilesByFd[fd]=file;
+
+  pthread_mutex_unlock( &openFilesMutex );
+}
+
+/***********************************************************************
+* releaseOpenFile: remove a file from the cache, and close it if it is
+*   not in use (openFilesMutex locked)
+***********************************************************************/
+
+void LocalRepository::releaseOpenFile(OpenFile *file)
+{
+  if (file->cached)
+  {
+    openFiles.erase(file->url);
+    openFilesLru.erase(file->lruIt);
+    file->cached=false;
+  }
+
+  if (!file->refs)
+  {
+    openFilesByFd.erase(file->fd);
+    close(file->fd);
+    delete file;
+  }
+}
+
+/***********************************************************************
+* invalidateOpenFiles: remove a changed file from the cache
+* @param url - the file, or a directory
+* @param directory - true to remove the files under url/ (all of them if
+*   url is empty)
+***********************************************************************/
+
+void LocalRepository::invalidateOpenFiles(const nw::string& url, const bool directory)
+{
+  pthread_mutex_lock( &openFilesMutex );
+  openFilesGeneration++;
+
+  if (directory)
+  {
+    nw::string prefix=url.size() ? url+'/' : "";
+    nw::map<nw::string, OpenFile*>::iterator it=openFiles.lower_bound(prefix);
+    while (it != openFiles.end() && !it->first.compare(0, prefix.size(), prefix))
+      releaseOpenFile((it++)->second);
+  }
   else
-    filename=*path+'/'+filename;
+  {
+    nw::map<nw::string, OpenFile*>::iterator it=openFiles.find(url);
+    if (it != openFiles.end())
+      releaseOpenFile(it->second);
+  }
+
+  pthread_mutex_unlock( &openFilesMutex );
+}
 
-  FILE *pFile = fopen ( filename.c_str() , "rb" );
-  if (pFile==NULL)
+/**********************************************************************/
+
+void LocalRepository::closeFile(int fd)
+{
+  pthread_mutex_lock( &openFilesMutex );
+  nw::map<int, OpenFile*>::iterator it=openFilesByFd.find(fd);
+  if (it == openFilesByFd.end())
+  {
+    pthread_mutex_unlock( &openFilesMutex );
+    ::close(fd);
+    return;
+  }
+
+  OpenFile *file=it->second;
+  file->refs--;
+  if (!file->refs && !file->cached)
+    releaseOpenFile(file);
+  pthread_mutex_unlock( &openFilesMutex );
+}
+
+/**********************************************************************/
+
+bool LocalRepository::getFile(HttpRequest* request, HttpResponse *response)
+{
+  nw::string url = request->getUrl();
+  struct stat s;
+  HttpRequestMethod method=request->getRequestType();
+
+  if (method == PATCH_METHOD || method == EXTENSION_METHOD)
+    return false;
+
+  unsigned parity=enterIndex();
+  const nw::string *filename=index->find(url);
+
+  if (filename == NULL) { leaveIndex(parity); return false; };
+
+  if (method == OPTIONS_METHOD)
+  {
+    leaveIndex(parity);
+    response->addHeader("Allow", "GET, HEAD, OPTIONS");
+    return true;
+  }
+
+  int fd;
+  off_t size;
+  unsigned long generation=0;
+  if (getOpenFile(url, fd, size, generation))
+  {
+    leaveIndex(parity);
+    response->setContentFile (fd, size);
+    return true;
+  }
+
+  fd = open ( filename->c_str(), O_RDONLY | O_CLOEXEC );
+  if (fd == -1)
   {
     char logBuffer[150];
-    snprintf(logBuffer, 150, "Webserver : Error opening file '%s'", filename.c_str() );
+    snprintf(logBuffer, 150, "Webserver : Error opening file '%s'", filename->c_str() );
+    leaveIndex(parity);
     NVJ_LOG->append(NVJ_ERROR, logBuffer);
     return false;
   }
 
   // obtain file size.
-  fseek (pFile , 0 , SEEK_END);
-  webpageLen = ftell (pFile);
-  rewind (pFile);
-
-  if ( (webpage = (unsigned char *)malloc( webpageLen+1 * sizeof(char))) == NULL )
-    return false;
-  size_t nb=fread (webpage,1,webpageLen,pFile);
-  if (nb != webpageLen)
+  if (fstat(fd, &s) == -1 || (s.st_mode & S_IFMT) != S_IFREG)
   {
     char logBuffer[150];
-    snprintf(logBuffer, 150, "Webserver : Error accessing file '%s'", filename.c_str() );
+    snprintf(logBuffer, 150, "Webserver : Error accessing file '%s'", filename->c_str() );
+    leaveIndex(parity);
     NVJ_LOG->append(NVJ_ERROR, logBuffer);
+    close(fd);
     return false;
   }
+  leaveIndex(parity);
+  addOpenFile(url, fd, s.st_size, generation);
 
-  fclose (pFile);
-  response->setContent (webpage, webpageLen);
+  // the content is read (or sent with sendfile) by the webserver
+  response->setContentFile (fd, s.st_size);
   return true;
 }
-
-
-
-
@@ -0,0 +1,321 @@
+//********************************************************
+/**
+ * @file  MimeTypes.cc
+ *
+ * @brief The mime types of the files extensions (perfect hash table)
+ *
+ * @author agent (agent@local)
+ *
+ * @version 1
+ * @date 19/10/26
+ */
+//********************************************************
+
+#include <string.h>
+#include <strings.h>
+
+#include "libnavajo/MimeTypes.hh"
+
+#define MIME_TYPE(ext, type) { ext, type, sizeof(type) - 1 }
+
+const MimeType MimeTypes::table[] =
+{
+  // text
+  MIME_TYPE("html", "text/html"),
+  MIME_TYPE("htm", "text/html"),
+  MIME_TYPE("shtml", "text/html"),
+  MIME_TYPE("css", "text/css"),
+  MIME_TYPE("txt", "text/plain"),
+  MIME_TYPE("text", "text/plain"),
+  MIME_TYPE("log", "text/plain"),
+  MIME_TYPE("csv", "text/csv"),
+  MIME_TYPE("tsv", "text/tab-separated-values"),
+  MIME_TYPE("md", "text/markdown"),
+  MIME_TYPE("ics", "text/calendar"),
+  MIME_TYPE("vcf", "text/vcard"),
+  MIME_TYPE("vtt", "text/vtt"),
+  MIME_TYPE("mml", "text/mathml"),
+  MIME_TYPE("jad", "text/vnd.sun.j2me.app-descriptor"),
+  MIME_TYPE("wml", "text/vnd.wap.wml"),
+  MIME_TYPE("htc", "text/x-component"),
+
+  // application
+  MIME_TYPE("js", "application/javascript"),
+  MIME_TYPE("mjs", "application/javascript"),
+  MIME_TYPE("json", "application/json"),
+  MIME_TYPE("map", "application/json"),
+  MIME_TYPE("jsonld", "application/ld+json"),
+  MIME_TYPE("webmanifest", "application/manifest+json"),
+  MIME_TYPE("xml", "application/xml"),
+  MIME_TYPE("xsl", "application/xml"),
+  MIME_TYPE("xsd", "application/xml"),
+  MIME_TYPE("dtd", "application/xml-dtd"),
+  MIME_TYPE("xhtml", "application/xhtml+xml"),
+  MIME_TYPE("rss", "application/rss+xml"),
+  MIME_TYPE("atom", "application/atom+xml"),
+  MIME_TYPE("kml", "application/vnd.google-earth.kml+xml"),
+  MIME_TYPE("kmz", "application/vnd.google-earth.kmz"),
+  MIME_TYPE("wasm", "application/wasm"),
+  MIME_TYPE("pdf", "application/pdf"),
+  MIME_TYPE("ps", "application/postscript"),
+  MIME_TYPE("eps", "application/postscript"),
+  MIME_TYPE("ai", "application/postscript"),
+  MIME_TYPE("rtf", "application/rtf"),
+  MIME_TYPE("doc", "application/msword"),
+  MIME_TYPE("docx", "application/vnd.openxmlformats-officedocument.wordprocessingml.document"),
+  MIME_TYPE("xls", "application/vnd.ms-excel"),
+  MIME_TYPE("xlsx", "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet"),
+  MIME_TYPE("ppt", "application/vnd.ms-powerpoint"),
+  MIME_TYPE("pptx", "application/vnd.openxmlformats-officedocument.presentationml.presentation"),
+  MIME_TYPE("odt", "application/vnd.oasis.opendocument.text"),
+  MIME_TYPE("ods", "application/vnd.oasis.opendocument.spreadsheet"),
+  MIME_TYPE("odp", "application/vnd.oasis.opendocument.presentation"),
+  MIME_TYPE("odg", "application/vnd.oasis.opendocument.graphics"),
+  MIME_TYPE("epub", "application/epub+zip"),
+  MIME_TYPE("bin", "application/octet-stream"),
+  MIME_TYPE("exe", "application/octet-stream"),
+  MIME_TYPE("dll", "application/octet-stream"),
+  MIME_TYPE("so", "application/octet-stream"),
+  MIME_TYPE("deb", "application/octet-stream"),
+  MIME_TYPE("dmg", "application/octet-stream"),
+  MIME_TYPE("iso", "application/octet-stream"),
+  MIME_TYPE("img", "application/octet-stream"),
+  MIME_TYPE("msi", "application/octet-stream"),
+  MIME_TYPE("rpm", "application/x-redhat-package-manager"),
+  MIME_TYPE("apk", "application/vnd.android.package-archive"),
+  MIME_TYPE("jar", "application/java-archive"),
+  MIME_TYPE("war", "application/java-archive"),
+  MIME_TYPE("ear", "application/java-archive"),
+  MIME_TYPE("class", "application/java-vm"),
+  MIME_TYPE("zip", "application/zip"),
+  MIME_TYPE("gz", "application/gzip"),
+  MIME_TYPE("tgz", "application/gzip"),
+  MIME_TYPE("bz2", "application/x-bzip2"),
+  MIME_TYPE("xz", "application/x-xz"),
+  MIME_TYPE("zst", "application/zstd"),
+  MIME_TYPE("7z", "application/x-7z-compressed"),
+  MIME_TYPE("rar", "application/vnd.rar"),
+  MIME_TYPE("tar", "application/x-tar"),
+  MIME_TYPE("cpio", "application/x-cpio"),
+  MIME_TYPE("swf", "application/x-shockwave-flash"),
+  MIME_TYPE("crt", "application/x-x509-ca-cert"),
+  MIME_TYPE("der", "application/x-x509-ca-cert"),
+  MIME_TYPE("pem", "application/x-pem-file"),
+  MIME_TYPE("p12", "application/x-pkcs12"),
+  MIME_TYPE("sh", "application/x-sh"),
+  MIME_TYPE("pl", "application/x-perl"),
+  MIME_TYPE("pm", "application/x-perl"),
+  MIME_TYPE("tcl", "application/x-tcl"),
+  MIME_TYPE("tk", "application/x-tcl"),
+  MIME_TYPE("run", "application/x-makeself"),
+  MIME_TYPE("prc", "application/x-pilot"),
+  MIME_TYPE("pdb", "application/x-pilot"),
+  MIME_TYPE("sea", "application/x-sea"),
+  MIME_TYPE("sit", "application/x-stuffit"),
+  MIME_TYPE("xpi", "application/x-xpinstall"),
+  MIME_TYPE("cco", "application/x-cocoa"),
+  MIME_TYPE("jardiff", "application/x-java-archive-diff"),
+  MIME_TYPE("jnlp", "application/x-java-jnlp-file"),
+  MIME_TYPE("wmlc", "application/vnd.wap.wmlc"),
+  MIME_TYPE("m3u8", "application/vnd.apple.mpegurl"),
+  MIME_TYPE("hqx", "application/mac-binhex40"),
+  MIME_TYPE("torrent", "application/x-bittorrent"),
+  MIME_TYPE("sql", "application/sql"),
+  MIME_TYPE("ttl", "text/turtle"),
+
+  // fonts
+  MIME_TYPE("woff", "font/woff"),
+  MIME_TYPE("woff2", "font/woff2"),
+  MIME_TYPE("ttf", "font/ttf"),
+  MIME_TYPE("otf", "font/otf"),
+  MIME_TYPE("eot", "application/vnd.ms-fontobject"),
+
+  // images
+  MIME_TYPE("png", "image/png"),
+  MIME_TYPE("jpg", "image/jpeg"),
+  MIME_TYPE("jpeg", "image/jpeg"),
+  MIME_TYPE("jpe", "image/jpeg"),
+  MIME_TYPE("gif", "image/gif"),
+  MIME_TYPE("svg", "image/svg+xml"),
+  MIME_TYPE("svgz", "image/svg+xml"),
+  MIME_TYPE("ico", "image/x-icon"),
+  MIME_TYPE("cur", "image/x-icon"),
+  MIME_TYPE("bmp", "image/bmp"),
+  MIME_TYPE("webp", "image/webp"),
+  MIME_TYPE("avif", "image/avif"),
+  MIME_TYPE("heic", "image/heic"),
+  MIME_TYPE("tif", "image/tiff"),
+  MIME_TYPE("tiff", "image/tiff"),
+  MIME_TYPE("jng", "image/x-jng"),
+  MIME_TYPE("wbmp", "image/vnd.wap.wbmp"),
+  MIME_TYPE("psd", "image/vnd.adobe.photoshop"),
+  MIME_TYPE("xbm", "image/x-xbitmap"),
+
+  // audio
+  MIME_TYPE("au", "audio/basic"),
+  MIME_TYPE("snd", "audio/basic"),
+  MIME_TYPE("wav", "audio/wav"),
+  MIME_TYPE("mp3", "audio/mpeg"),
+  MIME_TYPE("m4a", "audio/mp4"),
+  MIME_TYPE("aac", "audio/aac"),
+  MIME_TYPE("oga", "audio/ogg"),
+  MIME_TYPE("ogg", "audio/ogg"),
+  MIME_TYPE("opus", "audio/ogg"),
+  MIME_TYPE("flac", "audio/flac"),
+  MIME_TYPE("weba", "audio/webm"),
+  MIME_TYPE("mid", "audio/midi"),
+  MIME_TYPE("midi", "audio/midi"),
+  MIME_TYPE("kar", "audio/midi"),
+  MIME_TYPE("ra", "audio/x-realaudio"),
+  MIME_TYPE("aif", "audio/x-aiff"),
+  MIME_TYPE("aiff", "audio/x-aiff"),
+
+  // video
+  MIME_TYPE("mp4", "video/mp4"),
+  MIME_TYPE("m4v", "video/x-m4v"),
+  MIME_TYPE("webm", "video/webm"),
+  MIME_TYPE("ogv", "video/ogg"),
+  MIME_TYPE("mpeg", "video/mpeg"),
+  MIME_TYPE("mpg", "video/mpeg"),
+  MIME_TYPE("avi", "video/x-msvideo"),
+  MIME_TYPE("mov", "video/quicktime"),
+  MIME_TYPE("qt", "video/quicktime"),
+  MIME_TYPE("mkv", "video/x-matroska"),
+  MIME_TYPE("flv", "video/x-flv"),
+  MIME_TYPE("wmv", "video/x-ms-wmv"),
+  MIME_TYPE("asf", "video/x-ms-asf"),
+  MIME_TYPE("asx", "video/x-ms-asf"),
+  MIME_TYPE("mng", "video/x-mng"),
+  MIME_TYPE("3gp", "video/3gpp"),
+  MIME_TYPE("3gpp", "video/3gpp"),
+  MIME_TYPE("ts", "video/mp2t"),
+  MIME_TYPE("h264", "video/h264"),
+  MIME_TYPE("dv", "video/dv")
+};
+
+const size_t MimeTypes::tableSize=sizeof table / sizeof table[0];
+unsigned short MimeTypes::slots[MIME_TYPES_SLOTS];
+unsigned short MimeTypes::displacements[MIME_TYPES_BUCKETS];
+bool MimeTypes::initialized=MimeTypes::init();
+
+/***********************************************************************
+* hash: FNV-1a of the lower case extension, from a seed
+***********************************************************************/
+
+u_int32_t MimeTypes::hash(const char *ext, const size_t len, const u_int32_t seed)
+{
+  u_int32_t h=2166136261u ^ (seed * 0x9e3779b9u);
+  for (size_t i=0; i<len; i++)
+  {
+    unsigned char c=ext[i];
+    if (c >= 'A' && c <= 'Z') c+='a'-'A';
+    h=(h ^ c) * 16777619u;
+  }
+  h^=h >> 15;
+  return h;
+}
+
+/***********************************************************************
+* init: compute the displacements, the largest buckets placed first
+* \return true
+***********************************************************************/
+
+bool MimeTypes::init()
+{
+  if (initialized)
+    return true;
+
+  unsigned short bucketSizes[MIME_TYPES_BUCKETS];
+  memset(bucketSizes, 0, sizeof bucketSizes);
+  memset(slots, 0, sizeof slots);
+  for (size_t i=0; i<tableSize; i++)
+    bucketSizes[hash(table[i].extension, strlen(table[i].extension), 0) % MIME_TYPES_BUCKETS]++;
+
+  for (unsigned short size=tableSize; size > 0; size--)
+    for (unsigned b=0; b<MIME_TYPES_BUCKETS; b++)
+    {
+      if (bucketSizes[b] != size)
+        continue;
+
+      // the first displacement placing all the bucket's extensions in free slots
+      for (u_int32_t d=1; d <= 0xffff; d++)
+      {
+        size_t placed[MIME_TYPES_SLOTS], nbPlaced=0;
+        bool ok=true;
+        for (size_t i=0; i<tableSize && ok; i++)
+        {
+          size_t len=strlen(table[i].extension);
+          if (hash(table[i].extension, len, 0) % MIME_TYPES_BUCKETS != b)
+            continue;
+          size_t slot=hash(table[i].extension, len, d) & (MIME_TYPES_SLOTS - 1);
+          if (slots[slot])
+            ok=false;
+          else
+          {
+            slots[slot]=i + 1;
+            placed[nbPlaced++]=slot;
+          }
+        }
+
+        if (ok)
+        {
+          displacements[b]=d;
+          break;
+        }
+        while (nbPlaced)
+          slots[placed[--nbPlaced]]=0;
+      }
+    }
+
+  return true;
+}
+
+/**********************************************************************/
+
+const MimeType* MimeTypes::find(const char *ext, const size_t len)
+{
+  if (!initialized)
+    initialized=init();
+  if (!len || len > MIME_TYPES_EXTENSION_MAX)
+    return NULL;
+
+  u_int32_t d=displacements[hash(ext, len, 0) % MIME_TYPES_BUCKETS];
+  unsigned short i=slots[hash(ext, len, d) & (MIME_TYPES_SLOTS - 1)];
+  if (!i || strncasecmp(table[i-1].extension, ext, len) || table[i-1].extension[len])
+    return NULL;
+  return &table[i-1];
+}
+
+/**********************************************************************/
+
+const MimeType* MimeTypes::findByName(const char *name)
+{
+  const char *ext=strrchr(name, '.');
+  if (ext == NULL || strchr(ext, '/') != NULL)
+    return NULL;
+  ext++;
+  return find(ext, strlen(ext));
+}
+
+/**********************************************************************/
+
+bool MimeTypes::isCompressible(const char *type)
+{
+  static const char *compressibleTypes[]=
+  {
+    "application/postscript", "application/rtf", "application/msword", "application/vnd.ms-excel",
+    "application/vnd.ms-powerpoint", "application/vnd.ms-fontobject", "application/wasm", "application/sql",
+    "application/x-tar", "application/x-sh", "application/x-perl", "application/x-tcl", "application/x-pem-file",
+    "font/ttf", "font/otf", "image/bmp", "image/x-icon", NULL
+  };
+
+  if (!strncmp(type, "text/", 5) || strstr(type, "json") != NULL || strstr(type, "xml") != NULL
+      || strstr(type, "javascript") != NULL)
+    return true;
+
+  for (const char **t=compressibleTypes; *t != NULL; t++)
+    if (!strcmp(type, *t))
+      return true;
+  return false;
+}
+
@@ -0,0 +1,182 @@
+//********************************************************
+/**
+ * @file  PeerIpHistory.cc
+ *
+ * @brief The recent clients ip addresses (bounded, lock free)
+ *
+ * @author agent (agent@local)
+ *
+ * @version 1
+ * @date 19/10/26
+ */
+//********************************************************
+
+#include <string.h>
+#include <sched.h>
+
+#include "libnavajo/PeerIpHistory.hh"
+
+#define PEER_IP_HISTORY_RETRIES 4 // concurrent writers, before giving up
+
+/**********************************************************************/
+
+PeerIpHistory::PeerIpHistory()
+{
+  slots=new Slot[PEER_IP_HISTORY_SIZE];
+  memset(slots, 0, PEER_IP_HISTORY_SIZE * sizeof(Slot));
+}
+
+/**********************************************************************/
+
+PeerIpHistory::~PeerIpHistory()
+{
+  delete[] slots;
+}
+
+/**********************************************************************/
+
+size_t PeerIpHistory::hash(const IpAddress& ip)
+{
+  u_int32_t h;
+  if (ip.ipversion == 4)
+    h=ip.ip.v4;
+  else
+  {
+    h=2166136261u;
+    for (unsigned i=0; i<INET6_ADDRLEN; i++)
+      h=(h ^ ip.ip.v6.s6_addr[i]) * 16777619u;
+  }
+
+  // all the bits are mixed in the low ones
+  h^=h >> 16; h*=0x85ebca6bu;
+  h^=h >> 13; h*=0xc2b2ae35u;
+  h^=h >> 16;
+  return h;
+}
+
+/**********************************************************************/
+
+bool PeerIpHistory::isEqual(const Slot& slot, const IpAddress& ip)
+{
+  if (slot.ipversion != ip.ipversion)
+    return false;
+  if (ip.ipversion == 4)
+    return slot.ip.v4 == ip.ip.v4;
+  return !memcmp(slot.ip.v6.s6_addr, ip.ip.v6.s6_addr, INET6_ADDRLEN);
+}
+
+/**********************************************************************/
+
+bool PeerIpHistory::update(const IpAddress& ip, const time_t now, const time_t expiration)
+{
+  size_t h=hash(ip);
+
+  for (unsigned retry=0; retry<PEER_IP_HISTORY_RETRIES; retry++)
+  {
+    Slot *victim=NULL;
+    unsigned victimSeq=0;
+    bool found=false, busy=false;
+
+    for (unsigned i=0; i<PEER_IP_HISTORY_PROBES && !found; i++)
+    {
+      Slot *slot=&slots[(h+i) & (PEER_IP_HISTORY_SIZE-1)];
+      unsigned seq=slot->seq;
+      __sync_synchronize();
+
+      // being written: it may be this address
+      if (seq & 1)
+      {
+        busy=true;
+        break;
+      }
+
+      if (isEqual(*slot, ip))
+      {
+        victim=slot;
+        victimSeq=seq;
+        found=true;
+      }
+      else
+        // an empty slot, or the least recently seen address
+        if (victim == NULL || (victim->ipversion && (!slot->ipversion || slot->lastSeen < victim->lastSeen)))
+        {
+          victim=slot;
+          victimSeq=seq;
+        }
+
+      // the slots are never emptied: the address can't be further
+      if (!slot->ipversion) break;
+    }
+
+    if (busy || victim == NULL || !__sync_bool_compare_and_swap(&victim->seq, victimSeq, victimSeq+1))
+      continue;
+
+    bool isNew;
+    if (found && isEqual(*victim, ip))
+    {
+      isNew = now - victim->lastSeen > expiration;
+      victim->connections++;
+    }
+    else
+    {
+      isNew=true;
+      victim->ipversion=ip.ipversion;
+      victim->ip=ip.ip;
+      victim->connections=1;
+    }
+    victim->lastSeen=now;
+
+    __sync_synchronize();
+    victim->seq=victimSeq+2;
+    return isNew;
+  }
+
+  return false;
+}
+
+/***********************************************************************
+* read: copy a slot
+* \return false if it is empty
+***********************************************************************/
+
+bool PeerIpHistory::read(const Slot& slot, IpAddress& ip, PeerIpStats& stats)
+{
+  unsigned seq;
+  do
+  {
+    while ((seq=slot.seq) & 1)
+      sched_yield();
+    __sync_synchronize();
+    ip.ipversion=slot.ipversion;
+    ip.ip=slot.ip;
+    stats.lastSeen=slot.lastSeen;
+    stats.connections=slot.connections;
+    __sync_synchronize();
+  }
+  while (seq != slot.seq);
+
+  return ip.ipversion != 0;
+}
+
+/**********************************************************************/
+
+void PeerIpHistory::getSnapshot(nw::map<IpAddress,time_t>& history) const
+{
+  IpAddress ip;
+  PeerIpStats stats;
+  for (size_t i=0; i<PEER_IP_HISTORY_SIZE; i++)
+    if (read(slots[i], ip, stats))
+      history[ip]=stats.lastSeen;
+}
+
+/**********************************************************************/
+
+void PeerIpHistory::getSnapshot(nw::map<IpAddress,PeerIpStats>& history) const
+{
+  IpAddress ip;
+  PeerIpStats stats;
+  for (size_t i=0; i<PEER_IP_HISTORY_SIZE; i++)
+    if (read(slots[i], ip, stats))
+      history[ip]=stats;
+}
+
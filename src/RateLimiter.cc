@@ -0,0 +1,237 @@
+//********************************************************
+/**
+ * @file  RateLimiter.cc
+ *
+ * @brief Requests rate limiting (token buckets per client)
+ *
+ * @author agent (agent@local)
+ *
+ * @version 1
+ * @date 19/10/26
+ */
+//********************************************************
+
+#include <string.h>
+#include <time.h>
+
+#include "libnavajo/RateLimiter.hh"
+
+/**********************************************************************/
+
+RateLimiter::RateLimiter()
+{
+  for (unsigned i=0; i<RATE_LIMITER_SHARDS; i++)
+    pthread_mutex_init(&shards[i].mutex, NULL);
+  requests=0;
+  rejected=0;
+}
+
+/**********************************************************************/
+
+RateLimiter::~RateLimiter()
+{
+  for (unsigned i=0; i<RATE_LIMITER_SHARDS; i++)
+    pthread_mutex_destroy(&shards[i].mutex);
+}
+
+/**********************************************************************/
+
+void RateLimiter::setLimit(const nw::string& urlPrefix, const double rate, const size_t burst, const int keys)
+{
+  Policy policy;
+  policy.urlPrefix=urlPrefix;
+  while (policy.urlPrefix.size() && policy.urlPrefix[0] == '/')
+    policy.urlPrefix.erase(0, 1);
+  policy.rate=rate;
+  policy.burst=burst ? burst : 1;
+  policy.keys=keys;
+
+  nw::vector<Policy>::iterator it=policies.begin();
+  while (it != policies.end() && it->urlPrefix.size() > policy.urlPrefix.size())
+    it++;
+  while (it != policies.end() && it->urlPrefix.size() == policy.urlPrefix.size() && it->urlPrefix != policy.urlPrefix)
+    it++;
+
+  if (it != policies.end() && it->urlPrefix == policy.urlPrefix)
+    *it=policy;
+  else
+    policies.insert(it, policy);
+}
+
+/***********************************************************************
+* getPolicy: \return the policy of the longest prefix of the url, or NULL
+***********************************************************************/
+
+const RateLimiter::Policy* RateLimiter::getPolicy(const char *url) const
+{
+  while (*url == '/') url++;
+  for (size_t i=0; i<policies.size(); i++)
+    if (!strncmp(url, policies[i].urlPrefix.c_str(), policies[i].urlPrefix.size()))
+      return &policies[i];
+  return NULL;
+}
+
+/***********************************************************************
+* purge: remove the buckets which are full again (a new bucket would be
+*  the same), or else the least recently refilled one: the clients are
+*  still limited when there are too many of them
+***********************************************************************/
+
+void RateLimiter::purge(Shard& shard, const unsigned long long now)
+{
+  for (BucketsMap::iterator it=shard.buckets.begin(); it != shard.buckets.end(); )
+    if (it->second.fullTime <= now)
+    {
+      shard.lru.erase(it->second.lruIt);
+      shard.buckets.erase(it++);
+    }
+    else
+      it++;
+
+  if (shard.buckets.size() >= RATE_LIMITER_MAX_BUCKETS_PER_SHARD)
+  {
+    shard.buckets.erase(shard.lru.front());
+    shard.lru.pop_front();
+  }
+}
+
+/***********************************************************************
+* getKey: \return the bucket key: the policy, the client (user or ip
+*   address), and the url
+***********************************************************************/
+
+nw::string RateLimiter::getKey(const Policy *policy, const IpAddress& ip, const nw::string& username, const char *url) const
+{
+  nw::string key(1, (char)(policy - &policies[0]));
+  if ((policy->keys & RATE_LIMIT_BY_USER) && username.size())
+  {
+    key+='u';
+    key+=username;
+  }
+  else
+    if (ip.ipversion == 4)
+    {
+      key+='4';
+      key.append((const char*)&ip.ip.v4, sizeof ip.ip.v4);
+    }
+    else
+    {
+      key+='6';
+      key.append((const char*)ip.ip.v6.s6_addr, sizeof ip.ip.v6.s6_addr);
+    }
+
+  if (policy->keys & RATE_LIMIT_BY_ROUTE)
+  {
+    while (*url == '/') url++;
+    key+='\0';
+    key+=url;
+  }
+  return key;
+}
+
+/***********************************************************************
+* takeToken: refill a bucket, and take a token from it
+* @param take - false to only test that a token is available
+* \return 0 if a token is available, else the delay (in seconds) before
+*   a token is available
+***********************************************************************/
+
+unsigned RateLimiter::takeToken(const Policy *policy, const nw::string& key, const bool take)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  unsigned long long now=(unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+  Shard& shard=getShard(key);
+  unsigned retryAfter=0;
+
+  pthread_mutex_lock(&shard.mutex);
+
+  BucketsMap::iterator it=shard.buckets.find(key);
+  if (it == shard.buckets.end())
+  {
+    // a new bucket is full
+    if (!take)
+    {
+      pthread_mutex_unlock(&shard.mutex);
+      return 0;
+    }
+
+    if (shard.buckets.size() >= RATE_LIMITER_MAX_BUCKETS_PER_SHARD)
+      purge(shard, now);
+
+    Bucket bucket;
+    bucket.tokens=policy->burst;
+    bucket.time=now;
+    bucket.lruIt=shard.lru.insert(shard.lru.end(), key);
+    it=shard.buckets.insert(BucketsMap::value_type(key, bucket)).first;
+  }
+  else
+    shard.lru.splice(shard.lru.end(), shard.lru, it->second.lruIt);
+
+  Bucket& bucket=it->second;
+  bucket.tokens+=(now - bucket.time) * policy->rate / 1000000;
+  if (bucket.tokens > policy->burst)
+    bucket.tokens=policy->burst;
+  bucket.time=now;
+
+  if (bucket.tokens >= 1)
+  {
+    if (take)
+      bucket.tokens-=1;
+  }
+  else
+  {
+    unsigned long long wait=(unsigned long long)((1 - bucket.tokens) * 1000000 / policy->rate);
+    retryAfter=(unsigned)((wait + 999999) / 1000000);
+    if (!retryAfter) retryAfter=1;
+  }
+
+  bucket.fullTime=now + (unsigned long long)((policy->burst - bucket.tokens) * 1000000 / policy->rate);
+
+  pthread_mutex_unlock(&shard.mutex);
+
+  if (retryAfter)
+    __sync_fetch_and_add(&rejected, 1);
+  return retryAfter;
+}
+
+/**********************************************************************/
+
+unsigned RateLimiter::checkClient(const IpAddress& ip, const char *url)
+{
+  const Policy *policy=getPolicy(url);
+  if (policy == NULL || policy->rate <= 0)
+    return 0;
+
+  __sync_fetch_and_add(&requests, 1);
+
+  return takeToken(policy, getKey(policy, ip, "", url), !(policy->keys & RATE_LIMIT_BY_USER));
+}
+
+/**********************************************************************/
+
+unsigned RateLimiter::checkUser(const IpAddress& ip, const nw::string& username, const char *url)
+{
+  const Policy *policy=getPolicy(url);
+  if (policy == NULL || policy->rate <= 0 || !(policy->keys & RATE_LIMIT_BY_USER))
+    return 0;
+
+  return takeToken(policy, getKey(policy, ip, username, url), true);
+}
+
+/**********************************************************************/
+
+void RateLimiter::getStats(RateLimiterStats& stats)
+{
+  stats.requests=requests;
+  stats.rejected=rejected;
+  stats.buckets=0;
+  for (unsigned i=0; i<RATE_LIMITER_SHARDS; i++)
+  {
+    pthread_mutex_lock(&shards[i].mutex);
+    stats.buckets+=shards[i].buckets.size();
+    pthread_mutex_unlock(&shards[i].mutex);
+  }
+}
+
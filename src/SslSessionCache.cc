@@ -0,0 +1,344 @@
+//********************************************************
+/**
+ * @file  SslSessionCache.cc
+ *
+ * @brief TLS session resumption: server side sessions cache
+ *        and session tickets keys management
+ *
+ * @author agent (agent@local)
+ *
+ * @version 1
+ * @date 19/10/26
+ */
+//********************************************************
+
+#include <string.h>
+
+#include <openssl/rand.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#endif
+
+#include "libnavajo/LogRecorder.hh"
+#include "libnavajo/SslSessionCache.hh"
+
+int SslSessionCache::exDataIndex=-1;
+
+/**********************************************************************/
+
+SslSessionCache::SslSessionCache()
+{
+  for (unsigned i=0; i<SSL_SESSION_CACHE_SHARDS; i++)
+    pthread_mutex_init(&shards[i].mutex, NULL);
+  pthread_mutex_init(&ticketKeys_mutex, NULL);
+
+  maxSessionsPerShard=0;
+  sessionTimeout=300;
+  nbTicketKeys=0;
+  ticketKeyLifetime=0;
+  handshakes=resumedHandshakes=cacheHits=cacheMisses=ticketKeysRotations=0;
+}
+
+/**********************************************************************/
+
+SslSessionCache::~SslSessionCache()
+{
+  for (unsigned i=0; i<SSL_SESSION_CACHE_SHARDS; i++)
+  {
+    for (SessionsMap::iterator it=shards[i].sessions.begin(); it!=shards[i].sessions.end(); it++)
+      SSL_SESSION_free(it->second.session);
+    shards[i].sessions.clear();
+    shards[i].lru.clear();
+    pthread_mutex_destroy(&shards[i].mutex);
+  }
+
+  OPENSSL_cleanse(ticketKeys, sizeof ticketKeys);
+  pthread_mutex_destroy(&ticketKeys_mutex);
+}
+
+/**********************************************************************/
+
+void SslSessionCache::attach(SSL_CTX *ctx, const size_t maxSessions, const time_t timeout, const time_t ticketKeyLifetime)
+{
+  if (exDataIndex == -1)
+    exDataIndex=SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+  SSL_CTX_set_ex_data(ctx, exDataIndex, this);
+
+  sessionTimeout=timeout;
+  SSL_CTX_set_timeout(ctx, timeout);
+
+  if (maxSessions)
+  {
+    maxSessionsPerShard=(maxSessions + SSL_SESSION_CACHE_SHARDS - 1) / SSL_SESSION_CACHE_SHARDS;
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+    SSL_CTX_sess_set_new_cb(ctx, newSessionCallback);
+    SSL_CTX_sess_set_get_cb(ctx, getSessionCallback);
+    SSL_CTX_sess_set_remove_cb(ctx, removeSessionCallback);
+  }
+  else
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+
+  this->ticketKeyLifetime=ticketKeyLifetime;
+  if (ticketKeyLifetime)
+  {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticketKeyCallback);
+#else
+    SSL_CTX_set_tlsext_ticket_key_cb(ctx, ticketKeyCallback);
+#endif
+  }
+  else
+    SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+}
+
+/**********************************************************************/
+
+SslSessionCache* SslSessionCache::fromSSL(SSL *ssl)
+{
+  return static_cast<SslSessionCache*>(SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), exDataIndex));
+}
+
+/**********************************************************************/
+
+void SslSessionCache::removeSession(const unsigned char *id, unsigned int len)
+{
+  Shard& shard=getShard(id, len);
+  nw::string key((const char*)id, len);
+
+  pthread_mutex_lock(&shard.mutex);
+  SessionsMap::iterator it=shard.sessions.find(key);
+  if (it != shard.sessions.end())
+  {
+    SSL_SESSION_free(it->second.session);
+    shard.lru.erase(it->second.lruIt);
+    shard.sessions.erase(it);
+  }
+  pthread_mutex_unlock(&shard.mutex);
+}
+
+/***********************************************************************
+* newSessionCallback: a new session has been negotiated
+* \return 1: the cache keeps the reference on the session
+***********************************************************************/
+
+int SslSessionCache::newSessionCallback(SSL *ssl, SSL_SESSION *session)
+{
+  SslSessionCache *cache=fromSSL(ssl);
+  if (cache == NULL) return 0;
+
+  unsigned int len=0;
+  const unsigned char *id=SSL_SESSION_get_id(session, &len);
+  Shard& shard=cache->getShard(id, len);
+  nw::string key((const char*)id, len);
+
+  pthread_mutex_lock(&shard.mutex);
+
+  SessionsMap::iterator it=shard.sessions.find(key);
+  if (it != shard.sessions.end())
+  {
+    SSL_SESSION_free(it->second.session);
+    shard.lru.erase(it->second.lruIt);
+    shard.sessions.erase(it);
+  }
+
+  // evict the least recently used sessions
+  while (shard.sessions.size() >= cache->maxSessionsPerShard && !shard.lru.empty())
+  {
+    SessionsMap::iterator oldest=shard.sessions.find(shard.lru.front());
+    if (oldest != shard.sessions.end())
+    {
+      SSL_SESSION_free(oldest->second.session);
+      shard.sessions.erase(oldest);
+    }
+    shard.lru.pop_front();
+  }
+
+  CachedSession& cached=shard.sessions[key];
+  cached.session=session;
+  cached.expiration=time(NULL)+cache->sessionTimeout;
+  cached.lruIt=shard.lru.insert(shard.lru.end(), key);
+
+  pthread_mutex_unlock(&shard.mutex);
+  return 1;
+}
+
+/***********************************************************************
+* getSessionCallback: the client wants to resume a session
+* \return the cached session (with a new reference, for the caller) or NULL
+***********************************************************************/
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+SSL_SESSION* SslSessionCache::getSessionCallback(SSL *ssl, const unsigned char *id, int len, int *copy)
+#else
+SSL_SESSION* SslSessionCache::getSessionCallback(SSL *ssl, unsigned char *id, int len, int *copy)
+#endif
+{
+  SslSessionCache *cache=fromSSL(ssl);
+  SSL_SESSION *session=NULL;
+  *copy=0; // the reference is taken here, before the cache can free it
+
+  if (cache == NULL) return NULL;
+
+  Shard& shard=cache->getShard(id, len);
+  nw::string key((const char*)id, len);
+
+  pthread_mutex_lock(&shard.mutex);
+  SessionsMap::iterator it=shard.sessions.find(key);
+  if (it != shard.sessions.end())
+  {
+    if (it->second.expiration > time(NULL))
+    {
+      session=it->second.session;
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+      SSL_SESSION_up_ref(session);
+#else
+      CRYPTO_add(&session->references, 1, CRYPTO_LOCK_SSL_SESSION);
+#endif
+      shard.lru.splice(shard.lru.end(), shard.lru, it->second.lruIt);
+    }
+    else
+    {
+      SSL_SESSION_free(it->second.session);
+      shard.lru.erase(it->second.lruIt);
+      shard.sessions.erase(it);
+    }
+  }
+  pthread_mutex_unlock(&shard.mutex);
+
+  __sync_fetch_and_add(session != NULL ? &cache->cacheHits : &cache->cacheMisses, 1);
+
+  return session;
+}
+
+/**********************************************************************/
+
+void SslSessionCache::removeSessionCallback(SSL_CTX *ctx, SSL_SESSION *session)
+{
+  SslSessionCache *cache=static_cast<SslSessionCache*>(SSL_CTX_get_ex_data(ctx, exDataIndex));
+  if (cache == NULL) return;
+
+  unsigned int len=0;
+  const unsigned char *id=SSL_SESSION_get_id(session, &len);
+  cache->removeSession(id, len);
+}
+
+/**********************************************************************/
+
+bool SslSessionCache::generateTicketKey(TicketKey& key)
+{
+  if (RAND_bytes(key.name, sizeof key.name) != 1
+    || RAND_bytes(key.aesKey, sizeof key.aesKey) != 1
+    || RAND_bytes(key.hmacKey, sizeof key.hmacKey) != 1)
+  {
+    NVJ_LOG->append(NVJ_ERROR, "OpenSSL error: Can't generate a session ticket key");
+    return false;
+  }
+  key.creation=time(NULL);
+  return true;
+}
+
+/***********************************************************************
+* getTicketKey: get the key to encrypt a new ticket (rotate it if it is
+*  too old) or the key matching the name of a received ticket
+* \return false if no key is available
+***********************************************************************/
+
+bool SslSessionCache::getTicketKey(const unsigned char *name, bool encrypt, TicketKey& key, bool& isCurrent)
+{
+  bool found=false;
+  pthread_mutex_lock(&ticketKeys_mutex);
+
+  if (!nbTicketKeys || time(NULL) - ticketKeys[0].creation >= ticketKeyLifetime)
+  {
+    TicketKey newKey;
+    if (generateTicketKey(newKey))
+    {
+      ticketKeys[1]=ticketKeys[0];
+      ticketKeys[0]=newKey;
+      if (nbTicketKeys < 2) nbTicketKeys++;
+      ticketKeysRotations++;
+    }
+  }
+
+  for (size_t i=0; i<nbTicketKeys && !found; i++)
+    if (encrypt || !memcmp(name, ticketKeys[i].name, sizeof ticketKeys[i].name))
+    {
+      key=ticketKeys[i];
+      isCurrent= i==0;
+      found=true;
+    }
+
+  pthread_mutex_unlock(&ticketKeys_mutex);
+  return found;
+}
+
+/***********************************************************************
+* ticketKeyCallback: encrypt a new session ticket or decrypt a ticket
+* \return 1: ok, 2: ok but the ticket must be renewed,
+*         0: unknown key (full handshake), -1: error
+***********************************************************************/
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+int SslSessionCache::ticketKeyCallback(SSL *ssl, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *ectx, EVP_MAC_CTX *hctx, int enc)
+#else
+int SslSessionCache::ticketKeyCallback(SSL *ssl, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *ectx, HMAC_CTX *hctx, int enc)
+#endif
+{
+  SslSessionCache *cache=fromSSL(ssl);
+  TicketKey key;
+  bool isCurrent=false;
+
+  if (cache == NULL) return -1;
+
+  if (!cache->getTicketKey(name, enc != 0, key, isCurrent))
+    return enc ? -1 : 0;
+
+  if (enc)
+  {
+    memcpy(name, key.name, sizeof key.name);
+    if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1)
+      return -1;
+    if (EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, key.aesKey, iv) != 1)
+      return -1;
+  }
+  else
+    if (EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, key.aesKey, iv) != 1)
+      return -1;
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  OSSL_PARAM params[3];
+  params[0]=OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmacKey, sizeof key.hmacKey);
+  params[1]=OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char*)"SHA256", 0);
+  params[2]=OSSL_PARAM_construct_end();
+  if (EVP_MAC_CTX_set_params(hctx, params) != 1)
+    return -1;
+#else
+  if (HMAC_Init_ex(hctx, key.hmacKey, sizeof key.hmacKey, EVP_sha256(), NULL) != 1)
+    return -1;
+#endif
+
+  OPENSSL_cleanse(&key, sizeof key);
+  return (enc || isCurrent) ? 1 : 2;
+}
+
+/**********************************************************************/
+
+void SslSessionCache::getStats(SslSessionStats& stats)
+{
+  stats.handshakes=handshakes;
+  stats.resumedHandshakes=resumedHandshakes;
+  stats.cacheHits=cacheHits;
+  stats.cacheMisses=cacheMisses;
+  stats.ticketKeysRotations=ticketKeysRotations;
+  stats.cacheSize=0;
+  for (unsigned i=0; i<SSL_SESSION_CACHE_SHARDS; i++)
+  {
+    pthread_mutex_lock(&shards[i].mutex);
+    stats.cacheSize+=shards[i].sessions.size();
+    pthread_mutex_unlock(&shards[i].mutex);
+  }
+}
+
@@ -72,29 +72,62 @@
 #include <fcntl.h>
 
 #include "libnavajo/WebServer.hh"
+#include "libnavajo/HttpRequestBuffer.hh"
+#ifdef LINUX
+#include <sched.h>
+#include <sys/sendfile.h>
+#define HAVE_SENDFILE
+#define HAVE_ACCEPT4
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+#define HAVE_KTLS
+#endif
+#endif
 #if defined(LINUX) || defined(__darwin__)
 #include "libnavajo/AuthPAM.hh"
 #endif
+#include <openssl/sha.h>
 #include "libnavajo/thread.h"
 #include "libnavajo/htonll.h"
 #include "libnavajo/WebSocket.hh"
+#include "libnavajo/WebSocketClient.hh"
 
 #define DEFAULT_HTTP_PORT 8080
 #define LOGHIST_EXPIRATION_DELAY 600
 #define BUFSIZE 32768
+#define TLS_HANDSHAKE_TIMEOUT 10
+#define TLS_HANDSHAKES_MAX 4096
+#define ACCEPT_BATCH_MAX 64 // connections accepted per socket and per poll
 
-const char WebServer::authStr[]="Authorization: Basic ";
 const int WebServer::verify_depth=512;
 char *WebServer::certpass=NULL;
 nw::string WebServer::webServerName;
 pthread_mutex_t IpAddress::resolvIP_mutex = PTHREAD_MUTEX_INITIALIZER;
 HttpSession::HttpSessionsContainerMap HttpSession::sessions;
 pthread_mutex_t HttpSession::sessions_mutex=PTHREAD_MUTEX_INITIALIZER;
-const nw::string WebServer::base64_chars =
+const char WebServer::base64_chars[] =
              "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
              "abcdefghijklmnopqrstuvwxyz"
              "0123456789+/";
-const nw::string WebServer::webSocketMagicString="258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+const signed char WebServer::base64_values[256] =
+{
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1, -1, 63,
+  52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1,
+  -1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+  15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+  -1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+  41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+const char WebServer::webSocketMagicString[]="258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
 
 
 time_t HttpSession::lastExpirationSearchTime=0;
@@ -106,49 +139,58 @@ WebServer::WebServer()
 {
   sslCtx=NULL;
   s_server_session_id_context = 1;
+  sslSessionCache=NULL;
+  sslSessionCacheSize=20480;
+  sslSessionTimeout=300;
+  sslTicketKeyLifetime=3600;
+  useKtls=false;
 
   webServerName=nw::string("Server: libNavajo/")+nw::string(LIBNAVAJO_SOFTWARE_VERSION);
   exiting=false;
-  exitedThread=0;
   httpdAuth=false;
-  nbServerSock=0;
+  requestHeaderTimeout=DEFAULT_REQUEST_HEADER_TIMEOUT;
+  requestBodyTimeout=DEFAULT_REQUEST_BODY_TIMEOUT;
+  keepAliveTimeout=DEFAULT_KEEPALIVE_TIMEOUT;
+  keepAliveMaxRequests=DEFAULT_KEEPALIVE_MAX_REQUESTS;
+  nbAcceptors=0;
+  listenBacklog=DEFAULT_LISTEN_BACKLOG;
 
   disableIpV4=false;
   disableIpV6=false;
   tcpPort=DEFAULT_HTTP_PORT;
-  threadsPoolSize=128;
+  threadsPoolSize=0;
+  threadsPoolMinSize=0;
+  threadsPoolIdleTimeout=POOL_THREAD_IDLE_TIMEOUT;
+  threadsAffinity=false;
+  nextPoolThread=0;
+  nbPoolThreads=0;
+  queuedClients=0;
+  queueWaitTime=0;
+  clientsQueueSize=0;
 
   sslEnabled=false;
   authPeerSsl=false;
   authPam=false;
 
   pthread_mutex_init(&clientsQueue_mutex, NULL);
-  pthread_cond_init(&clientsQueue_cond, NULL);
+  pthread_mutex_init(&poolThreads_mutex, NULL);
 
   pthread_mutex_init(&webSocketClientList_mutex, NULL);
 
   pthread_mutex_init(&peerDnHistory_mutex, NULL);
-  pthread_mutex_init(&usersAuthHistory_mutex, NULL);
+
+  authCacheSize=DEFAULT_AUTH_CACHE_SIZE;
+  authAllowedTimeout=DEFAULT_AUTH_ALLOWED_TIMEOUT;
+  authDeniedTimeout=DEFAULT_AUTH_DENIED_TIMEOUT;
+  pamVerifications=NULL;
+  pamTimeout=DEFAULT_PAM_AUTH_TIMEOUT;
 }
 
 /*********************************************************************/
 
-void WebServer::updatePeerIpHistory(IpAddress& ip)
+void WebServer::updatePeerIpHistory(const IpAddress& ip)
 {
-  time_t t = time ( NULL );
-  nw::map<IpAddress, time_t>::iterator i = peerIpHistory.find (ip);
-
-  bool dispPeer = false;
-  if (i != peerIpHistory.end())
-  {
-        dispPeer = t - i->second > LOGHIST_EXPIRATION_DELAY;
-        i->second = t;
-  }
-  else
-  {
-        peerIpHistory[ip]=t;
-         dispPeer = true;
-  }
+  bool dispPeer = peerIpHistory.update(ip, time ( NULL ), LOGHIST_EXPIRATION_DELAY);
 
   if (dispPeer)
      NVJ_LOG->append(NVJ_INFO,nw::string ("WebServer: Connection from IP: ") + ip.str());
@@ -190,118 +232,113 @@ void WebServer::updatePeerDnHistory(nw::string dn)
 */
 bool WebServer::isUserAllowed(const nw::string &pwdb64, nw::string& login)
 {
-
-  pthread_mutex_lock( &usersAuthHistory_mutex );
-  time_t t = time ( NULL );
-
-  bool isNewUser = true;
-  nw::map<nw::string,time_t>::iterator i = usersAuthHistory.find (pwdb64);
-
-  if (i != usersAuthHistory.end())
+  nw::string key=authCache.getKey(pwdb64);
+  switch (authCache.lookup(key, login))
   {
-    isNewUser = t - i->second > LOGHIST_EXPIRATION_DELAY;
-    i->second = t;
-  }
-
-  if (!isNewUser)
-  {
-    pthread_mutex_unlock( &usersAuthHistory_mutex );
-    return true;
+    case AUTH_CACHE_ALLOWED: return true;
+    case AUTH_CACHE_DENIED: return false;
+    default: break;
   }
 
   // It's a new user !
   bool authOK=false;
   nw::string loginPwd=base64_decode(pwdb64.c_str());
-  printf ("%s => %s", loginPwd.c_str(), pwdb64.c_str());
   size_t loginPwdSep=loginPwd.find(':');
   if (loginPwdSep==nw::string::npos)
   {
-    pthread_mutex_unlock( &usersAuthHistory_mutex );
+    authCache.store(key, "", false);
     return false;
   }
 
   login=loginPwd.substr(0,loginPwdSep);
   nw::string pwd=loginPwd.substr(loginPwdSep+1);
 
-  nw::vector<nw::string> httpAuthLoginPwd=authLoginPwdList;
-  if (httpAuthLoginPwd.size())
-  {
-    nw::string logPass=login+':'+pwd;
-    for ( nw::vector<nw::string>::iterator it=httpAuthLoginPwd.begin(); it != httpAuthLoginPwd.end(); it++ )
-      if ( logPass == *it )
-        authOK=true;
-  }
+  for ( nw::vector<nw::string>::const_iterator it=authLoginPwdList.begin(); it != authLoginPwdList.end() && !authOK; it++ )
+    if ( loginPwd == *it )
+      authOK=true;
+  OPENSSL_cleanse(&loginPwd[0], loginPwd.size());
+
 #if defined(LINUX) || defined(__darwin__)
   if (!authOK && isAuthPam())
   {
-    if (authPamUsersList.size())
+    bool pamUser=!authPamUsersList.size();
+    for ( nw::vector<nw::string>::const_iterator it=authPamUsersList.begin(); it != authPamUsersList.end() && !pamUser; it++ )
+      pamUser = login == *it;
+
+    if (pamUser)
     {
-      for ( nw::vector<nw::string>::iterator it=authPamUsersList.begin(); it != authPamUsersList.end(); it++ )
-        if (login == *it)
-          authOK=AuthPAM::authentificate(login.c_str(), pwd.c_str(), pamService.c_str());
+      int res=pamVerifications != NULL ? pamVerifications->authentificate(key, login.c_str(), pwd.c_str(), pamService.c_str(), pamTimeout)
+                                       : AuthPAM::authentificate(login.c_str(), pwd.c_str(), pamService.c_str());
+      if (res < 0)
+      {
+        // not known yet: refused, but not cached
+        OPENSSL_cleanse(&pwd[0], pwd.size());
+        NVJ_LOG->append(NVJ_WARNING,"WebServer: Authentification timed out for user '"+login+"'");
+        return false;
+      }
+      authOK = res == 1;
     }
-    else
-      authOK=AuthPAM::authentificate(login.c_str(), pwd.c_str(), pamService.c_str() );
   }
 #endif
+  if (pwd.size())
+    OPENSSL_cleanse(&pwd[0], pwd.size());
+
   if (authOK)
-  {
     NVJ_LOG->append(NVJ_INFO,"WebServer: Authentification passed for user '"+login+"'");
-    if (i == usersAuthHistory.end())
-      usersAuthHistory[pwdb64]=t;
-  }
   else
     NVJ_LOG->append(NVJ_INFO,"WebServer: Authentification failed for user '"+login+"'");
 
-  pthread_mutex_unlock( &usersAuthHistory_mutex );
+  authCache.store(key, login, authOK);
   return authOK;
 }
 
 /***********************************************************************
-* recvLine:  Receive an ascii line from a socket
-* @param c - the socket connected to the client
-* \return always NULL
+* recvRequestData:  Receive data from the client in the request buffer
+* @param client - the client
+* @param buffer - the connection's request buffer
+* \return false if the connection is closed (or timeout)
 ***********************************************************************/
 
-size_t WebServer::recvLine(int client, char *bufLine, size_t nsize)
+bool WebServer::recvRequestData(ClientSockData *client, HttpRequestBuffer *buffer)
 {
-  size_t bufLineLen=0;
-  char c;
   int n;
-  do
-  {
-    n = recv(client, &c, 1, 0);
 
-    if (n > 0)
-      bufLine[bufLineLen++] = c;
-  }
-  while ((bufLineLen + 1 < nsize ) && (c != '\n') && ( n > 0 ));
-  bufLine[bufLineLen] = '\0';
+  if (exiting)
+    return false;
+
+  if (sslEnabled)
+    n=SSL_read(client->ssl, buffer->getFreeSpace(), buffer->getFreeSpaceLength());
+  else
+    do
+      n=recv(client->socketId, buffer->getFreeSpace(), buffer->getFreeSpaceLength(), 0);
+    while (n < 0 && errno == EINTR && !exiting);
+
+  if (n <= 0)
+    return false;
 
-  return bufLineLen;
+  buffer->received(n);
+  return true;
 }
 
 
 /***********************************************************************
 * accept_request:  Process a request
 * @param c - the socket connected to the client
+* @param arena - the thread's request scoped memory, released at each request
 * \return true if the socket must to close
 ***********************************************************************/
 
-bool WebServer::accept_request(ClientSockData* client)
+bool WebServer::accept_request(ClientSockData* client, RequestArena *arena)
 {
-  char bufLine[BUFSIZE];
   HttpRequestMethod requestMethod;
   size_t postContentLength=0;
   bool urlencodedForm=false;
-  char urlBuffer[BUFSIZE];
-  size_t nbFileKeepAlive=5;
+  size_t nbRequests=0;
 
-  char requestParams[BUFSIZE], requestCookies[BUFSIZE], requestOrigin[BUFSIZE], webSocketClientKey[BUFSIZE];
+  const char *requestParams, *requestCookies, *requestOrigin, *webSocketClientKey;
   bool websocket=false;
   int webSocketVersion=-1;
   nw::string username;
-  size_t bufLineLen=0;
   BIO *ssl_bio = NULL;
 
   if (sslEnabled)
@@ -312,142 +349,162 @@ bool WebServer::accept_request(ClientSockData* client)
     BIO_push(client->bio,ssl_bio);
   }
 
-  bool crlfEmptyLineFound=false;
-  unsigned i=0, j=0;
+  if (client->requestBuffer == NULL)
+  {
+    if ((client->requestBuffer=(HttpRequestBuffer*)malloc(sizeof(HttpRequestBuffer))) == NULL)
+      return true;
+    client->requestBuffer->init();
+  }
+  HttpRequestBuffer *buffer=client->requestBuffer;
 
   bool authOK = !isAuthPam() && authLoginPwdList.size() == 0;
-  char httpVers[4]="";
+  const char *httpVers;
   int keepAlive=-1;
-  bool isQueryStr=false;
+  bool unframedBody=false;
+  const char *authorization=NULL;
 
   do
   {
-    requestMethod=UNKNOWN_METHOD;
+    buffer->next();
+    // the previous request's memory, whatever its response (429...)
+    arena->reset();
+
+    // a persistent connection waits for the next request, then for its header
+    bool idle=nbRequests != 0;
+    connections.setDeadline(client->timer, idle ? keepAliveTimeout : requestHeaderTimeout);
+
+    // the end of the previous request's body is discarded
+    while (buffer->hasBodyToSkip())
+      if (!recvRequestData(client, buffer))
+        return true;
+
     postContentLength=0;
     urlencodedForm=false;
-    *urlBuffer='\0';
-    char *url=urlBuffer;
-    *requestParams='\0';
-    *requestCookies='\0';
-    *requestOrigin='\0';
+    requestCookies="";
+    requestOrigin="";
     websocket=false;
-    *webSocketClientKey='\0';
+    webSocketClientKey="";
     webSocketVersion=-1;
     username="";
-    crlfEmptyLineFound=false;
     keepAlive=-1;
-    isQueryStr=false;
+    unframedBody=false;
+    authorization=NULL;
+    client->compression=NONE;
 
-    while (!crlfEmptyLineFound)
+    size_t headersLength;
+    while ((headersLength=buffer->findHeadersEnd()) == 0)
     {
-      bufLineLen=0;
-      *bufLine='\0';
-
-      if (sslEnabled)
+      if (!buffer->getFreeSpaceLength())
       {
-        int r=BIO_gets(client->bio, bufLine, BUFSIZE-1);
-
-        switch(SSL_get_error(client->ssl,r))
-        {
-          case SSL_ERROR_NONE:
-            bufLineLen=r;
-            break;
-          case SSL_ERROR_ZERO_RETURN:
-            return true;
-        }
+        nw::string msg = getHttpHeader(HTTP_STATUS_HEADER_FIELDS_TOO_LARGE, 0, false);
+        httpSend(client, (const void*) msg.c_str(), msg.length());
+        return true;
       }
-      else
-        bufLineLen=recvLine(client->socketId, bufLine, BUFSIZE-1);
-
-      if (bufLineLen == 0 || exiting)
+      if (!recvRequestData(client, buffer))
         return true;
+      if (idle)
+      {
+        idle=false;
+        connections.setDeadline(client->timer, requestHeaderTimeout);
+      }
+    }
+    nbRequests++;
 
-      if ( bufLineLen <= 2)
-        crlfEmptyLineFound = (*bufLine=='\n') || (*bufLine=='\r' && *(bufLine+1)=='\n');
-      else
+    int parseError=buffer->parse(headersLength);
+    if (parseError)
+    {
+      nw::string msg = parseError == 431 ? getHttpHeader(HTTP_STATUS_HEADER_FIELDS_TOO_LARGE, 0, false) : getBadRequestErrorMsg();
+      httpSend(client, (const void*) msg.c_str(), msg.length());
+      return true;
+    }
+
+    requestMethod=buffer->getMethod();
+    requestParams=buffer->getQuery();
+    httpVers=buffer->getVersion();
+
+    const HttpHeader *headers=buffer->getHeaders();
+    for (size_t h=0; h < buffer->getHeadersCount(); h++)
+    {
+      const char *name=headers[h].name, *value=headers[h].value;
+
+      if (!strcasecmp(name, "Authorization"))
       {
-        if (bufLineLen == BUFSIZE-1) *(bufLine+bufLineLen)='\0';
-        else *(bufLine+bufLineLen-2)='\0';
-        j = 0; while (isspace((int)(bufLine[j])) && j < (unsigned)bufLineLen) j++;
+        // the credentials are verified after the rate limiting
+        if (!strncmp(value, "Basic ", 6))
+          authorization=value+6;
+        continue;
+      }
 
-        if ( strncmp(bufLine+j, authStr, sizeof authStr - 1 ) == 0)
-        {
-          j+=sizeof authStr - 1;
-
-          // decode login/passwd
-          nw::string pwdb64="";
-          while ( j < (unsigned)bufLineLen && *(bufLine + j) != 0x0d && *(bufLine + j) != 0x0a)
-            pwdb64+=*(bufLine + j++);;
-          if (!authOK)
-            authOK=isUserAllowed(pwdb64, username);
-          continue;
-        }
+      if (!strcasecmp(name, "Connection"))
+      {
+        if (strstr(value,"pgrade") != NULL) websocket=true;
+        if (strstr(value,"lose") != NULL) keepAlive=false;
+        else if ((strstr(value,"eep-") != NULL) && (strstr(value,"live") != NULL)) keepAlive=true;
+        continue;
+      }
 
-        if (strncasecmp(bufLine+j, "Connection: ", 12) == 0)
-        {
-          j+=12;
-          if (strstr(bufLine+j,"pgrade") != NULL) websocket=true;
-          if (strstr(bufLine+j,"lose") != NULL) keepAlive=false;
-          else if ((strstr(bufLine+j,"eep-") != NULL) && (strstr(bufLine+j+4,"live") != NULL)) keepAlive=true;
-          continue;
-        }
+      if (!strcasecmp(name, "Accept-Encoding")) { if (strstr(value,"gzip") != NULL) client->compression=GZIP; continue; }
+
+      if (!strcasecmp(name, "Content-Type")) { urlencodedForm = !strncasecmp(value, "application/x-www-form-urlencoded", 33); continue; }
 
-        if (strncasecmp(bufLine+j, "Accept-Encoding: ",17) == 0) { j+=17; if (strstr(bufLine+j,"gzip") != NULL) client->compression=GZIP; continue; }
-// Unused:
-        if (strncasecmp(bufLine+j, "Content-Type: application/x-www-form-urlencoded", 47) == 0) { urlencodedForm=true; continue; }
+      if (!strcasecmp(name, "Content-Length")) { postContentLength = strtoul(value, NULL, 10); continue; }
 
-        if (strncasecmp(bufLine+j, "Content-Length: ",16) == 0) { j+=16; postContentLength = atoi(bufLine+j); continue; }
+      if (!strcasecmp(name, "Transfer-Encoding")) { unframedBody=true; continue; }
 
-        if (strncasecmp(bufLine+j, "Cookie: ",8) == 0) { j+=8; strcpy(requestCookies, bufLine+j); continue; }
+      if (!strcasecmp(name, "Cookie")) { requestCookies=value; continue; }
 
-        if (strncasecmp(bufLine+j, "Origin: ",8) == 0) { j+=8; strcpy(requestOrigin, bufLine+j); continue; }
+      if (!strcasecmp(name, "Origin")) { requestOrigin=value; continue; }
 
-        if (strncasecmp(bufLine+j, "Sec-WebSocket-Key: ", 19) == 0) { j+=19; strcpy(webSocketClientKey, bufLine+j); continue; }
+      if (!strcasecmp(name, "Sec-WebSocket-Key")) { webSocketClientKey=value; continue; }
 
 // Not working:
-//      if (strncasecmp(bufLine+j, "Sec-WebSocket-Extensions: ", 26) == 0) { j+=26; if (strstr(bufLine+j, "permessage-deflate")  != NULL) client->compression=ZLIB; continue; }
+//    if (!strcasecmp(name, "Sec-WebSocket-Extensions")) { if (strstr(value, "permessage-deflate")  != NULL) client->compression=ZLIB; continue; }
 
-        if (strncasecmp(bufLine+j, "Sec-WebSocket-Version: ", 23) == 0) { j+=23; webSocketVersion = atoi(bufLine+j); continue; }
+      if (!strcasecmp(name, "Sec-WebSocket-Version")) { webSocketVersion = atoi(value); continue; }
+    }
 
-        isQueryStr=false;
-        if (strncmp(bufLine+j, "GET", 3) == 0)
-          {  requestMethod=GET_METHOD; isQueryStr=true; j+=4; }
+    if (keepAlive==-1)
+      keepAlive = ( strncmp (httpVers,"1.1", 3) >= 0 );
 
-        if (strncmp(bufLine+j, "POST", 4) == 0)
-          {  requestMethod=POST_METHOD; isQueryStr=true; j+=5; }
+    // a chunked body can't be skipped
+    if (unframedBody)
+      keepAlive=false;
 
-        if (strncmp(bufLine+j, "PUT", 6) == 0)
-          {  requestMethod=PUT_METHOD; isQueryStr=true; j+=7; }
+    if (keepAliveMaxRequests && nbRequests >= keepAliveMaxRequests)
+      keepAlive=false;
 
-        if (strncmp(bufLine+j, "DELETE", 6) == 0)
-          {  requestMethod=DELETE_METHOD; isQueryStr=true; j+=7; }
+    // the url, without the leading slashes
+    const char *path=buffer->getPath();
+    while (*path == '/') path++;
 
-        if (isQueryStr)
-        {
-          while (isspace((int)(bufLine[j])) && j < bufLineLen) j++;
+    // the rate of each client is limited before its credentials are
+    //  verified, then the rate of each user
+    unsigned retryAfter=rateLimiter.isEnabled() ? rateLimiter.checkClient(client->ip, path) : 0;
 
-          i=0; while (!isspace((int)(bufLine[j])) && (i < BUFSIZE - 1) && (j < bufLineLen) && bufLine[j]!='?') urlBuffer[i++] = bufLine[j++];
-          urlBuffer[i]='\0';
+    if (!retryAfter && !authOK && authorization != NULL)
+      authOK=isUserAllowed(authorization, username);
 
-          if ( !urlencodedForm && (bufLine[j] == '?') )
-            { i=0; j++; while (!isspace((int)(bufLine[j])) && (i < BUFSIZE - 1) && (j < bufLineLen)) requestParams[i++] = bufLine[j++];
-            requestParams[i]='\0'; }
-          else requestParams[0]='\0';
+    if (!retryAfter && rateLimiter.isEnabled())
+      retryAfter=rateLimiter.checkUser(client->ip, username, path);
 
-          while (isspace((int)(bufLine[j])) && j < (unsigned)bufLineLen) j++;
-          if (strncmp(bufLine+j, "HTTP/", 5) == 0)
-          {
-            strncpy (httpVers, bufLine+j+5, 3);
-            *(httpVers+3)='\0';
-            j+=8;
-          }
-        }
-      }
+    if (retryAfter)
+    {
+      static const char tooManyRequests[]="Too Many Requests\n";
+      char value[16];
+      snprintf(value, sizeof value, "%u", retryAfter);
+      if (postContentLength)
+        buffer->setBody(postContentLength, false);
+      HttpResponse response("text/plain", arena);
+      response.addHeader("Retry-After", value);
+      sendHttpHeader(client, HTTP_STATUS_TOO_MANY_REQUESTS, sizeof tooManyRequests - 1, keepAlive, false, &response, arena);
+      if (requestMethod != HEAD_METHOD)
+        httpSend(client, tooManyRequests, sizeof tooManyRequests - 1);
+      continue;
     }
 
     if (!authOK)
     {
-      nw::string msg = getHttpHeader( "401 Authorization Required", 0, false);
+      nw::string msg = getHttpHeader( HTTP_STATUS_UNAUTHORIZED, 0, false);
       httpSend(client, (const void*) msg.c_str(), msg.length());
       return true;
     }
@@ -459,38 +516,43 @@ bool WebServer::accept_request(ClientSockData* client)
       return true;
     }
 
-    if ( urlencodedForm )
+    // The urlencoded form parameters are read, the other bodies are discarded
+    if ( postContentLength )
     {
-      if (sslEnabled)
+      ssize_t missing=buffer->setBody(postContentLength, urlencodedForm);
+      if (missing > 0)
+        connections.setDeadline(client->timer, requestBodyTimeout);
+      while ( missing > 0 )
       {
-        int r=BIO_gets(client->bio, requestParams, BUFSIZE);
+        if (!recvRequestData(client, buffer))
+          return true;
+        missing=buffer->setBody(postContentLength, urlencodedForm);
+      }
 
-        switch(SSL_get_error(client->ssl,r))
-        {
-          case SSL_ERROR_NONE:
-            bufLineLen=r;
-            break;
-          case SSL_ERROR_ZERO_RETURN:
-            return true;
-        }
+      if (missing < 0)
+      {
+        nw::string msg = getHttpHeader(HTTP_STATUS_PAYLOAD_TOO_LARGE, 0, false);
+        httpSend(client, (const void*) msg.c_str(), msg.length());
+        return true;
       }
-      else
-        bufLineLen=recvLine(client->socketId, requestParams, BUFSIZE);
+
+      if (urlencodedForm)
+        requestParams=buffer->getBody();
     }
 
-    if ( (url[strlen(url) - 1] == '/') && (strlen(url)+12 < BUFSIZE) )
-        strcpy (url + strlen(url) - 1, "/index.html");
+    connections.cancelDeadline(client->timer);
 
-    do { url++; } while (strlen(url) && url[0]=='/');
+    char *url=buffer->getUrl();
+    size_t urlLength=strlen(path);
+    memcpy(url, path, urlLength+1);
+    if ( !urlLength || url[urlLength - 1] == '/' )
+      strcpy (url + urlLength, "index.html");
 
-    char logBuffer[BUFSIZE];
-    snprintf(logBuffer, BUFSIZE, "Request : url='%s'  reqType='%d'  param='%s'  requestCookies='%s'  (httpVers=%s keepAlive=%d zipSupport=%d)\n", url, requestMethod, requestParams, requestCookies, httpVers, keepAlive, client->compression );
+    char logBuffer[1024];
+    snprintf(logBuffer, sizeof logBuffer, "Request : url='%s'  reqType='%d'  param='%s'  requestCookies='%s'  (httpVers=%s keepAlive=%d zipSupport=%d)\n", url, requestMethod, requestParams, requestCookies, httpVers, keepAlive, client->compression );
     NVJ_LOG->append(NVJ_DEBUG, logBuffer);
 
     // Process the query
-    if (keepAlive==-1)
-      keepAlive = ( strncmp (httpVers,"1.1", 3) >= 0 );
-
     /* *************************
     /  * processing WebSockets *
     /  *************************/
@@ -501,17 +563,36 @@ bool WebServer::accept_request(ClientSockData* client)
       nw::map<nw::string,WebSocket*>::iterator it;
 
       it = webSocketEndPoints.find(url);
+      if (it != webSocketEndPoints.end() && strlen(webSocketClientKey) > WEBSOCKET_CLIENT_KEY_MAX)
+      {
+        nw::string msg = getBadRequestErrorMsg();
+        httpSend(client, (const void*) msg.c_str(), msg.length());
+        return true;
+      }
+
       if (it != webSocketEndPoints.end()) // FOUND
       {
         WebSocket* webSocket=it->second;
-        nw::string header = getHttpWebSocketHeader("101 Switching Protocols", webSocketClientKey, client->compression == ZLIB);
+        nw::string header = getHttpWebSocketHeader(HTTP_STATUS_SWITCHING_PROTOCOLS, webSocketClientKey, client->compression == ZLIB);
 
         httpSend(client, (const void*) header.c_str(), header.length());
-        HttpRequest* request=new HttpRequest(requestMethod, url, requestParams, requestCookies, requestOrigin, username, client);
+        HttpRequest* request=new HttpRequest(requestMethod, url, requestParams, requestCookies, requestOrigin, username, client,
+                                             buffer->getHeaders(), buffer->getHeadersCount());
+        request->decodeParametersAndCookies(); // shared by the websocket threads
+        WebSocketClient* webSocketClient=new WebSocketClient(webSocket, request);
 
+        // a client from now on: it can subscribe topics in onOpening
+        webSocket->addNewClient(request);
         if (webSocket->onOpening(request))
+        {
           startWebSocketListener(webSocket, request);
-        return false;
+          return false;
+        }
+
+        webSocket->removeClient(request); // may have subscribed topics
+        delete webSocketClient;
+        delete request;
+        return true;
       }
       else
       {
@@ -532,27 +613,51 @@ bool WebServer::accept_request(ClientSockData* client)
     unsigned char *gzipWebPage=NULL;
     int sizeZip=0;
     bool zippedFile=false;
+    int webpageFd=-1;
+    bool webpageFromFd=false;
+    bool webpageInArena=false;
 
 #ifdef DEBUG_TRACES
     printf( "url: %s?%s\n", url, requestParams ); fflush(NULL);
 #endif
 
-    HttpRequest request(requestMethod, url, requestParams, requestCookies, requestOrigin, username, client);
+    HttpRequest request(requestMethod, url, requestParams, requestCookies, requestOrigin, username, client,
+                        buffer->getHeaders(), buffer->getHeadersCount(), arena);
+    if (requestMethod == EXTENSION_METHOD)
+      request.setRequestMethodName(buffer->getMethodName());
+
+    const MimeType *mime=MimeTypes::findByName(url);
+    HttpResponse response("", arena);
+    if (mime != NULL)
+      response.setStaticMimeType(mime->type, mime->length);
+    bool repoMimeType=false;
 
-    const char *mime=get_mime_type(url);
-    nw::string mimeStr; if (mime != NULL) mimeStr=mime;
-    HttpResponse response(mimeStr);
+    // "OPTIONS *": the server capabilities
+    if (requestMethod == OPTIONS_METHOD && !strcmp(buffer->getPath(), "*"))
+    {
+      response.addHeader("Allow", "GET, HEAD, POST, PUT, PATCH, DELETE, OPTIONS");
+      sendHttpHeader(client, HTTP_STATUS_NO_CONTENT, 0, keepAlive, false, &response, arena);
+      continue;
+    }
 
     nw::vector<WebRepository *>::const_iterator repo=webRepositories.begin();
     for( ; repo!=webRepositories.end() && !fileFound && !zippedFile;)
     {
       if (*repo == NULL) continue;
 
+      // the mime types set for this repository
+      const nw::string *repoMime=(*repo)->getMimeType(url);
+      if (repoMime != NULL)
+        response.setMimeType(*repoMime);
+      else if (repoMimeType)
+        response.setStaticMimeType(mime != NULL ? mime->type : NULL, mime != NULL ? mime->length : 0);
+      repoMimeType = repoMime != NULL;
+
       fileFound = (*repo)->getFile(&request, &response);
       if (fileFound && response.getForwardedUrl() != "")
       {
-        strncpy( url, response.getForwardedUrl().c_str(), BUFSIZE - 1);
-        *(urlBuffer + BUFSIZE - 1)='\0';
+        strncpy( url, response.getForwardedUrl().c_str(), buffer->getUrlSize() - 1);
+        *(url + buffer->getUrlSize() - 1)='\0';
         response.forwardTo("");
         repo=webRepositories.begin(); fileFound=false;
       }
@@ -565,7 +670,25 @@ bool WebServer::accept_request(ClientSockData* client)
       char bufLinestr[300]; snprintf(bufLinestr, 300, "Webserver: page not found %s",  url);
       NVJ_LOG->append(NVJ_WARNING,bufLinestr);
 
-      nw::string msg = getNotFoundErrorMsg();
+      // the url is answered for other methods
+      nw::string allowed;
+      if (requestMethod != EXTENSION_METHOD)
+        for (repo=webRepositories.begin(); repo != webRepositories.end() && allowed.empty(); repo++)
+          if (*repo != NULL)
+            allowed=(*repo)->getAllowedMethods(url);
+
+      if (allowed.size())
+      {
+        static const char methodNotAllowed[]="Method Not Allowed\n";
+        HttpResponse errorResponse("text/plain", arena);
+        errorResponse.addHeader("Allow", allowed);
+        sendHttpHeader(client, HTTP_STATUS_METHOD_NOT_ALLOWED, sizeof methodNotAllowed - 1, keepAlive, false, &errorResponse, arena);
+        if (requestMethod != HEAD_METHOD)
+          httpSend(client, methodNotAllowed, sizeof methodNotAllowed - 1);
+        continue;
+      }
+
+      nw::string msg = requestMethod == EXTENSION_METHOD ? getNotImplementedErrorMsg() : getNotFoundErrorMsg();
       httpSend(client, (const void*) msg.c_str(), msg.length());
       return true;
     }
@@ -573,12 +696,72 @@ bool WebServer::accept_request(ClientSockData* client)
     {
       repo--;
       response.getContent(&webpage, &webpageLen, &zippedFile);
+      webpageInArena=response.isArenaContent();
+      webpageFd=response.getContentFile();
 
-      if ( webpage == NULL || !webpageLen)
+      if (webpageFd != -1 && !webpageLen)
       {
-        nw::string msg = getNoContentErrorMsg();
-        httpSend(client, (const void*) msg.c_str(), msg.length());
-        return true;
+        (*repo)->closeFile(webpageFd);
+        webpageFd=-1;
+      }
+
+      // HEAD: the header only, the content is not read nor (un)compressed
+      //  (the uncompressed length is read in the gzip trailer)
+      if ( requestMethod == HEAD_METHOD && ( webpageFd != -1 || ( webpage != NULL && webpageLen ) ) )
+      {
+        bool zipped = zippedFile && client->compression == GZIP;
+        size_t contentLength=webpageLen;
+        if (zippedFile && !zipped
+            && !getGunzippedLength(webpageFd == -1 ? webpage : NULL, webpageFd, webpageLen, contentLength))
+        {
+          if (webpageFd != -1) (*repo)->closeFile(webpageFd);
+          else if (!webpageInArena) (*repo)->freeFile(webpage);
+          nw::string msg = getInternalServerErrorMsg();
+          httpSend(client, (const void*) msg.c_str(), msg.length());
+          return true;
+        }
+        sendHttpHeader(client, HTTP_STATUS_OK, contentLength, keepAlive, zipped, &response, arena);
+        if (webpageFd != -1) (*repo)->closeFile(webpageFd);
+        else if (!webpageInArena) (*repo)->freeFile(webpage);
+        continue;
+      }
+
+      // The file content is needed in memory if it must be (un)compressed
+      //  or if it can't be sent with sendfile
+      if ( webpageFd != -1
+        && ( (zippedFile && client->compression == NONE)
+          || (!zippedFile && client->compression == GZIP && webpageLen > GZIP_MIN_CONTENT_LENGTH && isCompressibleMimeType(response.getMimeType()))
+          || !isSendFileAvailable(client) ) )
+      {
+        webpage=readFileContent(webpageFd, webpageLen);
+        (*repo)->closeFile(webpageFd);
+        webpageFd=-1;
+        if (webpage == NULL)
+        {
+          nw::string msg = getInternalServerErrorMsg();
+          httpSend(client, (const void*) msg.c_str(), msg.length());
+          return true;
+        }
+        webpageFromFd=true;
+      }
+
+      if ( webpageFd == -1 && ( webpage == NULL || !webpageLen ) )
+      {
+        if (webpage != NULL && !webpageInArena) (*repo)->freeFile(webpage);
+        sendHttpHeader(client, HTTP_STATUS_NO_CONTENT, 0, keepAlive, false, &response, arena);
+        continue;
+      }
+
+      if (webpageFd != -1)
+      {
+
+        sendHttpHeader(client, HTTP_STATUS_OK, webpageLen, keepAlive, zippedFile, &response, arena);
+        bool sent=httpSendFile(client, webpageFd, webpageLen);
+        (*repo)->closeFile(webpageFd);
+        // less than Content-Length: the connection can't be kept
+        if (!sent)
+          return true;
+        continue;
       }
 
       if (zippedFile)
@@ -614,10 +797,9 @@ bool WebServer::accept_request(ClientSockData* client)
     }
 
     // Need to compress
-    if ( !zippedFile && (client->compression == GZIP) && (webpageLen > 2048) )
+    if ( !zippedFile && (client->compression == GZIP) && (webpageLen > GZIP_MIN_CONTENT_LENGTH) )
     {
-      const char *mimetype=response.getMimeType().c_str();
-      if (mimetype != NULL && (strncmp(mimetype,"application",11) == 0 || strncmp(mimetype,"text",4) == 0))
+      if (isCompressibleMimeType(response.getMimeType()))
       {
         try
         {
@@ -645,36 +827,33 @@ bool WebServer::accept_request(ClientSockData* client)
       }
     }
 
-    if (keepAlive && !(--nbFileKeepAlive)) keepAlive=false;
 
     if (sizeZip>0 && (client->compression == GZIP))
     {
-      nw::string header = getHttpHeader("200 OK", sizeZip, keepAlive, true, &response);
-      httpSend(client, (const void*) header.c_str(), header.length());
+      sendHttpHeader(client, HTTP_STATUS_OK, sizeZip, keepAlive, true, &response, arena);
       httpSend(client, (const void*) gzipWebPage, sizeZip);
     }
     else
     {
-      nw::string header = getHttpHeader("200 OK", webpageLen, keepAlive, false, &response);
-      httpSend(client, (const void*) header.c_str(), header.length());
+      sendHttpHeader(client, HTTP_STATUS_OK, webpageLen, keepAlive, false, &response, arena);
       httpSend(client, (const void*) webpage, webpageLen);
     }
 
     if (sizeZip>0 && !zippedFile) // cas compression = double desalloc
     {
       free (gzipWebPage);
-      (*repo)->freeFile(webpage);
+      if (webpageFromFd) free (webpage); else if (!webpageInArena) (*repo)->freeFile(webpage);
       continue;
     }
 
     if ((client->compression == NONE) && zippedFile) // cas décompression = double desalloc
     {
       free (webpage);
-      (*repo)->freeFile(gzipWebPage);
+      if (webpageFromFd) free (gzipWebPage); else if (!webpageInArena) (*repo)->freeFile(gzipWebPage);
       continue;
     }
 
-    (*repo)->freeFile(webpage);
+    if (webpageFromFd) free (webpage); else if (!webpageInArena) (*repo)->freeFile(webpage);
 
   }
   while (keepAlive && !exiting);
@@ -705,6 +884,118 @@ void WebServer::httpSend(ClientSockData *client, const void *buf, size_t len)
     sendCompat (client->socketId, buf, len, 0);
 }
 
+/***********************************************************************
+* isSendFileAvailable: can a file be sent to the client without being
+*  copied in user space ? (always for plain http on Linux, only if the
+*  kernel TLS offload is active for https)
+***********************************************************************/
+
+bool WebServer::isSendFileAvailable(ClientSockData *client)
+{
+#ifdef HAVE_SENDFILE
+  if (!sslEnabled)
+    return true;
+#ifdef HAVE_KTLS
+  if (useKtls && client->ssl != NULL)
+    return BIO_get_ktls_send(SSL_get_wbio(client->ssl));
+#endif
+#endif
+  return false;
+}
+
+/***********************************************************************
+* httpSendFile: send a file content (sendfile or SSL_sendfile)
+* @param fd - the file descriptor
+* @param len - the number of bytes to send
+* \return false if they have not all been sent (error, or file truncated):
+*   the connection must be closed
+***********************************************************************/
+
+bool WebServer::httpSendFile(ClientSockData *client, int fd, size_t len)
+{
+#ifdef HAVE_SENDFILE
+  off_t offset=0;
+  while (len)
+  {
+    ssize_t n;
+#ifdef HAVE_KTLS
+    if (sslEnabled)
+    {
+      n=SSL_sendfile(client->ssl, fd, offset, len, 0);
+      if (n > 0) offset+=n;
+    }
+    else
+#endif
+      n=sendfile(client->socketId, fd, &offset, len);
+
+    if (n <= 0)
+    {
+      if (n < 0 && errno == EINTR) continue;
+      NVJ_LOG->append(NVJ_WARNING, "WebServer: sendfile failed !");
+      return false;
+    }
+    len-=n;
+  }
+#endif
+  return !len;
+}
+
+/***********************************************************************
+* readFileContent: read a file content in memory
+* @param fd - the file descriptor
+* @param len - the number of bytes to read
+* \return a new buffer (to be freed) or NULL on error
+***********************************************************************/
+
+unsigned char* WebServer::readFileContent(int fd, size_t len)
+{
+  unsigned char *content=(unsigned char *)malloc(len ? len : 1);
+  size_t nb=0;
+
+  if (content == NULL) return NULL;
+
+  while (nb < len)
+  {
+    ssize_t n=pread(fd, content+nb, len-nb, nb);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0)
+    {
+      NVJ_LOG->append(NVJ_ERROR, "Webserver : Error reading file content");
+      free (content);
+      return NULL;
+    }
+    nb+=n;
+  }
+
+  return content;
+}
+
+/***********************************************************************
+* getGunzippedLength: the length of a gzip content once uncompressed, read
+*   in its trailer (ISIZE: the length modulo 2^32, little endian)
+* @param content - the gzip content, or NULL if it is read from fd
+* @param fd - the file descriptor
+* @param len - the gzip content length
+* @param gunzippedLen - set to the uncompressed length
+* \return false if the trailer can't be read
+***********************************************************************/
+
+bool WebServer::getGunzippedLength(const unsigned char *content, int fd, size_t len, size_t& gunzippedLen)
+{
+  unsigned char isize[4];
+
+  if (len < 18) return false; // header and trailer
+
+  if (content != NULL)
+    memcpy(isize, content+len-4, 4);
+  else
+    if (pread(fd, isize, 4, len-4) != 4)
+      return false;
+
+  gunzippedLen=(size_t)isize[0] | (size_t)isize[1] << 8 | (size_t)isize[2] << 16 | (size_t)isize[3] << 24;
+  return true;
+}
+
 /***********************************************************************
 * fatalError:  Print out a system error and exit
 * @param s - error message
@@ -736,131 +1027,138 @@ int WebServer::setSocketRcvTimeout(int socket, int seconds)
 
 
 /***********************************************************************
-* get_mime_type: return valid mime_type using filename's extension
-* @param name - filename
-* \return mime_type or NULL is no found
-***********************************************************************/
-
-const char* WebServer::get_mime_type(const char *name)
-{
-  char *ext = strrchr(const_cast<char*>(name), '.');
-  if (!ext) return NULL;
-
-  char extLowerCase[6]; unsigned i=0;
-  for (; i<5 && i<strlen(ext); i++)
-    { extLowerCase[i]=ext[i]; if((extLowerCase[i]>='A')&&(extLowerCase[i]<='Z')) extLowerCase[i]+= 'a'-'A'; }
-  extLowerCase[i]='\0';
-
-  if (strcmp(extLowerCase, ".html") == 0 || strcmp(extLowerCase, ".htm") == 0) return "text/html";
-  if (strcmp(extLowerCase, ".js") == 0) return "application/javascript";
-  if (strcmp(extLowerCase, ".json") == 0) return "application/json";
-  if (strcmp(extLowerCase, ".xml") == 0) return "application/xml";
-  if (strcmp(extLowerCase, ".jpg") == 0 || strcmp(extLowerCase, ".jpeg") == 0) return "image/jpeg";
-  if (strcmp(extLowerCase, ".gif") == 0) return "image/gif";
-  if (strcmp(extLowerCase, ".png") == 0) return "image/png";
-  if (strcmp(extLowerCase, ".css") == 0) return "text/css";
-  if (strcmp(extLowerCase, ".txt") == 0) return "text/plain";
-  if (strcmp(extLowerCase, ".au") == 0) return "audio/basic";
-  if (strcmp(extLowerCase, ".wav") == 0) return "audio/wav";
-  if (strcmp(extLowerCase, ".avi") == 0) return "video/x-msvideo";
-  if (strcmp(extLowerCase, ".mpeg") == 0 || strcmp(extLowerCase, ".mpg") == 0) return "video/mpeg";
-  if (strcmp(extLowerCase, ".mp3") == 0) return "audio/mpeg";
-  if (strcmp(extLowerCase, ".csv") == 0) return "text/csv";
-  if (strcmp(extLowerCase, ".mp4") == 0) return "application/mp4";
-  if (strcmp(extLowerCase, ".bin") == 0) return "application/octet-stream";
-  if (strcmp(extLowerCase, ".doc") == 0 || strcmp(extLowerCase, ".docx") == 0) return "application/msword";
-  if (strcmp(extLowerCase, ".pdf") == 0) return "application/pdf";
-  if (strcmp(extLowerCase, ".ps") == 0 || strcmp(extLowerCase, ".eps") == 0 || strcmp(extLowerCase, ".ai") == 0) return "application/postscript";
-  if (strcmp(extLowerCase, ".tar") == 0) return "application/x-tar";
-  if (strcmp(extLowerCase, ".h264") == 0) return "video/h264";
-  if (strcmp(extLowerCase, ".dv") == 0) return "video/dv";
-  if (strcmp(extLowerCase, ".qt") == 0 || strcmp(extLowerCase, ".mov") == 0) return "video/quicktime";
-
-  return NULL;
-}
-
-/***********************************************************************
-* getHttpHeader: generate HTTP header
-* @param messageType - client socket descriptor
-* @param len - HTTP message type
+* buildHttpHeader: generate HTTP header in a buffer
+* @param buf - the buffer
+* @param size - the buffer size
+* @param status - HTTP status
+* @param len - the content length
 * @param keepAlive
 * @param zipped - true is content will be compressed
 * @param response - the HttpResponse
-* \return result of send function (successfull: >=0, otherwise <0)
+* \return the header length (the header is truncated if it's greater than size)
 ***********************************************************************/
 
-nw::string WebServer::getHttpHeader(const char *messageType, const size_t len, const bool keepAlive, const bool zipped, HttpResponse* response)
+size_t WebServer::buildHttpHeader(char *buf, const size_t size, const HttpStatus status, const size_t len, const bool keepAlive, const bool zipped, HttpResponse* response)
 {
-  char timeBuf[200];
-  time_t rawtime;
-  struct tm timeinfo;
+  HttpResponseHeader header(buf, size);
 
-  nw::string header="HTTP/1.1 "+nw::string(messageType)+nw::string("\r\n");
-  time ( &rawtime );
-  gmtime_r ( &rawtime, &timeinfo );
-  strftime (timeBuf,200,"Date: %a, %d %b %Y %H:%M:%S GMT", &timeinfo);
-  header+=nw::string(timeBuf)+"\r\n";
+  header.appendStatusLine(status);
+  header.appendDate();
+  header.append(webServerName);
+  header.appendConstant("\r\n");
 
-  header+=webServerName+"\r\n";
-
-  if (strncmp(messageType, "401", 3) == 0)
-    header+=nw::string("WWW-Authenticate: Basic realm=\"Restricted area: please enter Login/Password\"\r\n");
+  if (status == HTTP_STATUS_UNAUTHORIZED)
+    header.appendConstant("WWW-Authenticate: Basic realm=\"Restricted area: please enter Login/Password\"\r\n");
 
   if (response != NULL)
   {
     if ( response->isCORS() )
     {
-      header += "Access-Control-Allow-Origin: " + response->getCORSdomain() + "\r\nAccess-Control-Allow-Credentials: ";
+      header.appendConstant("Access-Control-Allow-Origin: ");
+      header.append(response->getCORSdomain());
       if ( response->isCORSwithCredentials() )
-        header += "true\r\n";
-      else header+="false\r\n";
+        header.appendConstant("\r\nAccess-Control-Allow-Credentials: true\r\n");
+      else
+        header.appendConstant("\r\nAccess-Control-Allow-Credentials: false\r\n");
     }
 
     nw::vector<nw::string>& cookies=response->getCookies();
     for (unsigned i=0; i < cookies.size(); i++)
-      header+="Set-Cookie: " + cookies[i] + "\r\n";
-  }
+    {
+      header.appendConstant("Set-Cookie: ");
+      header.append(cookies[i]);
+      header.appendConstant("\r\n");
+    }
 
-  header+="Accept-Ranges: bytes\r\n";
+    nw::vector<nw::string>& headers=response->getHeaders();
+    for (unsigned i=0; i < headers.size(); i++)
+    {
+      header.append(headers[i]);
+      header.appendConstant("\r\n");
+    }
+  }
 
   if (keepAlive)
-    header+="Connection: Keep-Alive\r\n";
+    header.appendConstant("Accept-Ranges: bytes\r\nConnection: Keep-Alive\r\nContent-Type: ");
   else
-    header+="Connection: close\r\n";
+    header.appendConstant("Accept-Ranges: bytes\r\nConnection: close\r\nContent-Type: ");
 
-  nw::string mimetype="text/html";
   if (response != NULL)
-    mimetype=response->getMimeType();
-  header+="Content-Type: "+ mimetype  + "\r\n";
+    header.append(response->getMimeType(), response->getMimeTypeLength());
+  else
+    header.appendConstant("text/html");
+  header.appendConstant("\r\n");
 
   if (zipped)
-    header+="Content-Encoding: gzip\r\n";
+    header.appendConstant("Content-Encoding: gzip\r\n");
 
   if (len)
   {
-    nw::ostringstream lenSS; lenSS << len;
-    header+="Content-Length: "+lenSS.str()+ "\r\n";
+    header.appendConstant("Content-Length: ");
+    header.appendNumber(len);
+    header.appendConstant("\r\n");
   }
 
-  header+= "\r\n";
+  header.appendConstant("\r\n");
 
-  return header;
+  return header.getLength();
 }
 
-
-/**********************************************************************
-* getNoContentErrorMsg: send a 204 No Content Message
-* \return the http message to send
+/***********************************************************************
+* getHttpHeader: generate HTTP header
+* @param status - HTTP status
+* @param len - the content length
+* @param keepAlive
+* @param zipped - true is content will be compressed
+* @param response - the HttpResponse
+* \return the header
 ***********************************************************************/
 
-nw::string WebServer::getNoContentErrorMsg()
+nw::string WebServer::getHttpHeader(const HttpStatus status, const size_t len, const bool keepAlive, const bool zipped, HttpResponse* response)
 {
-  nw::string header=getHttpHeader( "204 No Content", 0, false );
+  char buf[HTTP_RESPONSE_HEADER_SIZE];
+  size_t length=buildHttpHeader(buf, sizeof buf, status, len, keepAlive, zipped, response);
+  if (length <= sizeof buf)
+    return nw::string(buf, length);
 
+  nw::string header(length, '\0');
+  buildHttpHeader(&header[0], length, status, len, keepAlive, zipped, response);
   return header;
+}
+
+/***********************************************************************
+* sendHttpHeader: generate and send HTTP header, without heap allocation
+*   unless it doesn't fit in HTTP_RESPONSE_HEADER_SIZE
+* @param client - the client
+* @param status - HTTP status
+* @param len - the content length
+* @param keepAlive
+* @param zipped - true is content will be compressed
+* @param response - the HttpResponse
+* @param arena - the request scoped memory, or NULL
+***********************************************************************/
+
+void WebServer::sendHttpHeader(ClientSockData *client, const HttpStatus status, const size_t len, const bool keepAlive, const bool zipped,
+                               HttpResponse* response, RequestArena *arena)
+{
+  char buf[HTTP_RESPONSE_HEADER_SIZE];
+  size_t length=buildHttpHeader(buf, sizeof buf, status, len, keepAlive, zipped, response);
+  if (length <= sizeof buf)
+  {
+    httpSend(client, buf, length);
+    return;
+  }
 
+  char *header = arena != NULL ? (char*)arena->allocate(length) : NULL;
+  bool onHeap = header == NULL;
+  if (onHeap && (header=(char*)malloc(length)) == NULL)
+    return;
+  buildHttpHeader(header, length, status, len, keepAlive, zipped, response);
+  httpSend(client, header, length);
+  if (onHeap) free(header);
 }
 
+
 /**********************************************************************
 * sendBadRequestError: send a 400 Bad Request Message
 * \return the http message to send
@@ -871,7 +1169,7 @@ nw::string  WebServer::getBadRequestErrorMsg()
   nw::string errorMessage="<HTML><HEAD>\n<TITLE>400 Bad Request</TITLE>\n</HEAD><body>\n<h1>Bad Request</h1>\n \
                 <p>Your browser sent a request that this server could not understand.<br />\n</p>\n</body></HTML>\n";
 
-  nw::string header=getHttpHeader( "400 Bad Request", errorMessage.length(), false);
+  nw::string header=getHttpHeader( HTTP_STATUS_BAD_REQUEST, errorMessage.length(), false);
 
   return header+errorMessage;
 }
@@ -887,7 +1185,7 @@ nw::string WebServer::getNotFoundErrorMsg()
                 "<p>\n\n\nThe requested URL was not found on this server.\n\n\n\n    If you entered the URL manually please check your spelling and try again.\n\n\n</p>\n" \
                 "<h2>Error 404</h2></body></HTML>\n";
 
-  nw::string header=getHttpHeader( "404 Not Found", errorMessage.length(), false );
+  nw::string header=getHttpHeader( HTTP_STATUS_NOT_FOUND, errorMessage.length(), false );
 
   return header+errorMessage;
 
@@ -903,7 +1201,7 @@ nw::string WebServer::getInternalServerErrorMsg()
   nw::string errorMessage="<HTML><HEAD><TITLE>Internal Server Error!</TITLE><body><h1>Internal Server Error!</h1>\n" \
                 "<p>\n\n\nSomething happens.\n\n\n\n    If you entered the URL manually please check your spelling and try again.\n\n\n</p>\n" \
                 "<h2>Error 500</h2></body></HTML>\n";
-  nw::string header=getHttpHeader( "500 Internal Server Error", errorMessage.length(), false );
+  nw::string header=getHttpHeader( HTTP_STATUS_INTERNAL_SERVER_ERROR, errorMessage.length(), false );
 
   return header+errorMessage;
 }
@@ -921,28 +1219,24 @@ nw::string WebServer::getNotImplementedErrorMsg()
                 "If you entered the URL manually please check your spelling and try again.\n\n\n</p>\n" \
                 "<h2>Error 501</h2></body></HTML>\n";
 
-  nw::string header=getHttpHeader( "501 Method Not Implemented", errorMessage.length(), false );
+  nw::string header=getHttpHeader( HTTP_STATUS_NOT_IMPLEMENTED, errorMessage.length(), false );
 
   return header+errorMessage;
 }
 
 
 /***********************************************************************
-* init: Initialize server listening socket
-* \return Port server used
+* openListeningSockets: open the listening sockets (one per address
+*  family), non blocking
+* @param sockets - the opened sockets are appended
+* @param reusePort - the port is shared with other sockets (SO_REUSEPORT)
 ***********************************************************************/
 
-u_short WebServer::init()
+void WebServer::openListeningSockets(nw::vector<int>& sockets, const bool reusePort)
 {
-  // Build SSL context
-  if (sslEnabled)
-    initialize_ctx(sslCertFile.c_str(), sslCaFile.c_str(), sslCertPwd.c_str());
-
   struct addrinfo  hints;
   struct addrinfo *result, *rp;
 
-  threadWebServer=0;
-  nbServerSock=0;
   memset(&hints, 0, sizeof(struct addrinfo));
   hints.ai_family = AF_UNSPEC;    /* Allow IPv4 or IPv6 */
   hints.ai_socktype = SOCK_STREAM; /* TCP socket */
@@ -958,56 +1252,112 @@ u_short WebServer::init()
   if (getaddrinfo(NULL, portStr, &hints, &result) != 0)
     fatalError("WebServer : getaddrinfo error ");
 
-  for (rp = result; rp != NULL && nbServerSock < sizeof(server_sock)/sizeof(int) ; rp = rp->ai_next)
+  for (rp = result; rp != NULL ; rp = rp->ai_next)
   {
-    if ( (server_sock[ nbServerSock ] = socket( rp->ai_family, rp->ai_socktype, rp->ai_protocol)) == -1 ) continue;
+    int sock;
+    if ( (sock = socket( rp->ai_family, rp->ai_socktype, rp->ai_protocol)) == -1 ) continue;
 
     int optval = 1;
 
-    setsockoptCompat( server_sock [ nbServerSock ], SOL_SOCKET, SO_REUSEADDR, &optval, sizeof optval);
+    setsockoptCompat( sock, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof optval);
 
+#ifdef SO_REUSEPORT
+    if (reusePort)
+      setsockoptCompat( sock, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof optval);
+#endif
 
     if (device.length())
     {
 #ifndef LINUX
       NVJ_LOG->append(NVJ_WARNING, "WebServer: HttpdDevice parameter will be ignored on your system");
 #else
-      setsockopt( server_sock [ nbServerSock ], SOL_SOCKET, SO_BINDTODEVICE, device.c_str(), device.length());
+      setsockopt( sock, SOL_SOCKET, SO_BINDTODEVICE, device.c_str(), device.length());
 #endif
     }
 
-    if ( rp->ai_family == PF_INET && disableIpV4) continue;
+    if ( rp->ai_family == PF_INET && disableIpV4) { close( sock ); continue; }
 
     if ( rp->ai_family == PF_INET6 )
     {
-      if (disableIpV6) continue;
+      if (disableIpV6) { close( sock ); continue; }
 #if defined( IPV6_V6ONLY )
 
       //Disable IPv4 mapped addresses.
 
       int v6Only = 1;
 
-      setsockoptCompat( server_sock [ nbServerSock ], IPPROTO_IPV6, IPV6_V6ONLY, &v6Only, sizeof( v6Only ) ) ;
+      setsockoptCompat( sock, IPPROTO_IPV6, IPV6_V6ONLY, &v6Only, sizeof( v6Only ) ) ;
 
 #else
       NVJ_LOG->append(NVJ_WARNING, "WebServer: Cannot set IPV6_V6ONLY socket option.  Closing IPv6 socket.");
-      close(  server_sock[ nbServerSock ] );
+      close( sock );
       continue;
 #endif
     }
-    if ( bind( server_sock[ nbServerSock ], rp->ai_addr, rp->ai_addrlen) == 0 )
-      if ( listen(server_sock [ nbServerSock ], 128) >= 0 )
-      {
-        nbServerSock ++;                  /* Success */
-        continue;
-      }
 
-    close( server_sock[ nbServerSock ] );
+    // the acceptors drain the pending connections until EAGAIN
+    int flags=fcntl( sock, F_GETFL, 0 );
+    if ( flags != -1 && fcntl( sock, F_SETFL, flags | O_NONBLOCK ) != -1 )
+    {
+      fcntl( sock, F_SETFD, FD_CLOEXEC );
+      if ( bind( sock, rp->ai_addr, rp->ai_addrlen) == 0 )
+        if ( listen( sock, listenBacklog ) >= 0 )
+        {
+          sockets.push_back( sock );                  /* Success */
+          continue;
+        }
+    }
+
+    close( sock );
   }
   freeaddrinfo(result);           /* No longer needed */
+}
 
-  if (nbServerSock == 0)
-    fatalError("WebServer : Init Failed ! (nbServerSock == 0)");
+/***********************************************************************
+* init: Initialize server listening sockets, for each acceptor
+* \return Port server used
+***********************************************************************/
+
+u_short WebServer::init()
+{
+  // Build SSL context
+  if (sslEnabled)
+    initialize_ctx(sslCertFile.c_str(), sslCaFile.c_str(), sslCertPwd.c_str());
+
+  threadWebServer=0;
+
+  // by default, the TLS handshakes are run by an acceptor per cpu
+  size_t n=nbAcceptors;
+  if (!n)
+  {
+    n=1;
+#ifdef SO_REUSEPORT
+    long nbCpus=sysconf(_SC_NPROCESSORS_ONLN);
+    if (sslEnabled && nbCpus > 1)
+      n=nbCpus;
+#endif
+  }
+#ifndef SO_REUSEPORT
+  if (n > 1)
+  {
+    NVJ_LOG->append(NVJ_WARNING, "WebServer: SO_REUSEPORT is not available, a single acceptor is used");
+    n=1;
+  }
+#endif
+
+  for (size_t i=0; i<n; i++)
+  {
+    Acceptor *acceptor=new Acceptor(this, i);
+    openListeningSockets(acceptor->sockets, n > 1);
+    acceptors.push_back(acceptor);
+
+    if (acceptor->sockets.empty())
+      fatalError("WebServer : Init Failed ! (no listening socket)");
+
+    pthread_mutex_lock( &clientsQueue_mutex );
+    serverSockets.insert(serverSockets.end(), acceptor->sockets.begin(), acceptor->sockets.end());
+    pthread_mutex_unlock( &clientsQueue_mutex );
+  }
 
   return ( tcpPort );
 }
@@ -1022,13 +1372,17 @@ void WebServer::exit()
   pthread_mutex_lock( &clientsQueue_mutex );
   exiting=true;
 
-  while (nbServerSock>0)
+  for (size_t i=0; i<serverSockets.size(); i++)
   {
-    shutdown ( server_sock[ --nbServerSock ], 2 ) ;
-    close (server_sock[ nbServerSock ]);
+    shutdown ( serverSockets[ i ], 2 ) ;
+    close ( serverSockets[ i ] );
   }
+  serverSockets.clear();
   pthread_mutex_unlock( &clientsQueue_mutex );
 
+  // the reads waiting for a request return
+  connections.shutdownConnections();
+
   pthread_mutex_lock(&webSocketClientList_mutex);
   for (nw::list<int>::iterator it = webSocketClientList.begin(); it != webSocketClientList.end();)
   {
@@ -1089,7 +1443,7 @@ int WebServer::verify_callback(int preverify_ok, X509_STORE_CTX *ctx)
   */
   if (!preverify_ok && (err == X509_V_ERR_UNABLE_TO_GET_ISSUER_CERT))
   {
-   X509_NAME_oneline(X509_get_issuer_name(ctx->current_cert), buf, 256);
+   X509_NAME_oneline(X509_get_issuer_name(err_cert), buf, 256);
    char buftmp[300]; snprintf(buftmp, 300, "X509_verify_cert error: issuer= %s", buf);
      NVJ_LOG->append(NVJ_INFO,buftmp);
   }
@@ -1128,6 +1482,21 @@ void WebServer::initialize_ctx(const char *certfile, const char *cafile, const c
 
   SSL_CTX_set_session_id_context(sslCtx, (const unsigned char*)&s_server_session_id_context, sizeof s_server_session_id_context);
 
+  /* Kernel TLS offload: the record encryption is done by the kernel,
+     so that static files can be sent with sendfile */
+  if (useKtls)
+  {
+#ifdef HAVE_KTLS
+    SSL_CTX_set_options(sslCtx, SSL_OP_ENABLE_KTLS);
+#else
+    NVJ_LOG->append(NVJ_WARNING,"WebServer: kernel TLS offload is not supported by this OpenSSL version");
+#endif
+  }
+
+  /* Sessions resumption */
+  sslSessionCache=new SslSessionCache();
+  sslSessionCache->attach(sslCtx, sslSessionCacheSize, sslSessionTimeout, sslTicketKeyLifetime);
+
   if ( authPeerSsl )
   {
       if(!(SSL_CTX_load_verify_locations(sslCtx, cafile,0)))
@@ -1153,46 +1522,344 @@ bool WebServer::isAuthorizedDN(const nw::string str)
   return res;
 }
 
-/**********************************************************************/
+/***********************************************************************
+* startTlsHandshake: prepare the non-blocking TLS handshake of a new client
+* @param client - the client, its socket is switched to non-blocking mode
+* \return false on error
+***********************************************************************/
 
-void WebServer::poolThreadProcessing()
+bool WebServer::startTlsHandshake(ClientSockData* client)
 {
-  BIO *sbio;
-  SSL *ssl=NULL;
-  X509 *peer=NULL;
-  bool authSSL=false;
+  #ifndef HAVE_ACCEPT4 // else accepted non blocking
+  int flags=fcntl(client->socketId, F_GETFL, 0);
+  if (flags == -1 || fcntl(client->socketId, F_SETFL, flags | O_NONBLOCK) == -1)
+    return false;
+#endif
 
+  if ((client->ssl=SSL_new(sslCtx)) == NULL)
+    return false;
+
+  SSL_set_fd(client->ssl, client->socketId);
+  SSL_set_accept_state(client->ssl);
+  return true;
+}
+
+/***********************************************************************
+* continueTlsHandshake: go on with the handshake, as far as the socket
+*  is ready
+* @param handshake - the pending handshake, its poll events are updated
+* \return 1 if the handshake is completed, 0 if it must be continued
+*   when the socket is ready, -1 on error
+***********************************************************************/
 
-  while( !clientsQueue.empty() || !exiting )
+int WebServer::continueTlsHandshake(TlsHandshake& handshake)
+{
+  ClientSockData* client=handshake.client;
+
+  ERR_clear_error();
+  int r=SSL_do_handshake(client->ssl);
+
+  if (r == 1)
+  {
+    sslSessionCache->recordHandshake(SSL_session_reused(client->ssl));
+
+    // the request processing uses blocking I/O
+    int flags=fcntl(client->socketId, F_GETFL, 0);
+    if (flags == -1 || fcntl(client->socketId, F_SETFL, flags & ~O_NONBLOCK) == -1)
+      return -1;
+    return 1;
+  }
+
+  switch (SSL_get_error(client->ssl, r))
+  {
+    case SSL_ERROR_WANT_READ:
+      handshake.events=POLLIN;
+      return 0;
+
+    case SSL_ERROR_WANT_WRITE:
+      handshake.events=POLLOUT;
+      return 0;
+
+    default:
+    {
+      const char *sslmsg=ERR_reason_error_string(ERR_get_error());
+      nw::string msg="SSL accept error ";
+      if (sslmsg != NULL) msg+=": "+nw::string(sslmsg);
+      NVJ_LOG->append(NVJ_DEBUG,msg);
+      return -1;
+    }
+  }
+}
+
+/***********************************************************************
+* monotonicTime: \return the monotonic clock, in µs
+***********************************************************************/
+
+static inline unsigned long long monotonicTime()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/***********************************************************************
+* pushClient: give a new client to the threads pool (the running threads
+*   are chosen in turn, an idle thread is woken up to process it). The
+*   pool grows if no thread is idle.
+***********************************************************************/
+
+void WebServer::pushClient(ClientSockData* client)
+{
+  size_t nbThreads=poolThreads.size();
+  size_t first=__sync_fetch_and_add(&nextPoolThread, 1) % nbThreads;
+  bool queued=false;
+
+  client->queuedTime=monotonicTime();
+  __sync_add_and_fetch(&queuedClients, 1);
+
+  for (size_t i=0; i<nbThreads && !queued; i++)
+  {
+    PoolThread *thread=poolThreads[ (first+i) % nbThreads ];
+    if (thread->state == POOL_THREAD_RUNNING)
+      queued=thread->queue.push(client);
+  }
+
+  if (!queued)
   {
     pthread_mutex_lock( &clientsQueue_mutex );
+    clientsQueue.push(client);
+    __sync_add_and_fetch(&clientsQueueSize, 1);
+    pthread_mutex_unlock( &clientsQueue_mutex );
+  }
 
-    while( clientsQueue.empty() && !exiting)
-      pthread_cond_wait( &clientsQueue_cond, &clientsQueue_mutex );
+  __sync_synchronize();
+  if (!wakePoolThread(first))
+    addPoolThread();
+}
 
-    if (exiting)  { pthread_mutex_unlock( &clientsQueue_mutex ); break; }
+/***********************************************************************
+* wakePoolThread: wake up a sleeping pool thread, if possible the given one
+* @param index - the preferred pool thread
+* \return false if no thread is sleeping
+***********************************************************************/
 
-    // clientsQueue is not empty
-    ClientSockData* client = clientsQueue.front();
-    clientsQueue.pop();
+bool WebServer::wakePoolThread(size_t index)
+{
+  size_t nbThreads=poolThreads.size();
+
+  for (size_t i=0; i<nbThreads; i++)
+  {
+    PoolThread *thread=poolThreads[ (index+i) % nbThreads ];
+    if (__sync_bool_compare_and_swap(&thread->sleeping, 1, 0))
+    {
+      pthread_mutex_lock( &thread->mutex );
+      pthread_cond_signal( &thread->cond );
+      pthread_mutex_unlock( &thread->mutex );
+      return true;
+    }
+  }
+  return false;
+}
+
+/***********************************************************************
+* popClient: get a client from the thread's queue, or steal one from the
+*   other threads (the stopped ones included). The queue wait time is
+*   recorded, the pool grows if it is too long.
+* @param thread - the pool thread
+* \return the client or NULL
+***********************************************************************/
+
+ClientSockData* WebServer::popClient(PoolThread *thread)
+{
+  ClientSockData *client=NULL;
+  size_t nbThreads=poolThreads.size();
 
+  for (size_t i=0; i<nbThreads && client == NULL; i++)
+    if (!poolThreads[ (thread->index+i) % nbThreads ]->queue.pop(client))
+      client=NULL;
+
+  if (client == NULL && clientsQueueSize)
+  {
+    pthread_mutex_lock( &clientsQueue_mutex );
+    if (!clientsQueue.empty())
+    {
+      client=clientsQueue.front();
+      clientsQueue.pop();
+      __sync_sub_and_fetch(&clientsQueueSize, 1);
+    }
     pthread_mutex_unlock( &clientsQueue_mutex );
+  }
 
-    if (sslEnabled)
+  if (client == NULL)
+    return NULL;
+
+  __sync_sub_and_fetch(&queuedClients, 1);
+
+  // moving average, only for monitoring: the races are harmless
+  unsigned long long wait=monotonicTime()-client->queuedTime;
+  queueWaitTime=(queueWaitTime*7 + wait) / 8;
+
+  if (wait >= POOL_GROW_QUEUE_WAIT)
+    addPoolThread();
+
+  return client;
+}
+
+/**********************************************************************/
+
+bool WebServer::hasQueuedClient()
+{
+  for (size_t i=0; i<poolThreads.size(); i++)
+    if (!poolThreads[i]->queue.empty())
+      return true;
+  return clientsQueueSize != 0;
+}
+
+/***********************************************************************
+* waitClient: sleep until a client is pushed (or the server exits)
+* @param thread - the pool thread
+* \return false if no client has been pushed for a second
+***********************************************************************/
+
+bool WebServer::waitClient(PoolThread *thread)
+{
+  __sync_lock_test_and_set(&thread->sleeping, 1);
+  __sync_synchronize();
+
+  // a client may have been pushed before the sleeping flag was set
+  if (exiting || hasQueuedClient())
+  {
+    __sync_bool_compare_and_swap(&thread->sleeping, 1, 0);
+    return true;
+  }
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec++;
+
+  bool woken=true;
+  pthread_mutex_lock( &thread->mutex );
+  while (thread->sleeping && !exiting)
+    if (pthread_cond_timedwait( &thread->cond, &thread->mutex, &deadline ) == ETIMEDOUT)
     {
-      sbio=BIO_new_socket(client->socketId, BIO_NOCLOSE);
-      ssl=SSL_new(sslCtx);
-      SSL_set_bio(ssl,sbio,sbio);
-
-      if (SSL_accept(ssl) <= 0)
-      { const char *sslmsg=ERR_reason_error_string(ERR_get_error());
-        nw::string msg="SSL accept error ";
-        if (sslmsg != NULL) msg+=": "+nw::string(sslmsg);
-        NVJ_LOG->append(NVJ_DEBUG,msg);
-      }
+      woken=false;
+      break;
+    }
+  pthread_mutex_unlock( &thread->mutex );
+
+  __sync_bool_compare_and_swap(&thread->sleeping, 1, 0);
+  return woken;
+}
+
+/***********************************************************************
+* addPoolThread: start a pool thread, if the pool is not full
+***********************************************************************/
+
+void WebServer::addPoolThread()
+{
+  size_t n;
+  do
+  {
+    n=nbPoolThreads;
+    if (n >= poolThreads.size()) return;
+  }
+  while (!__sync_bool_compare_and_swap(&nbPoolThreads, n, n+1));
+
+  pthread_mutex_lock( &poolThreads_mutex );
+  PoolThread *thread=NULL;
+  for (size_t i=0; i<poolThreads.size() && !exiting; i++)
+    if (poolThreads[i]->state != POOL_THREAD_RUNNING)
+    {
+      thread=poolThreads[i];
+      break;
+    }
+
+  if (thread == NULL)
+  {
+    // exiting, or a retiring thread is still running
+    __sync_sub_and_fetch(&nbPoolThreads, 1);
+    pthread_mutex_unlock( &poolThreads_mutex );
+    return;
+  }
+
+  if (thread->state == POOL_THREAD_EXITING)
+    wait_for_thread( thread->thread );
+  thread->state=POOL_THREAD_RUNNING;
+  create_thread( &thread->thread, WebServer::startPoolThread, static_cast<void *>(thread) );
+  pthread_mutex_unlock( &poolThreads_mutex );
+}
 
-      client->ssl=ssl;
-      client->bio=sbio;
+/***********************************************************************
+* retirePoolThread: an idle pool thread exits, if the pool is larger than
+*   its minimum size. The clients queued for it will be stolen.
+* @param thread - the pool thread
+* \return true if the thread must exit
+***********************************************************************/
+
+bool WebServer::retirePoolThread(PoolThread *thread)
+{
+  size_t n;
+  do
+  {
+    n=nbPoolThreads;
+    if (n <= threadsPoolMinSize) return false;
+  }
+  while (!__sync_bool_compare_and_swap(&nbPoolThreads, n, n-1));
+
+  thread->state=POOL_THREAD_EXITING;
+  return true;
+}
+
+/***********************************************************************
+* setCpuAffinity: pin the current thread on a cpu
+* @param index - the cpu index (modulo the number of online cpus)
+***********************************************************************/
+
+void WebServer::setCpuAffinity(size_t index)
+{
+#ifdef LINUX
+  long nbCpus=sysconf(_SC_NPROCESSORS_ONLN);
+  if (nbCpus <= 0) return;
+
+  cpu_set_t cpuSet;
+  CPU_ZERO(&cpuSet);
+  CPU_SET(index % nbCpus, &cpuSet);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet) != 0)
+    NVJ_LOG->append(NVJ_WARNING, "WebServer: can't set the thread cpu affinity");
+#else
+  (void)index;
+#endif
+}
+
+/**********************************************************************/
+
+void WebServer::poolThreadProcessing(PoolThread *thread)
+{
+  SSL *ssl=NULL;
+  X509 *peer=NULL;
+  bool authSSL=false;
+  RequestArena arena; // request scoped memory of this thread
+  time_t lastActive=time(NULL);
+
+  if (threadsAffinity)
+    setCpuAffinity(thread->index);
+
+  while( !exiting )
+  {
+    ClientSockData* client = popClient(thread);
+    if (client == NULL)
+    {
+      if (!waitClient(thread) && time(NULL) - lastActive >= threadsPoolIdleTimeout
+          && retirePoolThread(thread))
+        break;
+      continue;
+    }
+
+    if (sslEnabled)
+    {
+      // the TLS handshake has been completed by the listener thread
+      ssl=client->ssl;
+      client->bio=SSL_get_rbio(ssl);
 
       if ( authPeerSsl )
       {
@@ -1218,27 +1885,68 @@ void WebServer::poolThreadProcessing()
       else
         authSSL=true;
     }
-    if (accept_request(client))
+    if (accept_request(client, &arena))
       freeClientSockData(client);
+    arena.reset();
+    lastActive=time(NULL);
   }
-  exitedThread++;
-
 }
 
 
 /***********************************************************************
-* initPoolThreads:
+* initPoolThreads: create the threads slots, and start the minimum
+*   number of threads
 ************************************************************************/
 
 void WebServer::initPoolThreads()
 {
-  pthread_t newthread;
-  for (unsigned i=0; i<threadsPoolSize; i++)
+  long nbCpus=sysconf(_SC_NPROCESSORS_ONLN);
+  if (nbCpus <= 0) nbCpus=1;
+
+  if (!threadsPoolSize)
+    threadsPoolSize = nbCpus * POOL_THREADS_PER_CPU;
+  if (!threadsPoolMinSize)
+    threadsPoolMinSize = nbCpus * POOL_THREADS_MIN_PER_CPU;
+  if (threadsPoolMinSize > threadsPoolSize)
+    threadsPoolMinSize = threadsPoolSize;
+
+  nbPoolThreads=0;
+  queuedClients=0;
+  queueWaitTime=0;
+  for (size_t i=0; i<threadsPoolSize; i++)
+    poolThreads.push_back(new PoolThread(this, i));
+
+  for (size_t i=0; i<threadsPoolMinSize; i++)
+    addPoolThread();
+}
+
+/***********************************************************************
+* stopPoolThreads: wake up and join the pool threads (exiting is set)
+************************************************************************/
+
+void WebServer::stopPoolThreads()
+{
+  // no thread can be started once this lock has been released
+  pthread_mutex_lock( &poolThreads_mutex );
+  pthread_mutex_unlock( &poolThreads_mutex );
+
+  size_t idx;
+  for (idx = 0; idx < poolThreads.size(); idx++)
   {
-    create_thread( &newthread, WebServer::startPoolThread, static_cast<void *>(this) );
-    usleep(500);
+    PoolThread *thread=poolThreads[idx];
+    pthread_mutex_lock( &thread->mutex );
+    thread->sleeping=0;
+    pthread_cond_signal( &thread->cond );
+    pthread_mutex_unlock( &thread->mutex );
   }
-  exitedThread=0;
+
+  for (idx = 0; idx < poolThreads.size(); idx++)
+    if (poolThreads[idx]->state != POOL_THREAD_STOPPED)
+    {
+      wait_for_thread( poolThreads[idx]->thread );
+      poolThreads[idx]->state=POOL_THREAD_STOPPED;
+    }
+  nbPoolThreads=0;
 }
 
 
@@ -1256,56 +1964,71 @@ void* WebServer::startThread(void* t)
   return NULL;
 }
 
+/***********************************************************************
+* acceptClient: accept a connection (the TLS clients are non blocking
+*  for the handshake)
+* @param serverSocket - the listening socket
+* @param address - the client address
+* \return the client socket, or -1
+************************************************************************/
 
-void WebServer::threadProcessing()
+int WebServer::acceptClient(int serverSocket, struct sockaddr_storage *address)
 {
-  int client_sock=0;
-
-  exiting=false;
-  exitedThread=0;
-
-  struct sockaddr_storage clientAddress;
-  socklen_t clientAddressLength = sizeof(clientAddress);
-
-  ushort port=init();
-
-  initPoolThreads();
-  httpdAuth = authLoginPwdList.size() || isAuthPam() ;
-
-  if (isAuthPam())
-  {
-#if defined(LINUX) || defined(__darwin__)
-          AuthPAM::start();
+  socklen_t addressLength = sizeof(*address);
+#ifdef HAVE_ACCEPT4
+  return accept4( serverSocket, (struct sockaddr*)address, &addressLength, SOCK_CLOEXEC | (sslEnabled ? SOCK_NONBLOCK : 0) );
 #else
-          NVJ_LOG->appendUniq(NVJ_ERROR, "WebServer : WARNING authPAM will be ignored on your system");
+  int sock=accept( serverSocket, (struct sockaddr*)address, &addressLength );
+  if (sock != -1)
+    fcntl( sock, F_SETFD, FD_CLOEXEC );
+  return sock;
 #endif
-  }
+}
 
-  char buf[300]; snprintf(buf, 300, "WebServer : Listen on port %d", port);
-  NVJ_LOG->append(NVJ_INFO,buf);
+/***********************************************************************
+* acceptorProcessing: accept the connections of an acceptor's listening
+*  sockets, and drive the TLS handshakes
+* @param acceptor - the acceptor
+************************************************************************/
+
+void WebServer::acceptorProcessing(Acceptor *acceptor)
+{
+  int client_sock=0;
+  struct sockaddr_storage clientAddress;
 
-  struct pollfd *pfd;
-  if ( (pfd = (pollfd *)malloc( nbServerSock * sizeof( struct pollfd ) )) == NULL )
-      fatalError("WebServer : malloc error ");
+  if (threadsAffinity && acceptors.size() > 1)
+    setCpuAffinity(acceptor->index);
 
+  nw::vector<struct pollfd> pfd;
+  nw::vector<TlsHandshake> handshakes;
+  size_t nbServerSock=acceptor->sockets.size();
   unsigned idx;
   int status;
 
-  for ( idx = 0; idx < nbServerSock; idx++ )
+  for (;!exiting;)
   {
-      pfd[ idx ].fd = server_sock[ idx ];
+    // listening sockets first, then the pending TLS handshakes
+    size_t nbHandshakes=handshakes.size();
+    pfd.resize(nbServerSock + nbHandshakes);
+    for ( idx = 0; idx < nbServerSock; idx++ )
+    {
+      pfd[ idx ].fd = acceptor->sockets[ idx ];
       pfd[ idx ].events  = POLLIN;
       pfd[ idx ].revents = 0;
-  }
+    }
+    for ( idx = 0; idx < nbHandshakes; idx++ )
+    {
+      pfd[ nbServerSock + idx ].fd = handshakes[ idx ].client->socketId;
+      pfd[ nbServerSock + idx ].events  = handshakes[ idx ].events;
+      pfd[ nbServerSock + idx ].revents = 0;
+    }
 
-  for (;!exiting;)
-  {
     do
     {
     #ifdef __darwin__
-      status = poll( pfd, nbServerSock, 500 );
+      status = poll( &pfd[0], pfd.size(), 500 );
     #else
-      status = poll( pfd, nbServerSock, -1 );
+      status = poll( &pfd[0], pfd.size(), nbHandshakes ? 1000 : -1 );
     #endif
     }
     while ( ( status < 0 ) && ( errno == EINTR ) && !exiting );
@@ -1314,74 +2037,195 @@ void WebServer::threadProcessing()
     {
       if ( !(pfd[idx].revents & POLLIN) )
               continue;
-      client_sock = accept(pfd[idx].fd,
-                       (struct sockaddr*)&clientAddress, &clientAddressLength);
-
-      IpAddress webClientAddr;
 
-      if ( clientAddress.ss_family == AF_INET )
+      for ( size_t nbAccepted = 0; nbAccepted < ACCEPT_BATCH_MAX && !exiting; nbAccepted++ )
       {
-        webClientAddr.ipversion=4;
-        webClientAddr.ip.v4=((struct sockaddr_in *)&clientAddress)->sin_addr.s_addr;
-      }
+        client_sock = acceptClient(pfd[idx].fd, &clientAddress);
 
-      if ( clientAddress.ss_family == AF_INET6 )
-      {
-        webClientAddr.ipversion=6;
-        webClientAddr.ip.v6=((struct sockaddr_in6 *)&clientAddress)->sin6_addr;
-      }
+        if (client_sock == -1)
+        {
+          if ( !exiting && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED )
+            NVJ_LOG->appendUniq(NVJ_ERROR, "WebServer : An error occurred when attempting to access the socket (accept == -1)");
+          break;
+        }
+
+        IpAddress webClientAddr;
 
-      if (exiting) { close(pfd[idx].fd); break; };
+        if ( clientAddress.ss_family == AF_INET )
+        {
+          webClientAddr.ipversion=4;
+          webClientAddr.ip.v4=((struct sockaddr_in *)&clientAddress)->sin_addr.s_addr;
+        }
 
-      if ( hostsAllowed.size()
-        && !isIpBelongToIpNetwork(webClientAddr, hostsAllowed ) )
+        if ( clientAddress.ss_family == AF_INET6 )
         {
-          shutdown (client_sock, SHUT_RDWR);
+          webClientAddr.ipversion=6;
+          webClientAddr.ip.v6=((struct sockaddr_in6 *)&clientAddress)->sin6_addr;
+        }
+
+        if ( ( !hostsAllowed.empty() && !hostsAllowed.contains(webClientAddr) )
+          || ( !hostsDenied.empty() && hostsDenied.contains(webClientAddr) ) )
+          {
+            shutdown (client_sock, SHUT_RDWR);
+            close(client_sock);
+            continue;
+          }
+
+        if ( !connections.acquire(webClientAddr) )
+        {
+          NVJ_LOG->appendUniq(NVJ_WARNING, "WebServer : connections limit reached, connection refused");
           close(client_sock);
           continue;
         }
 
-      //
+        //
 
-      updatePeerIpHistory(webClientAddr);
-      if (client_sock == -1)
-        NVJ_LOG->appendUniq(NVJ_ERROR, "WebServer : An error occurred when attempting to access the socket (accept == -1)");
-      else
-      {
-        setSocketRcvTimeout(client_sock, 1);
+        updatePeerIpHistory(webClientAddr);
+
+        // the read deadlines replace the socket timeout
         ClientSockData* client=(ClientSockData*)malloc(sizeof(ClientSockData));
         client->socketId=client_sock;
         client->ip=webClientAddr;
         client->ssl=NULL;
         client->bio=NULL;
         client->peerDN=NULL;
-        pthread_mutex_lock( &clientsQueue_mutex );
-        clientsQueue.push(client);
-        pthread_mutex_unlock( &clientsQueue_mutex );
-        pthread_cond_signal (& clientsQueue_cond);
+        client->webSocketClient=NULL;
+        client->requestBuffer=NULL;
+        client->compression=NONE;
+        ConnectionManager::initTimer(client->timer, client_sock);
 
+        if (!sslEnabled)
+        {
+          pushClient(client);
+          continue;
+        }
+
+        if (handshakes.size() >= TLS_HANDSHAKES_MAX || !startTlsHandshake(client))
+        {
+          freeClientSockData(client);
+          continue;
+        }
+
+        TlsHandshake handshake;
+        handshake.client=client;
+        handshake.events=POLLIN;
+        handshake.deadline=time(NULL)+TLS_HANDSHAKE_TIMEOUT;
+        handshakes.push_back(handshake);
       }
+    }
+
+    // Go on with the TLS handshakes which are ready, or just started
+    time_t now=time(NULL);
+    for ( idx = 0; idx < handshakes.size() && !exiting; )
+    {
+      int res=0;
+      if ( idx >= nbHandshakes || pfd[ nbServerSock + idx ].revents )
+        res=continueTlsHandshake(handshakes[ idx ]);
 
+      if ( res == 0 && handshakes[ idx ].deadline > now )
+      {
+        idx++;
+        continue;
+      }
+
+      if ( res == 1 )
+        pushClient(handshakes[ idx ].client);
+      else
+        freeClientSockData(handshakes[ idx ].client);
+
+      // keep the pfd indexes of the remaining handshakes unchanged
+      handshakes[ idx ].client=NULL;
+      idx++;
     }
+
+    size_t n=0;
+    for ( idx = 0; idx < handshakes.size(); idx++ )
+      if ( handshakes[ idx ].client != NULL )
+        handshakes[ n++ ] = handshakes[ idx ];
+    handshakes.resize(n);
   }
 
-  while (exitedThread != threadsPoolSize)
+  for ( idx = 0; idx < handshakes.size(); idx++ )
+    freeClientSockData(handshakes[ idx ].client);
+}
+
+
+void WebServer::threadProcessing()
+{
+  exiting=false;
+
+  ushort port=init();
+
+  initPoolThreads();
+  connections.start();
+  httpdAuth = authLoginPwdList.size() || isAuthPam() ;
+  authCache.setup(authCacheSize, authAllowedTimeout, authDeniedTimeout);
+
+  if (isAuthPam())
   {
-    pthread_cond_broadcast (& clientsQueue_cond);
-    usleep(500);
+#if defined(LINUX) || defined(__darwin__)
+          AuthPAM::start();
+          pamVerifications=new AuthPAMVerifications();
+#else
+          NVJ_LOG->appendUniq(NVJ_ERROR, "WebServer : WARNING authPAM will be ignored on your system");
+#endif
   }
 
-  // Exiting...
-  free (pfd);
+  char buf[300]; snprintf(buf, 300, "WebServer : Listen on port %d", port);
+  NVJ_LOG->append(NVJ_INFO,buf);
+
+  // this thread is the first acceptor
+  size_t idx;
+  for ( idx = 1; idx < acceptors.size(); idx++ )
+    create_thread( &acceptors[ idx ]->thread, WebServer::startAcceptorThread, static_cast<void *>(acceptors[ idx ]) );
+  acceptorProcessing(acceptors[ 0 ]);
+
+  for ( idx = 1; idx < acceptors.size(); idx++ )
+    wait_for_thread( acceptors[ idx ]->thread );
+  for ( idx = 0; idx < acceptors.size(); idx++ )
+    delete acceptors[ idx ];
+  acceptors.clear();
 
+  stopPoolThreads();
+  connections.stop();
+
+  // the clients not processed
+  ClientSockData *client;
+  for (idx = 0; idx < poolThreads.size(); idx++)
+  {
+    while (poolThreads[idx]->queue.pop(client))
+      freeClientSockData(client);
+    delete poolThreads[idx];
+  }
+  poolThreads.clear();
+  while (!clientsQueue.empty())
+  {
+    freeClientSockData(clientsQueue.front());
+    clientsQueue.pop();
+  }
+  clientsQueueSize=0;
+
+  // Exiting...
   if (sslEnabled)
+  {
     SSL_CTX_free(sslCtx);
+    delete sslSessionCache;
+    sslSessionCache=NULL;
+  }
 
   pthread_mutex_destroy(&clientsQueue_mutex);
+  pthread_mutex_destroy(&poolThreads_mutex);
 
 #if defined(LINUX) || defined(__darwin__)
   if (isAuthPam())
+  {
+    if (pamVerifications != NULL)
+    {
+      delete pamVerifications;
+      pamVerifications=NULL;
+    }
     AuthPAM::stop();
+  }
 #endif
 
 }
@@ -1405,123 +2249,113 @@ void WebServer::closeSocket(ClientSockData* client)
 }
 
 /***********************************************************************
-* base64_decode & base64_encode
-  thanks to  René Nyffenegger rene.nyffenegger@adp-gmbh.ch for his
-  public implementation of this algorithm
-*
+* base64_decode: decode up to the first '=' or non base64 character
+* @param in - the base64 string
+* @param len - its length
+* @param out - the decoded bytes, BASE64_DECODED_MAX_LENGTH(len) at most
+* \return the number of decoded bytes
 ************************************************************************/
-nw::string WebServer::base64_decode(const nw::string& encoded_string)
+size_t WebServer::base64_decode(const char *in, const size_t len, unsigned char *out)
 {
+  const unsigned char *s=(const unsigned char*)in;
+  unsigned char *p=out;
+  size_t i=0;
 
-  int in_len = encoded_string.size();
-  int i = 0;
-  int j = 0;
-  int in_ = 0;
-  unsigned char char_array_4[4], char_array_3[3];
-  nw::string ret;
-
-  while (in_len-- && ( encoded_string[in_] != '=') && is_base64(encoded_string[in_]))
+  for (; i + 4 <= len; i+=4)
   {
-    char_array_4[i++] = encoded_string[in_]; in_++;
-    if (i ==4) {
-      for (i = 0; i <4; i++)
-        char_array_4[i] = base64_chars.find(char_array_4[i]);
-
-      char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-      char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-      char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
-
-      for (i = 0; (i < 3); i++)
-        ret += (char)char_array_3[i];
-      i = 0;
-    }
+    int a=base64_values[s[i]], b=base64_values[s[i+1]], c=base64_values[s[i+2]], d=base64_values[s[i+3]];
+    if ((a | b | c | d) < 0)
+      break;
+    u_int32_t n=(a << 18) | (b << 12) | (c << 6) | d;
+    *p++=n >> 16;
+    *p++=n >> 8;
+    *p++=n;
   }
 
-  if (i)
+  // the last characters
+  u_int32_t n=0;
+  size_t nbChars=0;
+  for (; i < len && nbChars < 3 && base64_values[s[i]] >= 0; i++, nbChars++)
+    n=(n << 6) | base64_values[s[i]];
+  if (nbChars == 3)
   {
-    for (j = i; j <4; j++)
-      char_array_4[j] = 0;
-
-    for (j = 0; j <4; j++)
-      char_array_4[j] = base64_chars.find(char_array_4[j]);
-
-    char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-    char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-    char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
-
-    for (j = 0; (j < i - 1); j++) ret += (char)char_array_3[j];
+    *p++=n >> 10;
+    *p++=n >> 2;
   }
+  else if (nbChars == 2)
+    *p++=n >> 4;
 
-  return ret;
+  return p-out;
 }
 
-nw::string WebServer::base64_encode(unsigned char const* bytes_to_encode, unsigned int in_len)
+/**********************************************************************/
+
+nw::string WebServer::base64_decode(const nw::string& encoded_string)
 {
   nw::string ret;
-  int i = 0;
-  int j = 0;
-  unsigned char char_array_3[3];
-  unsigned char char_array_4[4];
-
-  while (in_len--) {
-    char_array_3[i++] = *(bytes_to_encode++);
-    if (i == 3) {
-      char_array_4[0] = (char_array_3[0] & 0xfc) >> 2;
-      char_array_4[1] = ((char_array_3[0] & 0x03) << 4) + ((char_array_3[1] & 0xf0) >> 4);
-      char_array_4[2] = ((char_array_3[1] & 0x0f) << 2) + ((char_array_3[2] & 0xc0) >> 6);
-      char_array_4[3] = char_array_3[2] & 0x3f;
-
-      for(i = 0; (i <4) ; i++)
-        ret += base64_chars[char_array_4[i]];
-      i = 0;
-    }
-  }
-
-  if (i)
-  {
-    for(j = i; j < 3; j++)
-      char_array_3[j] = '\0';
-
-    char_array_4[0] = (char_array_3[0] & 0xfc) >> 2;
-    char_array_4[1] = ((char_array_3[0] & 0x03) << 4) + ((char_array_3[1] & 0xf0) >> 4);
-    char_array_4[2] = ((char_array_3[1] & 0x0f) << 2) + ((char_array_3[2] & 0xc0) >> 6);
-    char_array_4[3] = char_array_3[2] & 0x3f;
-
-    for (j = 0; (j < i + 1); j++)
-      ret += base64_chars[char_array_4[j]];
-
-    while((i++ < 3))
-      ret += '=';
-
-  }
+  ret.resize(BASE64_DECODED_MAX_LENGTH(encoded_string.size()));
+  if (ret.size())
+    ret.resize(base64_decode(encoded_string.data(), encoded_string.size(), (unsigned char*)&ret[0]));
   return ret;
 }
 
 /***********************************************************************
-* SHA1_encode: Generate the SHA1 encoding
-* @param input - the string to encode
-* \return the encoded string
+* base64_encode
+* @param in - the bytes to encode
+* @param len - their number
+* @param out - the base64 string, BASE64_ENCODED_LENGTH(len) characters
+*   and a terminating '\0'
+* \return the length of the base64 string
 ************************************************************************/
-nw::string WebServer::SHA1_encode(const nw::string& input)
+size_t WebServer::base64_encode(const unsigned char *in, const size_t len, char *out)
 {
-    nw::string hash;
-    SHA_CTX context;
-    SHA1_Init(&context);
-    SHA1_Update(&context, &input[0], input.size());
-    hash.resize(160/8);
-    SHA1_Final((unsigned char*)&hash[0], &context);
-    return hash;
+  char *p=out;
+  size_t i=0;
+
+  for (; i + 3 <= len; i+=3)
+  {
+    u_int32_t n=(in[i] << 16) | (in[i+1] << 8) | in[i+2];
+    *p++=base64_chars[n >> 18];
+    *p++=base64_chars[(n >> 12) & 0x3f];
+    *p++=base64_chars[(n >> 6) & 0x3f];
+    *p++=base64_chars[n & 0x3f];
+  }
+
+  if (i < len)
+  {
+    u_int32_t n=in[i] << 16;
+    if (i + 1 < len) n|=in[i+1] << 8;
+    *p++=base64_chars[n >> 18];
+    *p++=base64_chars[(n >> 12) & 0x3f];
+    *p++=i + 1 < len ? base64_chars[(n >> 6) & 0x3f] : '=';
+    *p++='=';
+  }
+
+  *p='\0';
+  return p-out;
 }
 
 /***********************************************************************
-* generateWebSocketServerKey: Generate the websocket server key
+* generateWebSocketServerKey: Generate the websocket server key, the
+*   base64 SHA-1 of the client key and the websocket GUID
 * @param webSocketKey - the websocket client key.
-* \return the websocket server key
+* @param serverKey - set to the server key (WEBSOCKET_SERVER_KEY_LENGTH+1 characters)
+* \return false if the client key is longer than WEBSOCKET_CLIENT_KEY_MAX
 ************************************************************************/
-nw::string WebServer::generateWebSocketServerKey(nw::string webSocketKey)
+bool WebServer::generateWebSocketServerKey(const char *webSocketKey, char *serverKey)
 {
-  nw::string sha1Key=SHA1_encode(webSocketKey+webSocketMagicString);
-  return base64_encode(reinterpret_cast<const unsigned char*>(sha1Key.c_str()), sha1Key.length());
+  unsigned char input[WEBSOCKET_CLIENT_KEY_MAX + sizeof webSocketMagicString];
+  unsigned char sha1[SHA_DIGEST_LENGTH];
+
+  size_t keyLength=strlen(webSocketKey);
+  if (keyLength > WEBSOCKET_CLIENT_KEY_MAX)
+    return false;
+
+  memcpy(input, webSocketKey, keyLength);
+  memcpy(input + keyLength, webSocketMagicString, sizeof webSocketMagicString - 1);
+  SHA1(input, keyLength + sizeof webSocketMagicString - 1, sha1);
+  base64_encode(sha1, sizeof sha1, serverKey);
+  return true;
 }
 
 /***********************************************************************
@@ -1530,31 +2364,27 @@ nw::string WebServer::generateWebSocketServerKey(nw::string webSocketKey)
 * \return the header
 ***********************************************************************/
 
-nw::string WebServer::getHttpWebSocketHeader(const char *messageType, const char* webSocketClientKey, const bool webSocketDeflate)
+nw::string WebServer::getHttpWebSocketHeader(const HttpStatus status, const char* webSocketClientKey, const bool webSocketDeflate)
 {
-  char timeBuf[200];
-  time_t rawtime;
-  struct tm timeinfo;
-
-  nw::string header="HTTP/1.1 "+nw::string(messageType)+nw::string("\r\n");
-  header+="Upgrade: websocket\r\n";
-  header+="Connection: Upgrade\r\n";
-
-  time ( &rawtime );
-  gmtime_r ( &rawtime, &timeinfo );
-  strftime (timeBuf,200,"Date: %a, %d %b %Y %H:%M:%S GMT", &timeinfo);
-  header+=nw::string(timeBuf)+"\r\n";
-
-  header+=webServerName+"\r\n";
-
-  header+="Sec-WebSocket-Accept: "+generateWebSocketServerKey(webSocketClientKey)+"\r\n";
+  char buf[HTTP_RESPONSE_HEADER_SIZE];
+  HttpResponseHeader header(buf, sizeof buf);
+
+  header.appendStatusLine(status);
+  header.appendConstant("Upgrade: websocket\r\nConnection: Upgrade\r\n");
+  header.appendDate();
+  header.append(webServerName);
+  header.appendConstant("\r\nSec-WebSocket-Accept: ");
+  char serverKey[WEBSOCKET_SERVER_KEY_LENGTH+1];
+  if (generateWebSocketServerKey(webSocketClientKey, serverKey))
+    header.append(serverKey, WEBSOCKET_SERVER_KEY_LENGTH);
+  header.appendConstant("\r\n");
 
   if (webSocketDeflate)
-    header+="Sec-WebSocket-Extensions: permessage-deflate\r\n"; //x-webkit-deflate-frame
+    header.appendConstant("Sec-WebSocket-Extensions: permessage-deflate\r\n"); //x-webkit-deflate-frame
 
-  header+= "\r\n";
+  header.appendConstant("\r\n");
 
-  return header;
+  return nw::string(buf, header.getLength() < sizeof buf ? header.getLength() : sizeof buf);
 }
 
 /***********************************************************************/
@@ -1589,8 +2419,6 @@ void WebServer::listenWebSocket(WebSocket *websocket, HttpRequest* request)
   webSocketClientList.push_back(client->socketId);
   pthread_mutex_unlock(&webSocketClientList_mutex);
 
-  websocket->addNewClient(request);
-
   bool fin=false;
   unsigned char rsv=0, opcode=0;
   u_int64_t readLength=1;
@@ -1612,19 +2440,33 @@ void WebServer::listenWebSocket(WebSocket *websocket, HttpRequest* request)
 
     do
     {
+      // the queued frames are written by this thread, while it waits
+      if (!client->webSocketClient->waitForData())
+      {
+        closing=true;
+        continue;
+      }
+
       if (client->bio != NULL && client->ssl != NULL)
       {
           n=BIO_read(client->bio, bufferRecv+it, length-it);
 
           if (SSL_get_error(client->ssl,n) == SSL_ERROR_ZERO_RETURN)
             closing=true;
+          if ( n <= 0 )
+          {
+            if (!BIO_should_retry(client->bio))
+              closing=true;
+            continue;
+          }
       }
       else
       {
         n=recv(client->socketId, bufferRecv+it, length-it, 0);
         if ( n <= 0 )
         {
-          if ( errno==ENOTCONN || errno==EBADF || errno==ECONNRESET )
+          // closed by the client, or the read deadline expired
+          if ( n == 0 || errno==ENOTCONN || errno==EBADF || errno==ECONNRESET )
             closing=true;
           continue;
         }
@@ -1645,6 +2487,8 @@ void WebServer::listenWebSocket(WebSocket *websocket, HttpRequest* request)
         rsv=(bufferRecv[0] & 0x70) >> 4;
         opcode=bufferRecv[0] & 0xf;
 
+        // the rest of the frame must be received in time
+        connections.setDeadline(client->timer, requestBodyTimeout);
         step=LENGTH;
         readLength=1;
         break;
@@ -1789,6 +2633,7 @@ void WebServer::listenWebSocket(WebSocket *websocket, HttpRequest* request)
           msgContent=NULL;
           readLength=1;
           step=FIRSTBYTE;
+          connections.cancelDeadline(client->timer);
         }
         break;
     }
@@ -1798,13 +2643,15 @@ void WebServer::listenWebSocket(WebSocket *websocket, HttpRequest* request)
 
   websocket->removeClient(request);
 
+  // flush the outbound queue
+  delete client->webSocketClient;
+
   delete request;
-  freeClientSockData(client);
-  webSocketClientList.push_back(client->socketId);
   pthread_mutex_lock(&webSocketClientList_mutex);
   nw::list<int>::iterator it = nw::find(webSocketClientList.begin(), webSocketClientList.end(), client->socketId);
   if (it != webSocketClientList.end()) webSocketClientList.erase(it);
   pthread_mutex_unlock(&webSocketClientList_mutex);
+  freeClientSockData(client);
 }
 
 /***********************************************************************/
@@ -1813,68 +2660,16 @@ void WebServer::webSocketSend(HttpRequest* request, const u_int8_t opcode, const
 {
   ClientSockData* client = request->getClientSockData();
 
-  unsigned char headerBuffer[10]; // 10 is the max header size
-  size_t headerLen=2; // default header size
-  unsigned char *msg = NULL;
-  size_t msgLen=0;
+  WebSocketFrame *frame=WebSocketFrame::create(opcode, message, length, fin, client->compression == ZLIB);
+  if (frame == NULL)
+    return;
 
-  headerBuffer[0]= 0x80 | (opcode & 0xf) ; // FIN & OPCODE:0x1
-  if (client->compression == ZLIB)
-  {
-    headerBuffer[0] |= 0x40; // Set RSV1
-    try
-    {
-      msgLen=nvj_gzip( &msg, message, length, true );
-    }
-    catch(...)
-    {
-      NVJ_LOG->append(NVJ_ERROR, " Websocket: nvj_gzip raised an exception");
-      return;
-    }
-  }
+  if (client->webSocketClient != NULL)
+    client->webSocketClient->send(frame);
   else
-  {
-    msg=(unsigned char*)message;
-    msgLen=length;
-  }
-
-
-  if (msgLen < 126)
-    headerBuffer[1]=msgLen;
-  else
-  {
-    if (msgLen < 0xFFFF)
-    {
-      headerBuffer[1]=126;
-      *(u_int16_t*)(headerBuffer+2)=htons((u_int16_t)msgLen);
-      headerLen+=2;
-    }
-    else
-    {
-      headerBuffer[1]=127;
-      *(u_int64_t*)(headerBuffer+2)=htonll((u_int64_t)msgLen);
-      headerLen+=8;
-    }
-  }
-
-  if (client->bio != NULL && client->ssl != NULL)
-  {
-    if ( (BIO_write(client->bio, headerBuffer, headerLen) <=0 ) || (BIO_write(client->bio,  msg, msgLen) <=0 ) )
-    {
-      freeClientSockData(client);
-    }
-  }
-  else
-  {
-    if ( (send(client->socketId, headerBuffer, headerLen, 0) < 0) || ( msgLen && (send(client->socketId, msg, msgLen, 0) < 0) ) )
-    {
-      freeClientSockData(client);
-    }
-  }
-
+    WebSocketClient::writeFrame(client, frame);
 
-  if (client->compression == ZLIB)
-    free (msg);
+  frame->release();
 }
 
 /***********************************************************************/
@@ -0,0 +1,439 @@
+//********************************************************
+/**
+ * @file  WebSocketClient.cc
+ *
+ * @brief Websocket client connection and its outbound frames queue
+ *
+ * @author agent (agent@local)
+ *
+ * @version 1
+ * @date 19/10/26
+ */
+//********************************************************
+
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include "libnavajo/LogRecorder.hh"
+#include "libnavajo/WebSocket.hh"
+#include "libnavajo/WebSocketClient.hh"
+#include "libnavajo/htonll.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/***********************************************************************
+* create: encode a new websocket frame
+* @param opcode - the frame opcode
+* @param message - the payload
+* @param length - the payload length
+* @param deflate - compress the payload (permessage-deflate)
+* \return the new frame (refCount=1), or NULL
+***********************************************************************/
+
+WebSocketFrame* WebSocketFrame::create(const u_int8_t opcode, const unsigned char* message, size_t length, bool fin, bool deflate)
+{
+  unsigned char headerBuffer[10]; // 10 is the max header size
+  size_t headerLen=2; // default header size
+  unsigned char *msg = NULL;
+  size_t msgLen=0;
+
+  headerBuffer[0]= 0x80 | (opcode & 0xf) ; // FIN & OPCODE:0x1
+  if (deflate)
+  {
+    headerBuffer[0] |= 0x40; // Set RSV1
+    try
+    {
+      msgLen=nvj_gzip( &msg, message, length, true );
+    }
+    catch(...)
+    {
+      NVJ_LOG->append(NVJ_ERROR, " Websocket: nvj_gzip raised an exception");
+      return NULL;
+    }
+  }
+  else
+  {
+    msg=(unsigned char*)message;
+    msgLen=length;
+  }
+
+  if (msgLen < 126)
+    headerBuffer[1]=msgLen;
+  else
+  {
+    if (msgLen < 0xFFFF)
+    {
+      headerBuffer[1]=126;
+      *(u_int16_t*)(headerBuffer+2)=htons((u_int16_t)msgLen);
+      headerLen+=2;
+    }
+    else
+    {
+      headerBuffer[1]=127;
+      *(u_int64_t*)(headerBuffer+2)=htonll((u_int64_t)msgLen);
+      headerLen+=8;
+    }
+  }
+
+  unsigned char *data=(unsigned char*)malloc(headerLen+msgLen);
+  if (data != NULL)
+  {
+    memcpy(data, headerBuffer, headerLen);
+    if (msgLen) memcpy(data+headerLen, msg, msgLen);
+  }
+
+  if (deflate)
+    free (msg);
+
+  if (data == NULL)
+  {
+    NVJ_LOG->append(NVJ_ERROR, " Websocket: frame allocation failed");
+    return NULL;
+  }
+
+  return new WebSocketFrame(data, headerLen+msgLen, (opcode & 0x8) != 0);
+}
+
+/***********************************************************************/
+
+WebSocketClient::WebSocketClient(WebSocket *ws, HttpRequest *req): websocket(ws), request(req)
+{
+  client=request->getClientSockData();
+  queuedBytes=0;
+  highWatermarkReached=false;
+  overflowPending=false;
+  overflowQueuedBytes=0;
+  wakeupPending=false;
+  closing=false;
+  connectionThreadStarted=false;
+  pthread_mutex_init(&framesQueue_mutex, NULL);
+
+  if (pipe(wakeupPipe) == -1)
+  {
+    NVJ_LOG->append(NVJ_ERROR, nw::string("WebSocket: pipe error : ")+strerror(errno));
+    wakeupPipe[0]=wakeupPipe[1]=-1;
+    closing=true;
+  }
+  else
+    for (int i=0; i<2; i++)
+    {
+      fcntl(wakeupPipe[i], F_SETFD, FD_CLOEXEC);
+      fcntl(wakeupPipe[i], F_SETFL, O_NONBLOCK);
+    }
+
+  client->webSocketClient=this;
+}
+
+/***********************************************************************
+* ~WebSocketClient: the frames still queued are sent (by the connection's
+*  thread), without calling the callbacks.
+***********************************************************************/
+
+WebSocketClient::~WebSocketClient()
+{
+  struct timeval tv;
+  tv.tv_sec = 1; tv.tv_usec = 0;
+  setsockopt (client->socketId, SOL_SOCKET, SO_SNDTIMEO, (char *)&tv, sizeof tv);
+
+  pthread_mutex_lock(&framesQueue_mutex);
+  closing=true;
+  pthread_mutex_unlock(&framesQueue_mutex);
+
+  writeQueuedFrames(false);
+
+  dropQueuedFrames();
+  client->webSocketClient=NULL;
+  if (wakeupPipe[0] != -1)
+  {
+    ::close(wakeupPipe[0]);
+    ::close(wakeupPipe[1]);
+  }
+  pthread_mutex_destroy(&framesQueue_mutex);
+}
+
+/***********************************************************************/
+
+void WebSocketClient::dropQueuedFrames()
+{
+  pthread_mutex_lock(&framesQueue_mutex);
+  while (!framesQueue.empty())
+  {
+    framesQueue.front()->release();
+    framesQueue.pop_front();
+  }
+  queuedBytes=0;
+  pthread_mutex_unlock(&framesQueue_mutex);
+}
+
+/***********************************************************************
+* wakeup: wake the connection's thread up (framesQueue_mutex locked)
+***********************************************************************/
+
+void WebSocketClient::wakeup()
+{
+  if (wakeupPending || wakeupPipe[1] == -1)
+    return;
+  if (write(wakeupPipe[1], "", 1) == 1)
+    wakeupPending=true;
+}
+
+/***********************************************************************
+* send: push a frame in the outbound queue
+* @param frame - the frame, retained while it is queued
+* \return false if the frame has been discarded
+***********************************************************************/
+
+bool WebSocketClient::send(WebSocketFrame *frame)
+{
+  bool overflow=false;
+  size_t lowWatermark=websocket->getOutboundQueueLowWatermark();
+  size_t highWatermark=websocket->getOutboundQueueHighWatermark();
+  WebSocketOverflowPolicy policy=websocket->getOverflowPolicy();
+
+  pthread_mutex_lock(&framesQueue_mutex);
+
+  if (closing)
+  {
+    pthread_mutex_unlock(&framesQueue_mutex);
+    return false;
+  }
+
+  // the connection's thread writes its queue itself, rather than overflowing it
+  if (connectionThreadStarted && pthread_equal(connectionThread, pthread_self())
+      && queuedBytes + frame->getLength() > highWatermark)
+  {
+    pthread_mutex_unlock(&framesQueue_mutex);
+    writeQueuedFrames(false);
+    pthread_mutex_lock(&framesQueue_mutex);
+  }
+
+  // Control frames are never discarded
+  if (!frame->isCtrlFrame() && queuedBytes + frame->getLength() > highWatermark)
+  {
+    overflow=true;
+    if (!highWatermarkReached)
+    {
+      char buf[300]; snprintf(buf, 300, "WebSocket: outbound queue is full for host '%s' (%lu bytes pending)",
+                                        request->getPeerIpAddress().str().c_str(), (unsigned long)queuedBytes);
+      NVJ_LOG->append(NVJ_WARNING, buf);
+    }
+    highWatermarkReached=true;
+
+    // onQueueOverflow() is called by the connection's thread: the sender
+    //  may hold the websocket clients lock
+    overflowPending=true;
+    overflowQueuedBytes=queuedBytes;
+
+    switch (policy)
+    {
+      case WS_OVERFLOW_COALESCE:
+        for (nw::list<WebSocketFrame*>::iterator it=framesQueue.begin();
+             it != framesQueue.end() && queuedBytes + frame->getLength() > lowWatermark; )
+        {
+          if ((*it)->isCtrlFrame()) { it++; continue; }
+          queuedBytes-=(*it)->getLength();
+          (*it)->release();
+          it=framesQueue.erase(it);
+        }
+        overflow=false;
+        break;
+
+      case WS_OVERFLOW_CLOSE:
+        closing=true;
+        shutdown (client->socketId, SHUT_RDWR);
+        break;
+
+      case WS_OVERFLOW_DROP:
+      default:
+        break;
+    }
+  }
+
+  if (!overflow)
+  {
+    frame->retain();
+    framesQueue.push_back(frame);
+    queuedBytes+=frame->getLength();
+  }
+  wakeup();
+
+  pthread_mutex_unlock(&framesQueue_mutex);
+
+  return !overflow;
+}
+
+/***********************************************************************/
+
+void WebSocketClient::close()
+{
+  pthread_mutex_lock(&framesQueue_mutex);
+  closing=true;
+  shutdown (client->socketId, SHUT_RDWR);
+  pthread_mutex_unlock(&framesQueue_mutex);
+}
+
+/***********************************************************************/
+
+size_t WebSocketClient::getQueuedBytes()
+{
+  pthread_mutex_lock(&framesQueue_mutex);
+  size_t res=queuedBytes;
+  pthread_mutex_unlock(&framesQueue_mutex);
+  return res;
+}
+
+/***********************************************************************/
+
+size_t WebSocketClient::getQueueDepth()
+{
+  pthread_mutex_lock(&framesQueue_mutex);
+  size_t res=framesQueue.size();
+  pthread_mutex_unlock(&framesQueue_mutex);
+  return res;
+}
+
+/***********************************************************************
+* writeFrame: write a frame on the client socket
+* \return false if the connection is broken
+***********************************************************************/
+
+bool WebSocketClient::writeFrame(ClientSockData *client, const WebSocketFrame *frame)
+{
+  const unsigned char *data=frame->getData();
+  size_t len=frame->getLength();
+
+  if (client->bio != NULL && client->ssl != NULL)
+  {
+    while (BIO_write(client->bio, data, len) <= 0)
+      if (!BIO_should_retry(client->bio))
+        return false;
+    BIO_flush(client->bio);
+    return true;
+  }
+
+  while (len)
+  {
+    ssize_t n=::send(client->socketId, data, len, MSG_NOSIGNAL);
+    if (n < 0)
+    {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    data+=n; len-=n;
+  }
+  return true;
+}
+
+/***********************************************************************
+* writeQueuedFrames: write the queued frames (by the connection's thread)
+* @param notify - call onQueueOverflow() and onWritable()
+* \return false if the connection is broken
+***********************************************************************/
+
+bool WebSocketClient::writeQueuedFrames(const bool notify)
+{
+  pthread_mutex_lock(&framesQueue_mutex);
+
+  if (wakeupPending)
+  {
+    char c;
+    if (read(wakeupPipe[0], &c, 1) == 1)
+      wakeupPending=false;
+  }
+
+  for (;;)
+  {
+    if (overflowPending && notify)
+    {
+      size_t depth=overflowQueuedBytes;
+      overflowPending=false;
+      pthread_mutex_unlock(&framesQueue_mutex);
+      websocket->onQueueOverflow(request, depth);
+      pthread_mutex_lock(&framesQueue_mutex);
+      continue;
+    }
+
+    if (framesQueue.empty())
+      break;
+
+    WebSocketFrame *frame=framesQueue.front();
+    framesQueue.pop_front();
+    pthread_mutex_unlock(&framesQueue_mutex);
+
+    bool written=writeFrame(client, frame);
+
+    pthread_mutex_lock(&framesQueue_mutex);
+    queuedBytes-=frame->getLength();
+    frame->release();
+
+    if (!written)
+    {
+      closing=true;
+      shutdown (client->socketId, SHUT_RDWR);
+      pthread_mutex_unlock(&framesQueue_mutex);
+      return false;
+    }
+
+    if (highWatermarkReached && queuedBytes <= websocket->getOutboundQueueLowWatermark())
+    {
+      highWatermarkReached=false;
+      if (notify)
+      {
+        pthread_mutex_unlock(&framesQueue_mutex);
+        websocket->onWritable(request);
+        pthread_mutex_lock(&framesQueue_mutex);
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&framesQueue_mutex);
+  return true;
+}
+
+/**********************************************************************/
+
+bool WebSocketClient::waitForData()
+{
+  struct pollfd fds[2];
+  fds[0].fd=client->socketId;
+  fds[0].events=POLLIN;
+  fds[1].fd=wakeupPipe[0];
+  fds[1].events=POLLIN;
+
+  if (wakeupPipe[0] == -1)
+    return false;
+
+  if (!connectionThreadStarted)
+  {
+    pthread_mutex_lock(&framesQueue_mutex);
+    connectionThread=pthread_self();
+    connectionThreadStarted=true;
+    pthread_mutex_unlock(&framesQueue_mutex);
+  }
+
+  for (;;)
+  {
+    if (!writeQueuedFrames(true))
+      return false;
+
+    // the data already received (and decrypted) is read first
+    if (client->bio != NULL && BIO_pending(client->bio) > 0)
+      return true;
+
+    if (poll(fds, 2, -1) == -1)
+    {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    if (fds[0].revents)
+      return true;
+  }
+}
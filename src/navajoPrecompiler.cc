@@ -20,6 +20,8 @@
 #include <string>
 #include <algorithm>
 
+#include "libnavajo/MimeTypes.hh"
+
 void dump_buffer(FILE *f, unsigned n, const unsigned char* buf)
 {
   int cptLine = 0;
@@ -207,7 +209,16 @@ int main (int argc, char *argv[])
 
   for (size_t i = 0; i < filenamesVec.size(); i++)
   {
-    fprintf (stdout,"    indexMap.insert(IndexMap::value_type(\"%s\",PrecompiledRepository::WebStaticPage((const unsigned char*)&webRepository::%s, sizeof webRepository::%s)));\n", (*(conversionTable+i)).URL->c_str(), (*(conversionTable+i)).varName->c_str(), (*(conversionTable+i)).varName->c_str() );
+    // the mime type of the url (a compressed file is served for the url without ".gz")
+    std::string url = *(*(conversionTable+i)).URL;
+    if (url.size() > 3 && url.compare(url.size() - 3, 3, ".gz") == 0)
+      url.erase(url.size() - 3);
+    const MimeType *mime = MimeTypes::findByName(url.c_str());
+
+    if (mime != NULL)
+      fprintf (stdout,"    indexMap.insert(IndexMap::value_type(\"%s\",PrecompiledRepository::WebStaticPage((const unsigned char*)&webRepository::%s, sizeof webRepository::%s, \"%s\", %lu)));\n", (*(conversionTable+i)).URL->c_str(), (*(conversionTable+i)).varName->c_str(), (*(conversionTable+i)).varName->c_str(), mime->type, (unsigned long)mime->length );
+    else
+      fprintf (stdout,"    indexMap.insert(IndexMap::value_type(\"%s\",PrecompiledRepository::WebStaticPage((const unsigned char*)&webRepository::%s, sizeof webRepository::%s)));\n", (*(conversionTable+i)).URL->c_str(), (*(conversionTable+i)).varName->c_str(), (*(conversionTable+i)).varName->c_str() );
     delete (*(conversionTable+i)).URL;
     delete (*(conversionTable+i)).varName;
   }